@@ -0,0 +1,683 @@
+// Before the renderer headers for the same reason as <filesystem> in bvh_cache.cpp
+#include <filesystem>
+#include "../renderer/raycaster/geometry.h"
+#include "../renderer/raycaster/ray_packet.h"
+#include "../renderer/raycaster/hittable/object.h"
+#include "../renderer/scene.h"
+#include "../renderer/raycaster/caster.h"
+#include "../renderer/raycaster/accelerator/build_settings.h"
+#include "../math/ray.h"
+#include "../thread/topology.h"
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Self checks of the renderer's kernels and builders against simple references, registered with CTest.
+// Usage: liquid_checks <name>, every check is deterministic and returns 0 when it passes.
+
+struct CheckRandom
+{
+    u64 state = 0x9E3779B97F4A7C15ull;
+
+    f32 next(f32 min, f32 max)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return min + (max - min) * (f32)(state >> 40) / 16777216.0f;
+    }
+
+    Vector3 nextUnit()
+    {
+        while(true)
+        {
+            Vector3 v(next(-1, 1), next(-1, 1), next(-1, 1));
+            f32 l = Vector3::Dot(v, v);
+            if(l > 0.01f && l <= 1.0f) return v / sqrtf(l);
+        }
+    }
+};
+
+// The mesh loader only reads files, checks write their meshes next to the other temporaries
+struct CheckMesh
+{
+    std::vector<Vector3> vertices;
+    std::vector<u32> indices; // 3 per triangle
+
+    std::string write(const std::string& name) const
+    {
+        std::string path = (std::filesystem::temp_directory_path() / ("liquid_check_" + name + ".obj")).string();
+        std::ofstream f(path);
+        char line[128];
+        for(const Vector3& v : vertices)
+        {
+            snprintf(line, sizeof(line), "v %.9g %.9g %.9g\n", v.x, v.y, v.z); // Round trips every float
+            f << line;
+        }
+        f << "vt 0 0\nvn 0 0 1\n";
+        for(size_t i = 0; i < indices.size(); i += 3)
+            f << "f " << indices[i] + 1 << "/1/1 " << indices[i + 1] + 1 << "/1/1 " << indices[i + 2] + 1 << "/1/1\n";
+        return path;
+    }
+};
+
+internal TriangleMesh* LoadCheckMesh(const std::string& path, BVHLayout layout, u32 blockWidth)
+{
+    BVHBuildSettings settings;
+    settings.layout = layout;
+    settings.triangleBlockWidth = blockWidth;
+    settings.cache = false;
+    return TriangleMesh::CreateMeshFromFile(path, settings);
+}
+
+// Surface of a cube split into n x n quads per face, two triangles each. Vertices on the face borders are
+// shared (a closed, watertight mesh) and jittered so no face is axis aligned.
+internal CheckMesh JitteredCube(i32 n, CheckRandom* rng)
+{
+    CheckMesh mesh;
+    std::map<std::tuple<i32, i32, i32>, u32> lattice;
+    auto vertex = [&](i32 x, i32 y, i32 z) -> u32 {
+        auto it = lattice.find({ x, y, z });
+        if(it != lattice.end()) return it->second;
+        f32 j = 0.3f / n;
+        mesh.vertices.push_back(Vector3(2.0f * x / n - 1.0f + rng->next(-j, j),
+                                        2.0f * y / n - 1.0f + rng->next(-j, j),
+                                        2.0f * z / n - 1.0f + rng->next(-j, j)));
+        lattice[{ x, y, z }] = (u32)mesh.vertices.size() - 1;
+        return (u32)mesh.vertices.size() - 1;
+    };
+
+    for(i32 axis = 0; axis < 3; axis++)
+    {
+        for(i32 side = 0; side <= n; side += n)
+        {
+            for(i32 a = 0; a < n; a++)
+            {
+                for(i32 b = 0; b < n; b++)
+                {
+                    u32 q[4];
+                    const i32 corners[4][2] = { { a, b }, { a + 1, b }, { a + 1, b + 1 }, { a, b + 1 } };
+                    for(i32 c = 0; c < 4; c++)
+                    {
+                        i32 p[3];
+                        p[axis] = side;
+                        p[(axis + 1) % 3] = corners[c][0];
+                        p[(axis + 2) % 3] = corners[c][1];
+                        q[c] = vertex(p[0], p[1], p[2]);
+                    }
+                    mesh.indices.insert(mesh.indices.end(), { q[0], q[1], q[2], q[0], q[2], q[3] });
+                }
+            }
+        }
+    }
+    return mesh;
+}
+
+// The same watertight test as the triangle blocks, in double precision over every triangle
+internal bool ReferenceClosestHit(const TriangleMesh* mesh, const Ray& r, f64 tmin, f64 tmax, f64* t)
+{
+    const Vector3& d = r.direction;
+    f32 ax = fabsf(d.x), ay = fabsf(d.y), az = fabsf(d.z);
+    i32 kz = (ax > ay) ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+    i32 kx = (kz + 1) % 3;
+    i32 ky = (kx + 1) % 3;
+    if(d.data[kz] < 0.0f) std::swap(kx, ky);
+    const f64 sx = (f64)d.data[kx] / d.data[kz];
+    const f64 sy = (f64)d.data[ky] / d.data[kz];
+    const f64 sz = 1.0 / d.data[kz];
+
+    bool hit = false;
+    for(u64 i = 0; i < mesh->triangleCount; i++)
+    {
+        f64 x[3], y[3], z[3];
+        for(u32 v = 0; v < 3; v++)
+        {
+            const Vector3& p = mesh->vertices[mesh->triangles[i].indicesVertex[v]];
+            f64 pz = (f64)p.data[kz] - r.origin.data[kz];
+            x[v] = ((f64)p.data[kx] - r.origin.data[kx]) - sx * pz;
+            y[v] = ((f64)p.data[ky] - r.origin.data[ky]) - sy * pz;
+            z[v] = sz * pz;
+        }
+        f64 U = x[2] * y[1] - y[2] * x[1];
+        f64 V = x[0] * y[2] - y[0] * x[2];
+        f64 W = x[1] * y[0] - y[1] * x[0];
+        if((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) continue;
+        f64 det = U + V + W;
+        if(det == 0.0) continue;
+        f64 dist = (U * z[0] + V * z[1] + W * z[2]) / det;
+        if(dist >= tmin && dist < tmax)
+        {
+            tmax = dist;
+            hit = true;
+        }
+    }
+    *t = tmax;
+    return hit;
+}
+
+// Triangle blocks (every layout, 4 and 8 wide) against the double precision reference on a triangle soup,
+// then rays aimed exactly at the shared vertices and edges of a closed mesh, which must never slip through
+internal bool CheckWatertight()
+{
+    CheckRandom rng;
+    u32 failures = 0;
+
+    CheckMesh soup;
+    for(u32 i = 0; i < 2000; i++)
+    {
+        Vector3 c(rng.next(-10, 10), rng.next(-10, 10), rng.next(-10, 10));
+        for(u32 v = 0; v < 3; v++)
+        {
+            soup.vertices.push_back(c + Vector3(rng.next(-1.5f, 1.5f), rng.next(-1.5f, 1.5f), rng.next(-1.5f, 1.5f)));
+            soup.indices.push_back(3 * i + v);
+        }
+    }
+    std::vector<Ray> rays(20000);
+    std::vector<f32> tmins(rays.size());
+    for(size_t i = 0; i < rays.size(); i++)
+    {
+        rays[i].origin = Vector3(rng.next(-12, 12), rng.next(-12, 12), rng.next(-12, 12));
+        rays[i].direction = rng.nextUnit();
+        tmins[i] = i % 2 ? rng.next(0.0f, 5.0f) : 0.0f;
+    }
+
+    const std::string soupPath = soup.write("soup");
+    TriangleMesh* reference = LoadCheckMesh(soupPath, BVHLayout::FLAT, 0);
+    std::vector<char> refHit(rays.size());
+    std::vector<f64> refT(rays.size());
+    for(size_t i = 0; i < rays.size(); i++)
+        refHit[i] = ReferenceClosestHit(reference, rays[i], tmins[i], 1e30, &refT[i]);
+    delete reference;
+
+    for(BVHLayout layout : { BVHLayout::FLAT, BVHLayout::WIDE4, BVHLayout::WIDE8 })
+    {
+        for(u32 width : { 4u, 8u })
+        {
+            TriangleMesh* mesh = LoadCheckMesh(soupPath, layout, width);
+            u32 hitMismatch = 0;
+            u32 occludedMismatch = 0;
+            f64 worstError = 0.0;
+            for(size_t i = 0; i < rays.size(); i++)
+            {
+                HitRecord rec;
+                bool hit = mesh->traverse(&rays[i], tmins[i], 1e30f, &rec);
+                if(hit != (bool)refHit[i])
+                {
+                    hitMismatch++;
+                    continue;
+                }
+                if(!hit) continue;
+
+                // Relative to the scene scale, hits right at the origin only have absolute precision
+                const f64 scale = fmax(refT[i], 1.0);
+                worstError = fmax(worstError, fabs(rec.t - refT[i]) / scale);
+
+                // Just short of and just past the reference hit
+                if(mesh->occluded(&rays[i], tmins[i], (f32)(refT[i] - 1e-4 * scale))) occludedMismatch++;
+                if(!mesh->occluded(&rays[i], tmins[i], (f32)(refT[i] + 1e-4 * scale))) occludedMismatch++;
+            }
+            const bool ok = hitMismatch == 0 && occludedMismatch == 0 && worstError < 1e-5;
+            std::cout << (ok ? "ok   " : "FAIL ") << BVHLayoutName(layout) << " x" << width << ": " << hitMismatch
+                      << " hit and " << occludedMismatch << " occlusion mismatches, worst t error " << worstError << "\n";
+            failures += !ok;
+            delete mesh;
+        }
+    }
+    std::filesystem::remove(soupPath);
+
+    const CheckMesh cube = JitteredCube(8, &rng);
+    const std::string cubePath = cube.write("cube");
+    std::vector<Vector3> targets = cube.vertices;
+    for(size_t i = 0; i < cube.indices.size(); i += 3)
+    {
+        for(u32 e = 0; e < 3; e++)
+            targets.push_back((cube.vertices[cube.indices[i + e]] + cube.vertices[cube.indices[i + (e + 1) % 3]]) * 0.5f);
+    }
+    for(BVHLayout layout : { BVHLayout::FLAT, BVHLayout::WIDE4, BVHLayout::WIDE8 })
+    {
+        for(u32 width : { 4u, 8u })
+        {
+            TriangleMesh* mesh = LoadCheckMesh(cubePath, layout, width);
+            u32 leaks = 0;
+            u32 shot = 0;
+            for(u32 o = 0; o < 8; o++)
+            {
+                Ray r;
+                r.origin = Vector3(rng.next(-0.5f, 0.5f), rng.next(-0.5f, 0.5f), rng.next(-0.5f, 0.5f));
+                for(const Vector3& target : targets)
+                {
+                    r.direction = target - r.origin;
+                    HitRecord rec;
+                    leaks += !mesh->traverse(&r, 0.0f, 1e30f, &rec);
+                    leaks += !mesh->occluded(&r, 0.0f, 1e30f);
+                    shot += 2;
+                }
+            }
+            std::cout << (leaks == 0 ? "ok   " : "FAIL ") << BVHLayoutName(layout) << " x" << width << ": " << leaks << " of "
+                      << shot << " rays through shared vertices and edges leaked out of the closed mesh\n";
+            failures += leaks != 0;
+            delete mesh;
+        }
+    }
+    std::filesystem::remove(cubePath);
+
+    return failures == 0;
+}
+
+// Packets of neighbouring camera rays (coherent, culled with the interval test) and of random rays (incoherent)
+// against the same rays traced one by one, every layout. Hit lanes and distances must be identical.
+internal bool CheckPacket()
+{
+    CheckRandom rng;
+    u32 failures = 0;
+
+    CheckMesh soup;
+    for(u32 i = 0; i < 2000; i++)
+    {
+        Vector3 c(rng.next(-10, 10), rng.next(-10, 10), rng.next(-10, 10));
+        for(u32 v = 0; v < 3; v++)
+        {
+            soup.vertices.push_back(c + Vector3(rng.next(-1.5f, 1.5f), rng.next(-1.5f, 1.5f), rng.next(-1.5f, 1.5f)));
+            soup.indices.push_back(3 * i + v);
+        }
+    }
+    const std::string soupPath = soup.write("packet");
+
+    // 4 x 4 pixel tiles of a pinhole camera looking down -z at the soup, then as many random packets
+    const u32 packets = 4000;
+    std::vector<Ray> rays(packets * RAY_PACKET_MAX);
+    for(u32 k = 0; k < packets; k++)
+    {
+        Ray* lanes = &rays[k * RAY_PACKET_MAX];
+        const bool coherent = k < packets / 2;
+        const Vector3 eye(rng.next(-5, 5), rng.next(-5, 5), 20.0f);
+        const f32 u = rng.next(-0.5f, 0.5f);
+        const f32 v = rng.next(-0.5f, 0.5f);
+        for(u32 l = 0; l < RAY_PACKET_MAX; l++)
+        {
+            if(coherent)
+            {
+                lanes[l].origin = eye;
+                lanes[l].direction = Vector3(u + 0.002f * (l % 4), v + 0.002f * (l / 4), -1.0f).normalized();
+            }
+            else
+            {
+                lanes[l].origin = Vector3(rng.next(-12, 12), rng.next(-12, 12), rng.next(-12, 12));
+                lanes[l].direction = rng.nextUnit();
+            }
+        }
+    }
+
+    for(BVHLayout layout : { BVHLayout::TREE, BVHLayout::FLAT, BVHLayout::WIDE4, BVHLayout::WIDE8 })
+    {
+        for(u32 width : { 0u, 4u, 8u })
+        {
+            TriangleMesh* mesh = LoadCheckMesh(soupPath, layout, width);
+            u32 mismatches = 0;
+            u32 coherentPackets = 0;
+            for(u32 k = 0; k < packets; k++)
+            {
+                RayPacket p;
+                p.set(&rays[k * RAY_PACKET_MAX], RAY_PACKET_MAX, 1e30f);
+                coherentPackets += p.coherent;
+                HitRecord recs[RAY_PACKET_MAX];
+                const u32 hit = mesh->traversePacket(&p, p.fullMask(), 0.001f, recs);
+                for(u32 l = 0; l < RAY_PACKET_MAX; l++)
+                {
+                    HitRecord rec;
+                    const bool single = mesh->traverse(&rays[k * RAY_PACKET_MAX + l], 0.001f, 1e30f, &rec);
+                    const bool lane = (hit >> l) & 1;
+                    mismatches += lane != single || (single && recs[l].t != rec.t);
+                }
+            }
+            std::cout << (mismatches == 0 ? "ok   " : "FAIL ") << BVHLayoutName(layout) << " x" << width << ": " << mismatches
+                      << " lanes differ from single rays (" << coherentPackets << " of " << packets << " packets coherent)\n";
+            failures += mismatches != 0;
+            delete mesh;
+        }
+    }
+    std::filesystem::remove(soupPath);
+
+    return failures == 0;
+}
+
+// A square sloping from z = 0 to z = 2 with the ray origins just below it, closer than tmin, and a flat square
+// behind it. The sloped one's box reaches far past tmin so only the triangle tests can skip it: every layout,
+// with and without triangle blocks, must report the far square for closest hits and occlusion alike.
+internal bool CheckInterval()
+{
+    CheckRandom rng;
+    u32 failures = 0;
+
+    CheckMesh squares;
+    squares.vertices = { Vector3(-1, -1, 0), Vector3(1, -1, 0), Vector3(1, 1, 2), Vector3(-1, 1, 2),
+                         Vector3(-1, -1, 5), Vector3(1, -1, 5), Vector3(1, 1, 5), Vector3(-1, 1, 5) };
+    squares.indices = { 0, 1, 2, 0, 2, 3, 4, 5, 6, 4, 6, 7 };
+    const std::string squaresPath = squares.write("interval");
+
+    const f32 tmin = 0.001f;
+    std::vector<Ray> rays(1000);
+    for(Ray& r : rays)
+    {
+        f32 x = rng.next(-0.5f, 0.5f);
+        f32 y = rng.next(-0.5f, 0.5f);
+        r.origin = Vector3(x, y, y + 1.0f - 0.0005f);
+        r.direction = Vector3(rng.next(-0.1f, 0.1f), rng.next(-0.1f, 0.1f), 1.0f).normalized();
+    }
+
+    for(BVHLayout layout : { BVHLayout::TREE, BVHLayout::FLAT, BVHLayout::WIDE4, BVHLayout::WIDE8 })
+    {
+        for(u32 width : { 0u, 4u, 8u })
+        {
+            TriangleMesh* mesh = LoadCheckMesh(squaresPath, layout, width);
+            u32 mismatches = 0;
+            for(const Ray& r : rays)
+            {
+                const f32 far = (5.0f - r.origin.z) / r.direction.z;
+                HitRecord rec;
+                mismatches += !mesh->traverse(&r, tmin, 1e30f, &rec) || fabsf(rec.t - far) > 1e-4f * far;
+                mismatches += mesh->occluded(&r, tmin, 0.5f * far);
+                mismatches += !mesh->occluded(&r, tmin, 2.0f * far);
+            }
+            std::cout << (mismatches == 0 ? "ok   " : "FAIL ") << BVHLayoutName(layout) << " x" << width << ": "
+                      << mismatches << " queries reported a hit closer than tmin\n";
+            failures += mismatches != 0;
+            delete mesh;
+        }
+    }
+    std::filesystem::remove(squaresPath);
+
+    return failures == 0;
+}
+
+// Long thin triangles along the diagonals of a box, the case spatial splits are meant for. SBVH trees (every
+// layout, a small and a large duplication budget) against the plain SAH tree, and the number of triangle
+// references must grow but stay within the budget.
+internal bool CheckSBVH()
+{
+    CheckRandom rng;
+    u32 failures = 0;
+
+    CheckMesh truss;
+    const u32 triangles = 3000;
+    for(u32 i = 0; i < triangles; i++)
+    {
+        Vector3 a(rng.next(-10, 10), rng.next(-10, 10), rng.next(-10, 10));
+        Vector3 diagonal(a.x < 0 ? 1.0f : -1.0f, a.y < 0 ? 1.0f : -1.0f, a.z < 0 ? 1.0f : -1.0f);
+        Vector3 b = a + diagonal * rng.next(8, 15);
+        Vector3 c = a + Vector3(rng.next(-0.3f, 0.3f), rng.next(-0.3f, 0.3f), rng.next(-0.3f, 0.3f));
+        truss.vertices.insert(truss.vertices.end(), { a, b, c });
+        truss.indices.insert(truss.indices.end(), { 3 * i, 3 * i + 1, 3 * i + 2 });
+    }
+    std::vector<Ray> rays(20000);
+    for(Ray& r : rays)
+    {
+        r.origin = Vector3(rng.next(-12, 12), rng.next(-12, 12), rng.next(-12, 12));
+        r.direction = rng.nextUnit();
+    }
+
+    // The triangle kernel itself is covered by the watertight check, SBVH only changes which node a
+    // triangle is found through, so every hit must match the SAH tree exactly
+    const std::string trussPath = truss.write("truss");
+    TriangleMesh* reference = LoadCheckMesh(trussPath, BVHLayout::FLAT, 4);
+    std::vector<char> refHit(rays.size());
+    std::vector<f32> refT(rays.size());
+    for(size_t i = 0; i < rays.size(); i++)
+    {
+        HitRecord rec;
+        refHit[i] = reference->traverse(&rays[i], 0.0f, 1e30f, &rec);
+        refT[i] = rec.t;
+    }
+    delete reference;
+
+    for(f32 budget : { 0.3f, 1.0f })
+    {
+        for(BVHLayout layout : { BVHLayout::FLAT, BVHLayout::WIDE4, BVHLayout::WIDE8 })
+        {
+            BVHBuildSettings settings;
+            settings.mode = BVHBuildMode::SBVH;
+            settings.layout = layout;
+            settings.duplicationBudget = budget;
+            settings.cache = false;
+            TriangleMesh* mesh = TriangleMesh::CreateMeshFromFile(trussPath, settings);
+
+            u32 mismatches = 0;
+            for(size_t i = 0; i < rays.size(); i++)
+            {
+                HitRecord rec;
+                bool hit = mesh->traverse(&rays[i], 0.0f, 1e30f, &rec);
+                mismatches += hit != (bool)refHit[i] || (hit && rec.t != refT[i]);
+                mismatches += mesh->occluded(&rays[i], 0.0f, 1e30f) != (bool)refHit[i];
+            }
+            const u64 references = mesh->triangleCount;
+            const bool split = references > triangles && references <= triangles + (u64)(triangles * budget);
+            const bool ok = split && mismatches == 0;
+            std::cout << (ok ? "ok   " : "FAIL ") << BVHLayoutName(layout) << " budget " << budget << ": " << references
+                      << " references for " << triangles << " triangles, " << mismatches << " mismatches\n";
+            failures += !ok;
+            delete mesh;
+        }
+    }
+    std::filesystem::remove(trussPath);
+
+    return failures == 0;
+}
+
+// Closest hit of the scene's flat and binary trees against a loop over every object, same t expected
+internal u32 CountSceneMismatches(const Scene& world, const std::vector<Ray>& rays)
+{
+    u32 mismatches = 0;
+    for(const Ray& r : rays)
+    {
+        HitRecord ref, rec;
+        bool refHit = false;
+        f32 closest = 1e30f;
+        for(Object* o : world.objList)
+        {
+            if(o->hit(o, &r, 0.001f, closest, &rec))
+            {
+                closest = rec.t;
+                ref = rec;
+                refHit = true;
+            }
+        }
+
+        bool flatHit = world.flat->traverse(&r, 0.001f, 1e30f, &rec);
+        mismatches += flatHit != refHit || (refHit && rec.t != ref.t);
+        bool treeHit = world.top->traverse(&r, 0.001f, 1e30f, &rec);
+        mismatches += treeHit != refHit || (refHit && rec.t != ref.t);
+    }
+    return mismatches;
+}
+
+// Scene::UpdateObjects after small moves (refit only) and after a move across the scene (subtree rebuild)
+internal bool CheckRefit()
+{
+    CheckRandom rng;
+    Geometry::RegisterGeometry("Sphere", new Sphere());
+
+    std::vector<Object*> spheres;
+    for(u32 i = 0; i < 2000; i++)
+        spheres.push_back(Object::CreateSphere(Vector3(rng.next(-20, 20), rng.next(-20, 20), rng.next(-20, 20)), rng.next(0.1f, 0.5f), nullptr));
+
+    Scene world;
+    world.top = BVHNode::NewBVHTree(spheres);
+    world.flat = FlatBVH::FromBVHTree(world.top);
+    world.objList = spheres;
+    world.sky = nullptr;
+    world.renderCamera = nullptr;
+
+    std::vector<Ray> rays(5000);
+    for(Ray& r : rays)
+    {
+        r.origin = Vector3(rng.next(-25, 25), rng.next(-25, 25), rng.next(-25, 25));
+        r.direction = rng.nextUnit();
+    }
+
+    // Nudge every 100th sphere by less than its own size
+    std::vector<Object*> changed;
+    for(u32 i = 0; i < spheres.size(); i += 100)
+    {
+        spheres[i]->transform.position = spheres[i]->transform.position + Vector3(rng.next(-0.3f, 0.3f), rng.next(-0.3f, 0.3f), rng.next(-0.3f, 0.3f));
+        changed.push_back(spheres[i]);
+    }
+    const bool nudgeRebuilt = Scene::UpdateObjects(&world, changed);
+    const u32 nudgeMismatches = CountSceneMismatches(world, rays);
+    const bool nudgeOk = !nudgeRebuilt && nudgeMismatches == 0;
+    std::cout << (nudgeOk ? "ok   " : "FAIL ") << changed.size() << " spheres nudged: " << (nudgeRebuilt ? "rebuilt" : "refitted")
+              << ", " << nudgeMismatches << " mismatches against a loop over every object\n";
+
+    // Moving spheres to the far side of the scene blows their leaves' boxes up past maxAreaGrowth
+    changed.clear();
+    for(u32 i = 50; i < spheres.size(); i += 500)
+    {
+        spheres[i]->transform.position = Vector3(-spheres[i]->transform.position.x, spheres[i]->transform.position.y, -spheres[i]->transform.position.z);
+        changed.push_back(spheres[i]);
+    }
+    const bool moveRebuilt = Scene::UpdateObjects(&world, changed);
+    const u32 moveMismatches = world.flat ? CountSceneMismatches(world, rays) : (u32)rays.size();
+    const bool moveOk = moveRebuilt && moveMismatches == 0;
+    std::cout << (moveOk ? "ok   " : "FAIL ") << changed.size() << " spheres moved across the scene: " << (moveRebuilt ? "rebuilt" : "refitted")
+              << ", " << moveMismatches << " mismatches against a loop over every object\n";
+
+    Scene::FreeScene(&world);
+    Object::DeleteAll();
+    Geometry::UnloadAll();
+    return nudgeOk && moveOk;
+}
+
+// Worker order on a synthetic 2 socket, 4 cores per socket, 2 way SMT machine numbered the way Linux does it
+// (every first hardware thread, socket by socket, then their siblings)
+internal bool CheckPlacement()
+{
+    CPUTopology topo;
+    for(u32 id = 0; id < 16; id++)
+    {
+        const u32 core = id % 8;
+        topo.cpus.push_back({ id, core, core / 4, core / 4, id / 8 });
+    }
+    topo.coreCount = 8;
+    topo.packageCount = 2;
+    topo.nodeCount = 2;
+
+    struct Expected
+    {
+        WorkerPlacement placement;
+        std::vector<u32> ids;
+    };
+    const Expected expected[] = {
+        { WorkerPlacement::NONE,    {} },
+        { WorkerPlacement::SPREAD,  { 0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15 } },
+        { WorkerPlacement::COMPACT, { 0, 1, 2, 3, 8, 9, 10, 11, 4, 5, 6, 7, 12, 13, 14, 15 } },
+    };
+
+    u32 failures = 0;
+    for(const Expected& e : expected)
+    {
+        std::vector<u32> ids;
+        for(const LogicalCPU* cpu : topo.placementOrder(e.placement)) ids.push_back(cpu->id);
+        const bool ok = ids == e.ids;
+        std::cout << (ok ? "ok   " : "FAIL ") << WorkerPlacementName(e.placement) << ":";
+        for(u32 id : ids) std::cout << " " << id;
+        std::cout << "\n";
+        failures += !ok;
+    }
+    return failures == 0;
+}
+
+// Builds over nothing (no objects, a mesh without triangles, no boxes) return no tree instead of reading
+// before the primitive array, and a scene without objects renders as all misses
+internal bool CheckEmpty()
+{
+    u32 failures = 0;
+    auto report = [&](bool ok, const char* what) {
+        std::cout << (ok ? "ok   " : "FAIL ") << what << "\n";
+        failures += !ok;
+    };
+
+    TriangleMesh* mesh = new TriangleMesh();
+    mesh->vertices = nullptr;
+    mesh->normals = nullptr;
+    mesh->texCoords = nullptr;
+    mesh->triangles = nullptr;
+    mesh->vertexCount = mesh->normalCount = mesh->texCoordCount = mesh->triangleCount = 0;
+
+    for(BVHBuildMode mode : { BVHBuildMode::MEDIAN, BVHBuildMode::SAH_BINNED, BVHBuildMode::LBVH, BVHBuildMode::SBVH })
+    {
+        BVHBuildSettings settings;
+        settings.mode = mode;
+        const std::string name = BVHBuildModeName(mode);
+
+        BVHNode* top = BVHNode::NewBVHTree({}, settings);
+        report(top == nullptr, (name + " top level tree over no objects").c_str());
+        BVHNode::FreeBVHTree(top);
+
+        BVHNodeTri* tri = BVHNodeTri::NewBVHTriTree(mesh, settings);
+        report(tri == nullptr, (name + " tree over a mesh without triangles").c_str());
+        BVHNodeTri::FreeBVHTriTree(tri);
+
+        BVHNodeBox* box = BVHNodeBox::NewBVHBoxTree(nullptr, 0, settings);
+        report(box == nullptr, (name + " tree over no boxes").c_str());
+        BVHNodeBox::FreeBVHBoxTree(box);
+    }
+    delete mesh;
+
+    Scene world;
+    world.top = BVHNode::NewBVHTree({});
+    world.flat = FlatBVH::FromBVHTree(world.top);
+    world.sky = nullptr;
+    world.renderCamera = nullptr;
+    report(world.flat == nullptr, "no flat tree for an empty scene");
+
+    Ray r;
+    r.origin = Vector3(0, 0, 0);
+    r.direction = Vector3(0, 0, -1);
+    HitRecord rec;
+    report(!ClosestIntersect(&r, &world, &rec) && !world.occluded(&r, 0.001f, 1e30f), "rays miss an empty scene");
+    report(!Scene::UpdateObjects(&world, {}) && world.top == nullptr, "updating an empty scene keeps it empty");
+    Scene::FreeScene(&world);
+
+    return failures == 0;
+}
+
+struct Check
+{
+    const char* name;
+    bool (*run)();
+};
+
+internal const Check checks[] = {
+    { "watertight", CheckWatertight },
+    { "interval",   CheckInterval   },
+    { "packet",     CheckPacket     },
+    { "sbvh",       CheckSBVH       },
+    { "refit",      CheckRefit      },
+    { "placement",  CheckPlacement  },
+    { "empty",      CheckEmpty      },
+};
+
+int main(int argc, char** argv)
+{
+    if(argc != 2)
+    {
+        std::cerr << "Usage: liquid_checks <name>, one of:";
+        for(const Check& c : checks) std::cerr << " " << c.name;
+        std::cerr << std::endl;
+        return 2;
+    }
+
+    for(const Check& c : checks)
+    {
+        if(c.name != std::string(argv[1])) continue;
+        const bool passed = c.run();
+        std::cout << c.name << (passed ? " passed" : " FAILED") << std::endl;
+        return passed ? 0 : 1;
+    }
+    std::cerr << "error: Unknown check \"" << argv[1] << "\"." << std::endl;
+    return 2;
+}
@@ -0,0 +1,339 @@
+// Before the renderer headers for the same reason as <filesystem> in bvh_cache.cpp
+#include <iomanip>
+#include "../renderer/raycaster/hittable/object.h"
+#include "../renderer/raycaster/geometry.h"
+#include "../renderer/raycaster/material.h"
+#include "../renderer/raycaster/caster.h"
+#include "../renderer/raycaster/wavefront.h"
+#include "../renderer/scene.h"
+#include "../renderer/camera.h"
+#include "../renderer/samples/samples.h"
+#include "../image/image.h"
+#include "../math/sampler.h"
+#include "../thread/threadpool.h"
+
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+// Headless batch renderer: loads a sample scene or an OBJ, renders it on the thread pool and writes a BMP.
+// No window, GLFW or OpenGL involved, so it runs on render nodes without a display.
+
+#define CLI_BUDGET_MAX_SPP 65536 // Sample cap of budgeted renders when --spp is not given
+#define CLI_MESH_FOV 40.0f        // Vertical field of view the --mesh camera frames the mesh with
+
+struct CLIOptions
+{
+    std::string scene = "many";
+    std::string mesh; // Wavefront file rendered instead of the sample scene when set
+    u32 width = 1280;
+    u32 height = 720;
+    i32 spp = 64;
+    bool sppGiven = false;
+    RenderBudget budget;
+    u32 threads = 0; // Every hardware thread
+    std::string output = "render.bmp";
+    SamplerType sampler = SamplerType::SOBOL;
+    bool wavefront = false;
+};
+
+struct CLIScene
+{
+    const char* name;
+    Scene (*loader)(std::atomic<i32>* progress);
+};
+
+internal const CLIScene scenes[] = {
+    { "basic",   Samples::BasicSphere    },
+    { "single",  Samples::SingleSphere   },
+    { "colored", Samples::ColoredSpheres },
+    { "many",    Samples::ManySpheres    },
+};
+
+internal void PrintUsage()
+{
+    std::cout <<
+        "Usage: liquid_cli [options]\n"
+        "  --scene <name>     basic, single, colored or many (default many)\n"
+        "  --mesh <file.obj>  Render a wavefront mesh instead of a sample scene (grey, under a white sky)\n"
+        "  --width <pixels>   Image width (default 1280)\n"
+        "  --height <pixels>  Image height (default 720)\n"
+        "  --spp <samples>    Samples per pixel, the cap of budgeted renders (default 64, 65536 with a budget)\n"
+        "  --time <seconds>   Keep adding sample passes until this much wall clock time is spent\n"
+        "  --target-error <e> Keep adding sample passes until the estimated relative error is below e (0.05 = 5%)\n"
+        "  --threads <count>  Render threads, 0 uses every hardware thread (default 0)\n"
+        "  --output <file>    BMP written at the end (default render.bmp)\n"
+        "  --sampler <name>   uniform, stratified, halton or sobol (default sobol)\n"
+        "  --wavefront        Breadth-first integrator instead of the recursive one\n"
+        "  --help             Show this message\n";
+}
+
+internal bool ParseU32(const char* text, u32 min, u32* value)
+{
+    char* end = nullptr;
+    unsigned long v = strtoul(text, &end, 10);
+    if(end == text || *end != '\0' || text[0] == '-' || v < min || v > 0xFFFFFFFFul)
+        return false;
+    *value = (u32)v;
+    return true;
+}
+
+internal bool ParsePositive(const char* text, f64* value)
+{
+    char* end = nullptr;
+    f64 v = strtod(text, &end);
+    if(end == text || *end != '\0' || !(v > 0.0))
+        return false;
+    *value = v;
+    return true;
+}
+
+internal bool ParseSampler(const std::string& name, SamplerType* type)
+{
+    for(SamplerType t : { SamplerType::UNIFORM, SamplerType::STRATIFIED, SamplerType::HALTON, SamplerType::SOBOL })
+    {
+        std::string candidate = SamplerTypeName(t);
+        for(char& c : candidate) c = (char)tolower(c);
+        if(candidate == name)
+        {
+            *type = t;
+            return true;
+        }
+    }
+    return false;
+}
+
+// False (after printing why) on a bad command line
+internal bool ParseArguments(i32 argc, char** argv, CLIOptions* opts, bool* help)
+{
+    for(i32 a = 1; a < argc; a++)
+    {
+        const std::string arg = argv[a];
+        if(arg == "--help" || arg == "-h")
+        {
+            *help = true;
+            return true;
+        }
+        if(arg == "--wavefront")
+        {
+            opts->wavefront = true;
+            continue;
+        }
+
+        if(a + 1 >= argc)
+        {
+            std::cerr << "error: " << arg << " expects a value." << std::endl;
+            return false;
+        }
+        const char* value = argv[++a];
+
+        bool ok = true;
+        u32 number = 0;
+        f64 real = 0.0;
+        if(arg == "--scene")         opts->scene = value;
+        else if(arg == "--mesh")     opts->mesh = value;
+        else if(arg == "--output")   opts->output = value;
+        else if(arg == "--sampler")  ok = ParseSampler(value, &opts->sampler);
+        else if(arg == "--width")    ok = ParseU32(value, 1, &opts->width);
+        else if(arg == "--height")   ok = ParseU32(value, 1, &opts->height);
+        else if(arg == "--threads")  ok = ParseU32(value, 0, &opts->threads);
+        else if(arg == "--spp")
+        {
+            ok = ParseU32(value, 1, &number) && number <= 0x7FFFFFFF;
+            opts->spp = (i32)number;
+            opts->sppGiven = true;
+        }
+        else if(arg == "--time")
+        {
+            ok = ParsePositive(value, &real);
+            opts->budget.seconds = real;
+        }
+        else if(arg == "--target-error")
+        {
+            ok = ParsePositive(value, &real);
+            opts->budget.targetError = (f32)real;
+        }
+        else
+        {
+            std::cerr << "error: Unknown option " << arg << "." << std::endl;
+            return false;
+        }
+
+        if(!ok)
+        {
+            std::cerr << "error: Invalid value \"" << value << "\" for " << arg << "." << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// The samples frame their cameras for 16:9, match the requested image instead of stretching it
+internal void FitCameraAspect(Camera* cam, u32 w, u32 h)
+{
+    cam->iaspect = (f32)w / h;
+    cam->updateView(cam->origin, cam->origin + cam->direction);
+}
+
+// A single mesh lit by a white sky, the camera looks at it from the front right and slightly above.
+// Returns false if the mesh can't be loaded.
+internal bool LoadMeshScene(const std::string& file, Scene* world)
+{
+    TriangleMesh* mesh = TriangleMesh::CreateMeshFromFile(file);
+    if(mesh == nullptr) return false;
+    Geometry::RegisterGeometry(file, mesh);
+
+    Material* grey = Material::RegisterMaterial("MeshGrey", new Lambertian(Vector3(0.7f, 0.7f, 0.7f)));
+    Object* obj = Object::CreateMesh(file, grey);
+    BVHNode* tree = BVHNode::NewBVHTree({ obj });
+
+    // Back off until the bounding sphere of the mesh fits the vertical field of view
+    const Vector3 center = mesh->box.centroid();
+    f32 radius = (mesh->box.max - mesh->box.min).length() * 0.5f;
+    if(!(radius > 0.0f)) radius = 1.0f;
+    const f32 distance = radius / sinf(0.5f * CLI_MESH_FOV * PI / 180.0f);
+    const Vector3 eye = center + Vector3(1.0f, 0.5f, 2.0f).normalized() * distance;
+
+    world->name = file;
+    world->top = tree;
+    world->flat = FlatBVH::FromBVHTree(tree);
+    world->objList = { obj };
+    world->sky = new ColorTexture(Vector3(1.0f, 1.0f, 1.0f));
+    world->renderCamera = new Camera(eye, center, Vector3(0, 1, 0), CLI_MESH_FOV, 16.0f / 9.0f, 0.0f, distance);
+    return true;
+}
+
+internal f64 SecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+    CLIOptions opts;
+    bool help = false;
+    if(!ParseArguments(argc, argv, &opts, &help))
+    {
+        PrintUsage();
+        return 1;
+    }
+    if(help)
+    {
+        PrintUsage();
+        return 0;
+    }
+
+    const bool budgeted = opts.budget.seconds > 0.0 || opts.budget.targetError > 0.0f;
+    if(budgeted && !opts.sppGiven)
+        opts.spp = CLI_BUDGET_MAX_SPP;
+
+    const CLIScene* scene = nullptr;
+    for(const CLIScene& s : scenes)
+    {
+        if(opts.scene == s.name) scene = &s;
+    }
+    if(!scene && opts.mesh.empty())
+    {
+        std::cerr << "error: Unknown scene \"" << opts.scene << "\"." << std::endl;
+        PrintUsage();
+        return 1;
+    }
+
+    ThreadPool* pool = ThreadPool::Get();
+    pool->resize(opts.threads);
+
+    auto loadStart = std::chrono::steady_clock::now();
+    Scene world;
+    if(!opts.mesh.empty())
+    {
+        if(!LoadMeshScene(opts.mesh, &world))
+        {
+            std::cerr << "error: Could not load mesh " << opts.mesh << "." << std::endl;
+            return 1;
+        }
+    }
+    else
+    {
+        std::atomic<i32> loadProgress = 0;
+        world = scene->loader(&loadProgress);
+    }
+    const f64 loadSeconds = SecondsSince(loadStart);
+    FitCameraAspect(world.renderCamera, opts.width, opts.height);
+
+    std::cout << "Loaded scene: " << world.name << " (" << loadSeconds << "s)\n";
+    std::cout << "Rendering " << opts.width << "x" << opts.height << " at " << (budgeted ? "up to " : "") << opts.spp << "spp on "
+              << pool->size() << " threads (" << SamplerTypeName(opts.sampler) << " sampler, "
+              << (opts.wavefront ? "wavefront" : "recursive") << ")" << std::endl;
+    std::cout << std::fixed;
+    if(opts.budget.seconds > 0.0)
+        std::cout << "Time budget: " << std::setprecision(1) << opts.budget.seconds << "s\n";
+    if(opts.budget.targetError > 0.0f)
+        std::cout << "Target error: " << std::setprecision(2) << 100.0f * opts.budget.targetError << "%\n";
+
+    Image img(opts.width, opts.height, IMAGE_FORMAT_BPP);
+    std::atomic<bool> rendering = true; // Cleared by the job once the last pass is done
+    RenderJob job(
+        32,
+        TileOrder::SPIRAL,
+        false,
+        &world,
+        &img,
+        opts.spp,
+        opts.spp,
+        opts.wavefront ? calculateChunkWavefront : calculateChunk,
+        &rendering,
+        1,
+        {},
+        opts.sampler,
+        opts.budget
+    );
+
+    auto renderStart = std::chrono::steady_clock::now();
+    job.run(pool);
+    while(rendering.load())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        std::cout << "\rProgress: " << std::setw(5) << std::setprecision(1) << job.progress() << "%" << std::flush;
+    }
+    job.fence();
+    const f64 renderSeconds = SecondsSince(renderStart);
+    const u64 samples = job.samplesTaken();
+
+    std::cout << "\rProgress: " << std::setw(5) << std::setprecision(1) << job.progress() << "%\n";
+    std::cout << "Render time: " << std::setprecision(3) << renderSeconds << "s\n";
+    std::cout << "Primary rays: " << samples << " (" << std::setprecision(2) << samples / renderSeconds / 1e6 << " Mrays/s)\n";
+    std::cout << "Samples per pixel: " << job.samplesDone() << "\n";
+    if(job.estimatedError() >= 0.0f)
+        std::cout << "Estimated error: " << std::setprecision(2) << 100.0f * job.estimatedError() << "%\n";
+
+    if(budgeted)
+    {
+        const char* reason = "time budget";
+        if(opts.budget.targetError > 0.0f && job.estimatedError() >= 0.0f && job.estimatedError() <= opts.budget.targetError)
+            reason = "target error";
+        else if(job.samplesDone() >= opts.spp)
+            reason = "sample cap";
+        std::cout << "Stopped on: " << reason << "\n";
+    }
+
+    i32 status = 0;
+    if(img.saveToBMP(opts.output))
+    {
+        std::cout << "Saved " << opts.output << std::endl;
+    }
+    else
+    {
+        std::cerr << "error: Could not write " << opts.output << "." << std::endl;
+        status = 1;
+    }
+
+    Scene::FreeScene(&world);
+    Object::DeleteAll();
+    Material::UnloadAll();
+    Geometry::UnloadAll();
+    return status;
+}
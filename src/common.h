@@ -1,6 +1,6 @@
 #pragma once
 #include <iostream>
-// #include <cstdint>
+#include <cstdint>
 
 typedef int8_t   i8;
 typedef int16_t i16;
@@ -18,5 +18,14 @@ typedef double f64;
 #define PI 3.141592654f
 
 #define POSSIBLE_INLINE inline
+#ifdef _MSC_VER
 #define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE inline __attribute__((always_inline))
+#endif
 #define internal static
+
+// SSE kernels are compiled where the target has SSE, each of them keeps a scalar path for other hosts
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define LIQUID_SSE
+#endif
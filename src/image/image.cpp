@@ -3,17 +3,18 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "../stb/stb_image.h"
 
-#include <Windows.h>
+#include <cstdio>
+#include <cstdlib>
 
 const int BYTES_PER_PIXEL  =  3;
 const int FILE_HEADER_SIZE = 14;
 const int INFO_HEADER_SIZE = 40;
 
-void generateBitmapImage(unsigned char* image, int height, int width, const char* imageFileName);
-unsigned char* createBitmapFileHeader(int height, int stride);
-unsigned char* createBitmapInfoHeader(int height, int width);
+internal bool generateBitmapImage(unsigned char* image, int height, int width, const char* imageFileName);
+internal unsigned char* createBitmapFileHeader(int height, int stride);
+internal unsigned char* createBitmapInfoHeader(int height, int width);
 
-internal void generateBitmapImage (unsigned char* image, int height, int width, const char* imageFileName)
+internal bool generateBitmapImage (unsigned char* image, int height, int width, const char* imageFileName)
 {
     int widthInBytes = width * BYTES_PER_PIXEL;
 
@@ -23,6 +24,11 @@ internal void generateBitmapImage (unsigned char* image, int height, int width,
     int stride = (widthInBytes) + paddingSize;
 
     FILE* imageFile = fopen(imageFileName, "wb");
+    if(!imageFile)
+    {
+        std::cerr << "warn: Could not open " << imageFileName << " for writing." << std::endl;
+        return false;
+    }
 
     unsigned char* fileHeader = createBitmapFileHeader(height, stride);
     fwrite(fileHeader, 1, FILE_HEADER_SIZE, imageFile);
@@ -49,7 +55,7 @@ internal void generateBitmapImage (unsigned char* image, int height, int width,
     }
 
     free(ndata);
-    fclose(imageFile);
+    return fclose(imageFile) == 0;
 }
 
 internal unsigned char* createBitmapFileHeader(int height, int stride)
@@ -132,7 +138,7 @@ Image::~Image()
     if(data) stbi_image_free(data);
 }
 
-void Image::saveToBMP(std::string filename) const
+bool Image::saveToBMP(std::string filename) const
 {
-    generateBitmapImage(data, h, w, filename.c_str());
+    return generateBitmapImage(data, h, w, filename.c_str());
 }
\ No newline at end of file
@@ -2,6 +2,9 @@
 #include "../common.h"
 #include "../math/vector.h"
 #include "../math/math.h"
+#include <cstring>
+#include <cstdlib>
+#include <string>
 
 #define IMAGE_FORMAT_BPP 4
 
@@ -12,18 +15,34 @@ struct Image
     u8 bpp;
     u8* data;
 
-    Image(u32 w, u32 h, u8 bpp) : w(w), h(h), bpp(bpp) { data = new u8[w * h * bpp]; }
+    // Allocated with malloc like the stb_image loads, so the destructor frees both the same way
+    Image(u32 w, u32 h, u8 bpp) : w(w), h(h), bpp(bpp) { data = (u8*)malloc((size_t)w * h * bpp); }
     Image(const std::string& filename);
     Image(const std::string& filename, f32 factor);
     ~Image();
 
+    // Writes one pixel in the image format (BGRA) to dst, used for tile buffers too
+    static POSSIBLE_INLINE void EncodePixel(u8* dst, const Vector3& value)
+    {
+        dst[0] = (u8)(clampf32(value.z, 0.0f, 0.999f) * 256);
+        dst[1] = (u8)(clampf32(value.y, 0.0f, 0.999f) * 256);
+        dst[2] = (u8)(clampf32(value.x, 0.0f, 0.999f) * 256);
+        dst[3] = 0x00;
+    }
+
     POSSIBLE_INLINE void setPixel(u32 x, u32 y, const Vector3& value)
     {
         // Skip data check for speed - FORMAT = BGRA
-        data[IMAGE_FORMAT_BPP * y * w + IMAGE_FORMAT_BPP * x    ] = (u8)(clampf32(value.z, 0.0f, 0.999f) * 256);
-        data[IMAGE_FORMAT_BPP * y * w + IMAGE_FORMAT_BPP * x + 1] = (u8)(clampf32(value.y, 0.0f, 0.999f) * 256);
-        data[IMAGE_FORMAT_BPP * y * w + IMAGE_FORMAT_BPP * x + 2] = (u8)(clampf32(value.x, 0.0f, 0.999f) * 256);
-        data[IMAGE_FORMAT_BPP * y * w + IMAGE_FORMAT_BPP * x + 3] = 0x00;
+        EncodePixel(&data[IMAGE_FORMAT_BPP * y * w + IMAGE_FORMAT_BPP * x], value);
+    }
+
+    // Copies a packed rw x rh pixel block (already encoded) to (x, y), one memcpy per row
+    POSSIBLE_INLINE void writeRegion(u32 x, u32 y, u32 rw, u32 rh, const u8* src)
+    {
+        for(u32 r = 0; r < rh; r++)
+        {
+            memcpy(&data[IMAGE_FORMAT_BPP * ((y + r) * w + x)], &src[IMAGE_FORMAT_BPP * r * rw], IMAGE_FORMAT_BPP * rw);
+        }
     }
 
     POSSIBLE_INLINE void setAll(const Vector3& value)
@@ -37,5 +56,5 @@ struct Image
         }
     }
 
-    void saveToBMP(std::string filename) const;
+    bool saveToBMP(std::string filename) const; // False if the file could not be written
 };
\ No newline at end of file
@@ -10,17 +10,11 @@
 #include "renderer/raycaster/material.h"
 #include "thread/threadpool.h"
 
-// TODO: These sources are temporary
-#include "renderer/displayer/debug_display_win32.h"
 #include "renderer/displayer/display.h"
 
 int main()
 {
-#ifdef _WIN32WINDOW_DEBUG
-    run_window(&image, pool.getImage_mtx());
-#else
     RasterDisplay::RunGLFWWindow();
-#endif _WIN32WINDOW_DEBUG
 
     Object::DeleteAll();
     Material::UnloadAll();
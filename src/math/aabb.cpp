@@ -1,4 +1,5 @@
 #include "aabb.h"
+#include <limits>
 
 internal POSSIBLE_INLINE bool boxAxis(const AABB* aabb, const Ray* r, f32& tmin, f32& tmax, i32 axis)
 {
@@ -9,7 +10,7 @@ internal POSSIBLE_INLINE bool boxAxis(const AABB* aabb, const Ray* r, f32& tmin,
 
     tmin = fmaxf(tx_0, tmin);
     tmax = fminf(tx_1, tmax);
-    if(tmax <= tmin) return false;
+    if(tmax * AABB_ROBUST_FAR < tmin) return false; // Touching still counts, boxes of planar geometry have no thickness
     return true;
 }
 
@@ -21,6 +22,27 @@ bool AABB::hit(const Ray* r, f32 tmin, f32 tmax) const
     return 1;
 }
 
+Vector3 AABB::centroid() const
+{
+    return (min + max) * 0.5f;
+}
+
+f32 AABB::surfaceArea() const
+{
+    Vector3 d = max - min;
+    if(d.x < 0 || d.y < 0 || d.z < 0) return 0.0f;
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+AABB AABB::Empty()
+{
+    AABB r;
+    const f32 inf = std::numeric_limits<f32>::infinity();
+    r.min = Vector3( inf,  inf,  inf);
+    r.max = Vector3(-inf, -inf, -inf);
+    return r;
+}
+
 AABB AABB::SurroundingBox(AABB a, AABB b)
 {
     AABB r;
@@ -36,5 +58,31 @@ AABB AABB::SurroundingBox(AABB a, AABB b)
         fmaxf(a.max.z, b.max.z)
     );
 
+    return r;
+}
+
+AABB AABB::SurroundingPoint(AABB a, const Vector3& p)
+{
+    AABB r;
+    r.min = Vector3(fminf(a.min.x, p.x), fminf(a.min.y, p.y), fminf(a.min.z, p.z));
+    r.max = Vector3(fmaxf(a.max.x, p.x), fmaxf(a.max.y, p.y), fmaxf(a.max.z, p.z));
+    return r;
+}
+
+AABB AABB::Transformed(const AABB& box, const Matrix4& m)
+{
+    // Each output axis is the translation plus the min/max contribution of every input axis (Arvo)
+    AABB r;
+    for(i32 j = 0; j < 3; j++)
+    {
+        r.min.data[j] = r.max.data[j] = m.data[3][j];
+        for(i32 i = 0; i < 3; i++)
+        {
+            f32 a = m.data[i][j] * box.min.data[i];
+            f32 b = m.data[i][j] * box.max.data[i];
+            r.min.data[j] += fminf(a, b);
+            r.max.data[j] += fmaxf(a, b);
+        }
+    }
     return r;
 }
\ No newline at end of file
@@ -1,6 +1,11 @@
 #pragma once
 #include "vector.h"
 #include "ray.h"
+#include "matrix.h"
+
+// Every slab test scales its far distance by 1 + 2 gamma(3) (Ize 2013). The slab distances are rounded,
+// without the margin a ray through a vertex or edge lying on a box face can miss both boxes sharing it.
+#define AABB_ROBUST_FAR 1.00000036f
 
 struct AABB
 {
@@ -9,5 +14,24 @@ struct AABB
 
     bool hit(const Ray* r, f32 tmin, f32 tmax) const;
 
+    // Slab test with a precomputed inverse ray direction (no divides)
+    POSSIBLE_INLINE bool hit(const Vector3& origin, const Vector3& invDir, f32 tmin, f32 tmax) const
+    {
+        for(i32 axis = 0; axis < 3; axis++)
+        {
+            f32 t0 = (min.data[axis] - origin.data[axis]) * invDir.data[axis];
+            f32 t1 = (max.data[axis] - origin.data[axis]) * invDir.data[axis];
+            tmin = fmaxf(fminf(t0, t1), tmin);
+            tmax = fminf(fmaxf(t0, t1), tmax);
+        }
+        return tmin <= tmax * AABB_ROBUST_FAR;
+    }
+
+    Vector3 centroid() const;
+    f32 surfaceArea() const;
+
+    static AABB Empty();
     static AABB SurroundingBox(AABB a, AABB b);
+    static AABB SurroundingPoint(AABB a, const Vector3& p);
+    static AABB Transformed(const AABB& box, const Matrix4& m); // Box around the transformed box (p * m)
 };
\ No newline at end of file
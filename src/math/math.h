@@ -1,4 +1,20 @@
 #pragma once
 #include "../common.h"
 
-f32 clampf32(f32 x, f32 min, f32 max);
\ No newline at end of file
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+f32 clampf32(f32 x, f32 min, f32 max);
+
+// Index of the lowest set bit (mask must not be zero)
+POSSIBLE_INLINE u32 LowestSetBit(u32 mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (u32)index;
+#else
+    return (u32)__builtin_ctz(mask);
+#endif
+}
@@ -120,6 +120,70 @@ struct Matrix4
 		return Result;
     }
 
+    // Inverse of an affine matrix (last column is 0, 0, 0, 1) - the 3x3 part via the adjugate
+    inline static Matrix4 AffineInverse(const Matrix4& m)
+    {
+        const f32 (*a)[4] = m.data;
+        f32 c00 = a[1][1] * a[2][2] - a[1][2] * a[2][1];
+        f32 c01 = a[1][2] * a[2][0] - a[1][0] * a[2][2];
+        f32 c02 = a[1][0] * a[2][1] - a[1][1] * a[2][0];
+        f32 det = a[0][0] * c00 + a[0][1] * c01 + a[0][2] * c02;
+        if(fabsf(det) < 1e-12f)
+        {
+            std::cerr << "warn: Matrix4::AffineInverse singular matrix." << std::endl;
+            return Identity();
+        }
+        f32 id = 1.0f / det;
+
+        Matrix4 r = Identity();
+        r.data[0][0] = c00 * id;
+        r.data[0][1] = (a[0][2] * a[2][1] - a[0][1] * a[2][2]) * id;
+        r.data[0][2] = (a[0][1] * a[1][2] - a[0][2] * a[1][1]) * id;
+        r.data[1][0] = c01 * id;
+        r.data[1][1] = (a[0][0] * a[2][2] - a[0][2] * a[2][0]) * id;
+        r.data[1][2] = (a[0][2] * a[1][0] - a[0][0] * a[1][2]) * id;
+        r.data[2][0] = c02 * id;
+        r.data[2][1] = (a[0][1] * a[2][0] - a[0][0] * a[2][1]) * id;
+        r.data[2][2] = (a[0][0] * a[1][1] - a[0][1] * a[1][0]) * id;
+
+        // Row vector convention (p' = p * M), so the translation is undone after the 3x3 part
+        for(i32 j = 0; j < 3; j++)
+        {
+            r.data[3][j] = -(a[3][0] * r.data[0][j] + a[3][1] * r.data[1][j] + a[3][2] * r.data[2][j]);
+        }
+        return r;
+    }
+
+    // p * M with w = 1 (same convention as Translation and the raster model matrix)
+    inline Vector3 transformPoint(const Vector3& p) const
+    {
+        return Vector3(
+            p.x * data[0][0] + p.y * data[1][0] + p.z * data[2][0] + data[3][0],
+            p.x * data[0][1] + p.y * data[1][1] + p.z * data[2][1] + data[3][1],
+            p.x * data[0][2] + p.y * data[1][2] + p.z * data[2][2] + data[3][2]
+        );
+    }
+
+    // v * M with w = 0
+    inline Vector3 transformVector(const Vector3& v) const
+    {
+        return Vector3(
+            v.x * data[0][0] + v.y * data[1][0] + v.z * data[2][0],
+            v.x * data[0][1] + v.y * data[1][1] + v.z * data[2][1],
+            v.x * data[0][2] + v.y * data[1][2] + v.z * data[2][2]
+        );
+    }
+
+    // Normals go through the inverse transpose, call this on the inverse matrix (result is not normalized)
+    inline Vector3 transformNormal(const Vector3& n) const
+    {
+        return Vector3(
+            n.x * data[0][0] + n.y * data[0][1] + n.z * data[0][2],
+            n.x * data[1][0] + n.y * data[1][1] + n.z * data[1][2],
+            n.x * data[2][0] + n.y * data[2][1] + n.z * data[2][2]
+        );
+    }
+
     f32 data[4][4] = { 0 };
 };
 
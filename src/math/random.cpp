@@ -1,46 +1,111 @@
 #include "random.h"
+#include "sampler.h"
 #include <random>
+#include <cmath>
+#include <algorithm>
 
-internal std::random_device GlobalRandDevice;
-internal std::mt19937 GlobalGenerator(GlobalRandDevice());
+internal thread_local Random::Stream ThreadRng;
+internal thread_local bool ThreadRngSeeded = false;
+
+// SplitMix64 finalizer, spreads neighbouring pixel ids over the whole state space
+internal POSSIBLE_INLINE u64 MixBits(u64 x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+Random::Stream& Random::ThreadStream()
+{
+    if(!ThreadRngSeeded)
+    {
+        std::random_device device;
+        ThreadRng.rng.seed(((u64)device() << 32) | device(), ((u64)device() << 32) | device());
+        ThreadRngSeeded = true;
+    }
+    return ThreadRng;
+}
+
+void Random::SeedPixel(u64 pixel, u32 sample, u32 frame, const Sampler* sampler, u32 count)
+{
+    u64 mixed = MixBits(pixel ^ ((u64)frame << 40));
+    ThreadRng.rng.seed(mixed, sample);
+    ThreadRng.sampler = sampler;
+    ThreadRng.seed = (u32)(mixed >> 32);
+    ThreadRng.index = sample;
+    ThreadRng.count = count;
+    ThreadRng.dimension = 0;
+    ThreadRngSeeded = true;
+}
+
+void Random::ClearSampler()
+{
+    ThreadRng.sampler = nullptr;
+}
 
 i32 Random::RandomI32Range(i32 b, i32 e)
 {
-    std::uniform_int_distribution<i32> dist(b, e);
-    return dist(GlobalGenerator);
+    // Multiply-shift range reduction, the bias is below 2^-32 per value for small ranges
+    u64 range = (u64)((i64)e - b + 1);
+    return b + (i32)(((u64)ThreadStream().rng.next() * range) >> 32);
 }
 
 f32 Random::RandomF32Range(f32 b, f32 e)
 {
-    std::uniform_real_distribution<f32> dist(b, e);
-    return dist(GlobalGenerator);
+    return b + (e - b) * RandomF32();
 }
 
 f32 Random::RandomF32()
 {
-    std::uniform_real_distribution<f32> dist(0.0f, 1.0f);
-    return dist(GlobalGenerator);
+    Stream& s = ThreadStream();
+    if(s.sampler != nullptr && s.dimension < s.sampler->dimensions)
+    {
+        f32 value = s.sampler->sample(s.sampler, &s);
+        s.dimension++;
+        return value;
+    }
+    return (s.rng.next() >> 8) * (1.0f / 16777216.0f); // 24 bits, never reaches 1
+}
+
+Vector3 Random::RandomUnitNorm()
+{
+    f32 z = 1.0f - 2.0f * RandomF32();
+    f32 r = sqrtf(std::max(0.0f, 1.0f - z * z));
+    f32 phi = 2.0f * PI * RandomF32();
+    return Vector3(r * cosf(phi), r * sinf(phi), z);
 }
 
 Vector3 Random::RandomUnitSphere()
 {
-    while(1)
-    {
-        Vector3 point(RandomF32Range(-1, 1), RandomF32Range(-1, 1), RandomF32Range(-1, 1));
-        if(Vector3::Dot(point, point) < 1) return point;
-    }
+    // Radius with the cube root so the volume is covered evenly
+    Vector3 d = RandomUnitNorm();
+    return d * cbrtf(RandomF32());
 }
 
 Vector3 Random::RandomUnitDisk()
 {
-    while(1)
-    {
-        Vector3 point(RandomF32Range(-1, 1), RandomF32Range(-1, 1), 0);
-        if(Vector3::Dot(point, point) < 1) return point;
-    }
+    f32 r = sqrtf(RandomF32());
+    f32 theta = 2.0f * PI * RandomF32();
+    return Vector3(r * cosf(theta), r * sinf(theta), 0);
 }
 
-Vector3 Random::RandomUnitNorm()
+Vector3 Random::RandomUnitHemisphere(const Vector3& n)
 {
-    return RandomUnitSphere().normalized();
+    Vector3 d = RandomUnitNorm();
+    return Vector3::Dot(d, n) < 0.0f ? -d : d;
+}
+
+Vector3 Random::RandomCosineHemisphere(const Vector3& n)
+{
+    // Disk sample lifted onto the hemisphere, in a basis around n (Duff et al. 2017, branchless)
+    f32 sign = copysignf(1.0f, n.z);
+    f32 a = -1.0f / (sign + n.z);
+    f32 b = n.x * n.y * a;
+    Vector3 t(1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+    Vector3 s(b, sign + n.y * n.y * a, -n.y);
+
+    Vector3 d = RandomUnitDisk();
+    f32 h = sqrtf(std::max(0.0f, 1.0f - d.x * d.x - d.y * d.y));
+    return t * d.x + s * d.y + n * h;
 }
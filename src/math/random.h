@@ -2,14 +2,66 @@
 #include "../common.h"
 #include "vector.h"
 
+struct Sampler;
+
 namespace Random
 {
+    // PCG32 (XSH RR), 16 bytes of state. Each thread owns one, so nothing is shared between workers.
+    struct PCG32
+    {
+        u64 state = 0x853c49e6748fea9bULL;
+        u64 inc = 0xda3e39cb94b95bdbULL;
+
+        POSSIBLE_INLINE void seed(u64 initState, u64 sequence)
+        {
+            state = 0;
+            inc = (sequence << 1) | 1;
+            next();
+            state += initState;
+            next();
+        }
+
+        POSSIBLE_INLINE u32 next()
+        {
+            u64 old = state;
+            state = old * 6364136223846793005ULL + inc;
+            u32 xorshifted = (u32)(((old >> 18) ^ old) >> 27);
+            u32 rot = (u32)(old >> 59);
+            return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
+        }
+    };
+
+    // Random numbers of one path: the dimensions of a low discrepancy Sampler while it has any, then PCG32.
+    // Each thread owns one, packets and the wavefront carry a copy per lane or path.
+    struct Stream
+    {
+        PCG32 rng;
+        const Sampler* sampler = nullptr;
+        u32 seed = 0;      // Per pixel (and frame) scrambling of the sampler
+        u32 index = 0;     // Sample of the pixel
+        u32 count = 0;     // Samples per pixel the sampler lays its strata out for
+        u32 dimension = 0; // Next dimension RandomF32 takes
+    };
+
+    // Stream of the calling thread, its PCG32 is seeded from std::random_device on first use unless SeedPixel came first
+    Stream& ThreadStream();
+
+    // Restarts the calling thread's stream on one pixel sample, the same (pixel, sample, frame)
+    // always gives the same numbers whatever thread draws them. Without a sampler it is plain PCG32.
+    void SeedPixel(u64 pixel, u32 sample, u32 frame, const Sampler* sampler = nullptr, u32 count = 0);
+
+    // Back to plain PCG32 numbers (for whatever runs next on a render thread)
+    void ClearSampler();
+
     i32 RandomI32Range(i32 b, i32 e);
 
     f32 RandomF32Range(f32 b, f32 e);
-    f32 RandomF32();
+    f32 RandomF32(); // [0, 1), the next sampler dimension when the stream has one
 
-    Vector3 RandomUnitSphere();
-    Vector3 RandomUnitDisk();
-    Vector3 RandomUnitNorm();
-}
\ No newline at end of file
+    // Closed form, two or three draws each (no rejection loops)
+    Vector3 RandomUnitSphere(); // Inside the unit ball
+    Vector3 RandomUnitDisk();   // Inside the unit disk (z = 0)
+    Vector3 RandomUnitNorm();   // On the unit sphere
+    Vector3 RandomUnitHemisphere(const Vector3& n);    // On the unit sphere, same side as n
+    Vector3 RandomCosineHemisphere(const Vector3& n);  // Unit vector around the unit normal n, pdf cos / PI
+}
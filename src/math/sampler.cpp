@@ -0,0 +1,207 @@
+#include "sampler.h"
+#include <cmath>
+#include <algorithm>
+
+#define HALTON_DIMENSIONS 32
+#define SOBOL_BASE_DIMENSIONS 4 // Dimensions are padded in groups of these, each group with its own index shuffle
+
+internal const u32 HaltonPrimes[HALTON_DIMENSIONS] = {
+      2,   3,   5,   7,  11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,
+     59,  61,  67,  71,  73,  79,  83,  89,  97, 101, 103, 107, 109, 113, 127, 131
+};
+
+internal POSSIBLE_INLINE u32 HashU32(u32 x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+internal POSSIBLE_INLINE u32 HashCombine(u32 seed, u32 v)
+{
+    return seed ^ (HashU32(v) + 0x9e3779b9U + (seed << 6) + (seed >> 2));
+}
+
+internal POSSIBLE_INLINE f32 ToUnitF32(u32 bits)
+{
+    return (bits >> 8) * (1.0f / 16777216.0f);
+}
+
+internal POSSIBLE_INLINE u32 ReverseBits(u32 x)
+{
+    x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+    x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+    x = ((x >> 8) & 0x00ff00ffU) | ((x & 0x00ff00ffU) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Kensler's hashed permutation of [0, l), the same p always gives the same shuffle
+internal u32 Permute(u32 i, u32 l, u32 p)
+{
+    u32 w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do
+    {
+        i ^= p;             i *= 0xe170893dU;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;        i *= 0x0929eb3fU;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;  i *= 1 | p >> 27;
+                            i *= 0x6935fa69U;
+        i ^= (i & w) >> 11; i *= 0x74dcb303U;
+        i ^= (i & w) >> 2;  i *= 0x9e501cc3U;
+        i ^= (i & w) >> 2;  i *= 0xc860a3dfU;
+        i &= w;
+        i ^= i >> 5;
+    } while(i >= l);
+    return (i + p) % l;
+}
+
+internal f32 SampleStratified(const Sampler* self, const Random::Stream* s)
+{
+    // Dimensions go in pairs over a sx * sy grid of the pixel's sample count, the strata of
+    // each pair are visited in a different order so the pairs don't line up with each other
+    const u32 n = s->count > 0 ? s->count : 1;
+    const u32 sx = std::max((u32)sqrtf((f32)n), 1u);
+    const u32 sy = (n + sx - 1) / sx;
+    const u32 pair = s->dimension / 2;
+    const u32 stratum = Permute(s->index % (sx * sy), sx * sy, HashCombine(s->seed, pair));
+    const f32 jitter = ToUnitF32(HashU32(HashCombine(HashCombine(s->seed, s->index), s->dimension)));
+
+    if(s->dimension & 1)
+        return std::min((stratum / sx + jitter) / sy, 0.99999994f);
+    return std::min((stratum % sx + jitter) / sx, 0.99999994f);
+}
+
+StratifiedSampler::StratifiedSampler()
+{
+    sample = SampleStratified;
+    dimensions = 0xffffffffU;
+}
+
+internal f32 SampleHalton(const Sampler* self, const Random::Stream* s)
+{
+    const u32 base = HaltonPrimes[s->dimension];
+    const f32 invBase = 1.0f / base;
+    f32 invBaseN = 1.0f;
+    f32 value = 0.0f;
+    for(u32 i = s->index; i > 0; i /= base)
+    {
+        invBaseN *= invBase;
+        value += (i % base) * invBaseN;
+    }
+
+    // Cranley-Patterson rotation, every pixel gets its own offset per dimension
+    value += ToUnitF32(HashCombine(s->seed, s->dimension));
+    value -= floorf(value);
+    return std::min(value, 0.99999994f);
+}
+
+HaltonSampler::HaltonSampler()
+{
+    sample = SampleHalton;
+    dimensions = HALTON_DIMENSIONS;
+}
+
+// Generator matrices of the first Sobol dimensions (van der Corput, then Joe-Kuo primitive polynomials)
+struct SobolDirections
+{
+    u32 v[SOBOL_BASE_DIMENSIONS][32];
+
+    SobolDirections()
+    {
+        struct Poly { u32 s; u32 a; u32 m[3]; };
+        const Poly polys[SOBOL_BASE_DIMENSIONS - 1] = {
+            { 1, 0, { 1, 0, 0 } },
+            { 2, 1, { 1, 3, 0 } },
+            { 3, 1, { 1, 3, 1 } }
+        };
+
+        for(u32 k = 0; k < 32; k++)
+        {
+            v[0][k] = 1U << (31 - k);
+        }
+        for(u32 d = 1; d < SOBOL_BASE_DIMENSIONS; d++)
+        {
+            const Poly& p = polys[d - 1];
+            for(u32 k = 0; k < 32; k++)
+            {
+                if(k < p.s)
+                {
+                    v[d][k] = p.m[k] << (31 - k);
+                    continue;
+                }
+                u32 x = v[d][k - p.s] ^ (v[d][k - p.s] >> p.s);
+                for(u32 j = 1; j < p.s; j++)
+                {
+                    if((p.a >> (p.s - 1 - j)) & 1) x ^= v[d][k - j];
+                }
+                v[d][k] = x;
+            }
+        }
+    }
+};
+
+internal const SobolDirections Sobol;
+
+internal POSSIBLE_INLINE u32 SobolSample(u32 index, u32 dimension)
+{
+    u32 x = 0;
+    for(u32 bit = 0; index != 0; index >>= 1, bit++)
+    {
+        if(index & 1) x ^= Sobol.v[dimension][bit];
+    }
+    return x;
+}
+
+// Owen scrambling as in Burley, "Practical Hash-based Owen Scrambling" (2020), with Vegdahl's improved hash.
+// Every step only carries bits upward, and the bits are reversed around it, so each output bit depends on the higher input bits only.
+internal POSSIBLE_INLINE u32 NestedUniformScramble(u32 x, u32 seed)
+{
+    x = ReverseBits(x);
+    x ^= x * 0x3d20adeaU;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56U;
+    x ^= x * 0x53a22864U;
+    return ReverseBits(x);
+}
+
+internal f32 SampleSobol(const Sampler* self, const Random::Stream* s)
+{
+    // Each group of base dimensions shuffles the sample order on its own, that decorrelates the groups
+    const u32 group = s->dimension / SOBOL_BASE_DIMENSIONS;
+    const u32 index = NestedUniformScramble(s->index, HashCombine(s->seed, group));
+    const u32 x = SobolSample(index, s->dimension % SOBOL_BASE_DIMENSIONS);
+    return ToUnitF32(NestedUniformScramble(x, HashCombine(s->seed, s->dimension + 0x51ed27U)));
+}
+
+SobolSampler::SobolSampler()
+{
+    sample = SampleSobol;
+    dimensions = 0xffffffffU;
+}
+
+const Sampler* Sampler::Get(SamplerType type)
+{
+    static const StratifiedSampler stratified;
+    static const HaltonSampler halton;
+    static const SobolSampler sobol;
+
+    switch(type)
+    {
+        case SamplerType::STRATIFIED: return &stratified;
+        case SamplerType::HALTON:     return &halton;
+        case SamplerType::SOBOL:      return &sobol;
+        default: return nullptr;
+    }
+}
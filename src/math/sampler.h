@@ -0,0 +1,49 @@
+#pragma once
+#include "../common.h"
+#include "random.h"
+
+enum class SamplerType
+{
+    UNIFORM,    // Independent PCG32 numbers
+    STRATIFIED, // Jittered grid per pair of dimensions, strata shuffled per pixel
+    HALTON,     // Prime bases per dimension, rotated per pixel
+    SOBOL       // Owen scrambled Sobol (hash based), padded so any dimension count works
+};
+
+POSSIBLE_INLINE const char* SamplerTypeName(SamplerType type)
+{
+    switch(type)
+    {
+        case SamplerType::UNIFORM:    return "Uniform";
+        case SamplerType::STRATIFIED: return "Stratified";
+        case SamplerType::HALTON:     return "Halton";
+        case SamplerType::SOBOL:      return "Sobol";
+    }
+    return "Unknown";
+}
+
+// Hands out the value of one dimension of one pixel sample. Random::RandomF32 walks the dimensions
+// of the calling thread's stream, so the camera, the lens and every scatter take the next ones in turn.
+struct Sampler
+{
+    virtual ~Sampler() {  };
+    f32 (*sample)(const Sampler* self, const Random::Stream* s);
+    u32 dimensions; // Past these the stream falls back to its PCG32
+
+    static const Sampler* Get(SamplerType type); // Shared and stateless, nullptr for UNIFORM
+};
+
+struct StratifiedSampler : Sampler
+{
+    StratifiedSampler();
+};
+
+struct HaltonSampler : Sampler
+{
+    HaltonSampler();
+};
+
+struct SobolSampler : Sampler
+{
+    SobolSampler();
+};
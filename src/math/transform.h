@@ -5,14 +5,34 @@
 
 struct Transform
 {
-    Matrix4 tmatrix;
+    Matrix4 tmatrix; // Object to world
+    Matrix4 inverse; // World to object, kept in sync by the functions below
 
     Vector3 position;
     Vector3 scaleValue;
+    bool identity = true; // Lets the hit functions skip the ray transform
+
+    inline void set(const Matrix4& m)
+    {
+        tmatrix = m;
+        updateInverse();
+    }
+
+    inline void updateInverse()
+    {
+        inverse = Matrix4::AffineInverse(tmatrix);
+        position = Vector3(tmatrix.data[3][0], tmatrix.data[3][1], tmatrix.data[3][2]);
+
+        identity = true;
+        for(i32 i = 0; i < 4; i++)
+            for(i32 j = 0; j < 4; j++)
+                if(tmatrix.data[i][j] != (i == j ? 1.0f : 0.0f)) identity = false;
+    }
 
     inline void rotate(const f32& angle, const Vector3& v)
     {
         tmatrix = Matrix4::Rotation(angle, v) * tmatrix;
+        updateInverse();
     }
 
     inline void rotate(const Vector3& axis, const f32& v)
@@ -24,6 +44,7 @@ struct Transform
     inline void translate(const Vector3& v)
     {
         tmatrix = Matrix4::Translation(v) * tmatrix;
+        updateInverse();
     }
 
     inline void scale(const f32& sx, const f32& sy, const f32& sz)
@@ -33,5 +54,6 @@ struct Transform
         sm.data[1][1] = sy;
         sm.data[2][2] = sz;
         tmatrix = sm * tmatrix;
+        updateInverse();
     }
 };
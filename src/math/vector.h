@@ -1,5 +1,6 @@
 #pragma once
 #include "../common.h"
+#include <cmath>
 
 #ifdef USE_GLM
 #include <glm/glm.hpp>
@@ -156,12 +156,31 @@ internal void DestroyInternal(OpenGLInternalData data)
     glDeleteProgram(data.rtProgram);
 }
 
-internal void rtTextureUpdate(OpenGLInternalData data, Image* img, std::mutex* mtx)
+// Uploads only the tiles finished since the last frame, from the pixel copies they carry. The image
+// itself is still being written by the next pass of a progressive render, so it is never read here.
+internal void rtTextureUpdate(OpenGLInternalData data, RenderJob* job)
 {
-    std::lock_guard<std::mutex> lock(*mtx);
+    DirtyTile* tiles = job->takeDirtyTiles();
+    if(tiles == nullptr)
+        return;
+
+    // The list is newest first, a region published twice must end up with its latest pass
+    DirtyTile* oldestFirst = nullptr;
+    while(tiles)
+    {
+        DirtyTile* next = tiles->next;
+        tiles->next = oldestFirst;
+        oldestFirst = tiles;
+        tiles = next;
+    }
+
     // TODO: Maybe consider using a PBO later on for performance
     glBindTexture(GL_TEXTURE_2D, data.rtTexture);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, data.w, data.h, GL_BGRA, GL_UNSIGNED_BYTE, img->data);
+    for(DirtyTile* t = oldestFirst; t != nullptr; t = t->next)
+    {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, t->x, t->y, t->w, t->h, GL_BGRA, GL_UNSIGNED_BYTE, t->pixels);
+    }
+    DirtyTileList::Free(oldestFirst);
 }
 
 void RasterDisplay::RunGLFWWindow()
@@ -232,7 +251,7 @@ void RasterDisplay::RunGLFWWindow()
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         Image* image = Overlay::GetRenderTarget();
-        if(image)
+        if(image && rs.renderJob)
         {
             // Update, resize and draw the rt'ed image
             if(last_h != image->h)
@@ -241,7 +260,7 @@ void RasterDisplay::RunGLFWWindow()
                 ResizeImageTex(&data, image->w, image->h);
                 last_h = image->h;
             }
-            rtTextureUpdate(data, image, rs.workingPool->getImage_mtx());
+            rtTextureUpdate(data, rs.renderJob);
         }
         glUseProgram(data.rtProgram);
         glBindVertexArray(data.rtVao);
@@ -254,9 +273,11 @@ void RasterDisplay::RunGLFWWindow()
         glfwSwapBuffers(window);
     }
 
-    // TODO: Convert this from thread joins into a work cancel
-    if(rs.workingPool)
-        rs.workingPool->fence();
+    if(rs.renderJob)
+    {
+        rs.renderJob->cancel();
+        rs.renderJob->fence();
+    }
 
     if(rs.world.top)
         Scene::FreeScene(&rs.world);
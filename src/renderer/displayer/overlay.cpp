@@ -8,6 +8,7 @@
 
 #include "../../thread/threadpool.h"
 #include "../raycaster/caster.h"
+#include "../raycaster/wavefront.h"
 
 // Loading samples
 #include "../samples/samples.h"
@@ -21,8 +22,6 @@ internal Overlay::RenderSettings renderSettings;
 internal Image* rtRenderTarget = nullptr;
 internal std::atomic<i32> loadingBarPct = -1;
 internal std::atomic<i32>  renderBarPct = -1;
-internal std::mutex renderBarMtx;
-internal f32 renderBarPctFloating = 0.0;
 internal std::chrono::time_point<std::chrono::steady_clock> loadStart;
 internal std::future<Scene> sceneHandle;
 
@@ -118,11 +117,18 @@ internal void LoadingWindow(GLFWwindow* window, const std::string& title, std::a
 
 internal void StartAsyncSceneLoad(Scene (*loader)(std::atomic<i32>* progress))
 {
+    // The running render (if any) reads the scene that is about to be freed
+    if(renderSettings.renderJob)
+    {
+        renderSettings.renderJob->cancel();
+        renderSettings.renderJob->fence();
+    }
+
     if(renderSettings.world.top)
         Scene::FreeScene(&renderSettings.world);
     loadingBarPct.store(0);
     loadStart = std::chrono::steady_clock::now();
-    sceneHandle = std::async(std::launch::async, loader, &loadingBarPct);
+    sceneHandle = ThreadPool::Get()->submit([loader]() { return loader(&loadingBarPct); });
 }
 
 internal void DisplayMenuBar()
@@ -145,6 +151,10 @@ internal void DisplayMenuBar()
                 {
                     StartAsyncSceneLoad(Samples::ColoredSpheres);
                 }
+                if(ImGui::MenuItem("ManySpheres"))
+                {
+                    StartAsyncSceneLoad(Samples::ManySpheres);
+                }
                 ImGui::EndMenu();
             }
             
@@ -180,8 +190,8 @@ internal void DisplayMenuBar()
             RENDER_SETTINGS_STORE(rtRender);
             if(rtRender)
             {
-                if(renderSettings.workingPool != nullptr)
-                    delete renderSettings.workingPool;
+                if(renderSettings.renderJob != nullptr)
+                    delete renderSettings.renderJob;
 
                 if(rtRenderTarget != nullptr)
                     delete rtRenderTarget;
@@ -192,25 +202,42 @@ internal void DisplayMenuBar()
                     4
                 );
                 
-                renderSettings.workingPool = new ThreadPool(
-                    RENDER_SETTINGS_LOAD(rtBlocksX),
-                    RENDER_SETTINGS_LOAD(rtBlocksY),
+                ThreadPool* pool = ThreadPool::Get();
+                pool->resize(RENDER_SETTINGS_LOAD(rtThreads), RENDER_SETTINGS_LOAD(rtPlacement));
+
+                AdaptiveSettings adaptive;
+                adaptive.enabled = RENDER_SETTINGS_LOAD(rtAdaptive);
+                adaptive.threshold = RENDER_SETTINGS_LOAD(rtAdaptiveThreshold);
+                adaptive.minSamples = (u32)RENDER_SETTINGS_LOAD(rtAdaptiveMinSamples);
+                adaptive.heatmap = RENDER_SETTINGS_LOAD(rtAdaptiveHeatmap);
+
+                renderSettings.renderJob = new RenderJob(
+                    RENDER_SETTINGS_LOAD(rtTileSize),
+                    RENDER_SETTINGS_LOAD(rtTileOrder),
+                    RENDER_SETTINGS_LOAD(rtTileSortByCost),
                     &renderSettings.world,
                     rtRenderTarget,
                     RENDER_SETTINGS_LOAD(rtSamples),
-                    calculateChunk,
+                    RENDER_SETTINGS_LOAD(rtProgressive) ? RENDER_SETTINGS_LOAD(rtPassSamples) : RENDER_SETTINGS_LOAD(rtSamples),
+                    RENDER_SETTINGS_LOAD(rtWavefront) ? calculateChunkWavefront : calculateChunk,
                     &renderSettings.rtRender,
-                    &renderBarPctFloating,
-                    &renderBarMtx
+                    RENDER_SETTINGS_LOAD(rtPacketSize),
+                    adaptive,
+                    RENDER_SETTINGS_LOAD(rtSampler)
                 );
 
                 loadStart = std::chrono::steady_clock::now();
                 renderBarPct.store(0);
-                renderBarPctFloating = 0.0f; // NOTE: No lock is okay here
-                renderSettings.workingPool->run();
+                renderSettings.renderJob->run(pool);
             }
         }
 
+        // Workers drop their tiles at the next pixel, rtRender clears once they are all out
+        if(ImGui::MenuItem("Stop", nullptr, false, rtRender && renderSettings.renderJob))
+        {
+            renderSettings.renderJob->cancel();
+        }
+
         ImGui::Separator();
         // ImGui::Dummy(ImVec2(100.0f, 0.0f));
 
@@ -255,60 +282,243 @@ internal void DisplaySettings()
             ImGui::PopItemWidth();
         }
 
+        // RT Sampler
+        {
+            ImGui::PushItemWidth(ITEM_SIZE);
+            static SamplerType samplers[4] = { SamplerType::UNIFORM, SamplerType::STRATIFIED, SamplerType::HALTON, SamplerType::SOBOL };
+            SamplerType current = RENDER_SETTINGS_LOAD(rtSampler);
+            if(ImGui::BeginCombo("Sampler", SamplerTypeName(current)))
+            {
+                for(i32 i = 0; i < 4; i++)
+                {
+                    bool is_selected = (current == samplers[i]);
+                    if(ImGui::Selectable(SamplerTypeName(samplers[i]), is_selected))
+                    {
+                        SamplerType rtSampler = samplers[i];
+                        RENDER_SETTINGS_STORE(rtSampler);
+                    }
+                    if (is_selected)
+                    {
+                        ImGui::SetItemDefaultFocus();
+                    }
+                }
+                ImGui::EndCombo();
+            }
+            ImGui::PopItemWidth();
+        }
+
+        // RT Progressive passes
+        {
+            ImGui::PushItemWidth(ITEM_SIZE);
+            i32 currentIdx = RENDER_SETTINGS_LOAD(rtProgressive) ? 1 : 0;
+            static std::string opt[2] = { "Off",  "On" };
+            if(ImGui::BeginCombo("Progressive", opt[currentIdx].c_str()))
+            {
+                for(i32 i = 0; i < 2; i++)
+                {
+                    bool is_selected = (currentIdx == i);
+                    if(ImGui::Selectable(opt[i].c_str(), is_selected))
+                    {
+                        bool rtProgressive = (i == 1);
+                        RENDER_SETTINGS_STORE(rtProgressive);
+                    }
+                    if (is_selected)
+                    {
+                        ImGui::SetItemDefaultFocus();
+                    }
+                }
+                ImGui::EndCombo();
+            }
+            ImGui::PopItemWidth();
+        }
+
+        if(RENDER_SETTINGS_LOAD(rtProgressive))
+        {
+            ImGui::PushItemWidth(ITEM_SIZE);
+            static i32 rtPassSamples = RENDER_SETTINGS_LOAD(rtPassSamples);
+            if(ImGui::InputInt("Samples per Pass", &rtPassSamples, 1, 8))
+            {
+                if(rtPassSamples < 1) rtPassSamples = 1;
+                RENDER_SETTINGS_STORE(rtPassSamples);
+            }
+            ImGui::PopItemWidth();
+        }
+
+        // RT Adaptive sampling
+        {
+            ImGui::PushItemWidth(ITEM_SIZE);
+            i32 currentIdx = RENDER_SETTINGS_LOAD(rtAdaptive) ? 1 : 0;
+            static std::string opt[2] = { "Off",  "On" };
+            if(ImGui::BeginCombo("Adaptive Sampling", opt[currentIdx].c_str()))
+            {
+                for(i32 i = 0; i < 2; i++)
+                {
+                    bool is_selected = (currentIdx == i);
+                    if(ImGui::Selectable(opt[i].c_str(), is_selected))
+                    {
+                        bool rtAdaptive = (i == 1);
+                        RENDER_SETTINGS_STORE(rtAdaptive);
+                    }
+                    if (is_selected)
+                    {
+                        ImGui::SetItemDefaultFocus();
+                    }
+                }
+                ImGui::EndCombo();
+            }
+            ImGui::PopItemWidth();
+        }
+
+        if(RENDER_SETTINGS_LOAD(rtAdaptive))
+        {
+            ImGui::PushItemWidth(ITEM_SIZE);
+            static f32 rtAdaptiveThreshold = RENDER_SETTINGS_LOAD(rtAdaptiveThreshold);
+            if(ImGui::InputFloat("Noise Threshold", &rtAdaptiveThreshold, 0.005f, 0.05f, "%.3f"))
+            {
+                if(rtAdaptiveThreshold < 0.001f) rtAdaptiveThreshold = 0.001f;
+                RENDER_SETTINGS_STORE(rtAdaptiveThreshold);
+            }
+
+            static i32 rtAdaptiveMinSamples = RENDER_SETTINGS_LOAD(rtAdaptiveMinSamples);
+            if(ImGui::InputInt("Min Samples", &rtAdaptiveMinSamples, 1, 16))
+            {
+                if(rtAdaptiveMinSamples < 2) rtAdaptiveMinSamples = 2;
+                RENDER_SETTINGS_STORE(rtAdaptiveMinSamples);
+            }
+
+            i32 currentIdx = RENDER_SETTINGS_LOAD(rtAdaptiveHeatmap) ? 1 : 0;
+            static std::string opt[2] = { "Off",  "On" };
+            if(ImGui::BeginCombo("Sample Heatmap", opt[currentIdx].c_str()))
+            {
+                for(i32 i = 0; i < 2; i++)
+                {
+                    bool is_selected = (currentIdx == i);
+                    if(ImGui::Selectable(opt[i].c_str(), is_selected))
+                    {
+                        bool rtAdaptiveHeatmap = (i == 1);
+                        RENDER_SETTINGS_STORE(rtAdaptiveHeatmap);
+                    }
+                    if (is_selected)
+                    {
+                        ImGui::SetItemDefaultFocus();
+                    }
+                }
+                ImGui::EndCombo();
+            }
+            ImGui::PopItemWidth();
+        }
+
         // RT Threads
         {
             ImGui::PushItemWidth(ITEM_SIZE);
             static int threadConcurrency = std::thread::hardware_concurrency();
-            static std::string current = std::to_string(threadConcurrency);
+            static i32 rtThreads = RENDER_SETTINGS_LOAD(rtThreads) > 0 ? RENDER_SETTINGS_LOAD(rtThreads) : threadConcurrency;
+            std::string current = std::to_string(rtThreads);
             if(ImGui::BeginCombo("Threads", current.c_str()))
             {
-                i32 rtThreads = 1;
                 for(i32 i = 0; i < threadConcurrency; i++)
                 {
-                    std::string str = std::to_string(i + 1);
-                    bool is_selected = (current == str);
-                    if(ImGui::Selectable(str.c_str(), is_selected))
+                    bool is_selected = (rtThreads == i + 1);
+                    if(ImGui::Selectable(std::to_string(i + 1).c_str(), is_selected))
                     {
-                        current = str;
                         rtThreads = i + 1;
+                        RENDER_SETTINGS_STORE(rtThreads);
                     }
                     if (is_selected)
                     {
                         ImGui::SetItemDefaultFocus();
                     }
                 }
+                ImGui::EndCombo();
+            }
+            ImGui::PopItemWidth();
+        }
 
-                RENDER_SETTINGS_STORE(rtThreads);
-
+        // RT Worker placement
+        {
+            ImGui::PushItemWidth(ITEM_SIZE);
+            static WorkerPlacement placements[3] = { WorkerPlacement::NONE, WorkerPlacement::SPREAD, WorkerPlacement::COMPACT };
+            WorkerPlacement current = RENDER_SETTINGS_LOAD(rtPlacement);
+            if(ImGui::BeginCombo("Worker Placement", WorkerPlacementName(current)))
+            {
+                for(i32 i = 0; i < 3; i++)
+                {
+                    bool is_selected = (current == placements[i]);
+                    if(ImGui::Selectable(WorkerPlacementName(placements[i]), is_selected))
+                    {
+                        WorkerPlacement rtPlacement = placements[i];
+                        RENDER_SETTINGS_STORE(rtPlacement);
+                    }
+                    if (is_selected)
+                    {
+                        ImGui::SetItemDefaultFocus();
+                    }
+                }
                 ImGui::EndCombo();
             }
             ImGui::PopItemWidth();
         }
 
-        // RT Grid Blocks
+        // RT Tiles
         {
-            static i32 rtBlocksX = RENDER_SETTINGS_LOAD(rtBlocksX);
-            static i32 rtBlocksY = RENDER_SETTINGS_LOAD(rtBlocksY);
-
-            ImGui::PushItemWidth(25);
-            ImGui::PushID(0);
-            bool changed = ImGui::InputInt("", &rtBlocksX, 0, 1);
-            ImGui::PopID();
-            ImGui::SameLine();
-            ImGui::Text("x");
-            ImGui::SameLine();
-            ImGui::PushID(1);
-            changed |= ImGui::InputInt("", &rtBlocksY, 0, 1);
-            ImGui::PopID();
-            ImGui::SameLine();
-            ImGui::Text("Blocks");
+            ImGui::PushItemWidth(ITEM_SIZE);
+            static i32 rtTileSize = RENDER_SETTINGS_LOAD(rtTileSize);
+            if(ImGui::InputInt("Tile Size", &rtTileSize, 8, 32))
+            {
+                if(rtTileSize < 8) rtTileSize = 8;
+                RENDER_SETTINGS_STORE(rtTileSize);
+            }
             ImGui::PopItemWidth();
+        }
 
-            if(changed)
+        // RT Tile order
+        {
+            ImGui::PushItemWidth(ITEM_SIZE);
+            static TileOrder orders[3] = { TileOrder::SCANLINE, TileOrder::SPIRAL, TileOrder::HILBERT };
+            TileOrder current = RENDER_SETTINGS_LOAD(rtTileOrder);
+            if(ImGui::BeginCombo("Tile Order", TileOrderName(current)))
             {
-                RENDER_SETTINGS_STORE(rtBlocksX);
-                RENDER_SETTINGS_STORE(rtBlocksY);
+                for(i32 i = 0; i < 3; i++)
+                {
+                    bool is_selected = (current == orders[i]);
+                    if(ImGui::Selectable(TileOrderName(orders[i]), is_selected))
+                    {
+                        TileOrder rtTileOrder = orders[i];
+                        RENDER_SETTINGS_STORE(rtTileOrder);
+                    }
+                    if (is_selected)
+                    {
+                        ImGui::SetItemDefaultFocus();
+                    }
+                }
+                ImGui::EndCombo();
             }
+            ImGui::PopItemWidth();
+        }
+
+        // RT Tile cost pre-pass
+        {
+            ImGui::PushItemWidth(ITEM_SIZE);
+            i32 currentIdx = RENDER_SETTINGS_LOAD(rtTileSortByCost) ? 1 : 0;
+            static std::string opt[2] = { "Off",  "On" };
+            if(ImGui::BeginCombo("Longest Tiles First", opt[currentIdx].c_str()))
+            {
+                for(i32 i = 0; i < 2; i++)
+                {
+                    bool is_selected = (currentIdx == i);
+                    if(ImGui::Selectable(opt[i].c_str(), is_selected))
+                    {
+                        bool rtTileSortByCost = (i == 1);
+                        RENDER_SETTINGS_STORE(rtTileSortByCost);
+                    }
+                    if (is_selected)
+                    {
+                        ImGui::SetItemDefaultFocus();
+                    }
+                }
+                ImGui::EndCombo();
+            }
+            ImGui::PopItemWidth();
         }
 
         // RT Image resolution
@@ -342,6 +552,65 @@ internal void DisplaySettings()
             ImGui::PopItemWidth();
         }
         
+        // Integrator
+        {
+            ImGui::PushItemWidth(ITEM_SIZE);
+            i32 currentIdx = RENDER_SETTINGS_LOAD(rtWavefront) ? 1 : 0;
+            static std::string opt[2] = { "Recursive", "Wavefront" };
+            if(ImGui::BeginCombo("Integrator", opt[currentIdx].c_str()))
+            {
+                for(i32 i = 0; i < 2; i++)
+                {
+                    bool is_selected = (opt[currentIdx] == opt[i]);
+                    if(ImGui::Selectable(opt[i].c_str(), is_selected))
+                    {
+                        currentIdx = i;
+                    }
+                    if (is_selected)
+                    {
+                        ImGui::SetItemDefaultFocus();
+                    }
+                }
+                bool rtWavefront = opt[currentIdx] == "Wavefront";
+                RENDER_SETTINGS_STORE(rtWavefront);
+
+                ImGui::EndCombo();
+            }
+            ImGui::PopItemWidth();
+        }
+
+        // Primary ray packets
+        {
+            ImGui::PushItemWidth(ITEM_SIZE);
+            static i32 sizes[4] = { 1, 4, 8, 16 };
+            static std::string opt[4] = { "Off", "4", "8", "16" };
+            i32 currentIdx = 0;
+            for(i32 i = 0; i < 4; i++)
+            {
+                if(sizes[i] == RENDER_SETTINGS_LOAD(rtPacketSize)) currentIdx = i;
+            }
+            if(ImGui::BeginCombo("Ray Packets", opt[currentIdx].c_str()))
+            {
+                for(i32 i = 0; i < 4; i++)
+                {
+                    bool is_selected = (currentIdx == i);
+                    if(ImGui::Selectable(opt[i].c_str(), is_selected))
+                    {
+                        currentIdx = i;
+                    }
+                    if (is_selected)
+                    {
+                        ImGui::SetItemDefaultFocus();
+                    }
+                }
+                i32 rtPacketSize = sizes[currentIdx];
+                RENDER_SETTINGS_STORE(rtPacketSize);
+
+                ImGui::EndCombo();
+            }
+            ImGui::PopItemWidth();
+        }
+
         // Raster Enable/Disable
         {
             ImGui::PushItemWidth(ITEM_SIZE);
@@ -410,14 +679,17 @@ void Overlay::Display(GLFWwindow* window)
     });
     if(renderBarPct.load() >= 0) 
     {
-        // FIX: Don't do this dumb stuff... Atomic and mutex ?? Why am I so lazy
-        {
-            std::lock_guard<std::mutex> lock(renderBarMtx);
-            renderBarPct.store((i32)renderBarPctFloating);
-        }
+        if(renderSettings.renderJob)
+            renderBarPct.store((i32)renderSettings.renderJob->progress());
+
         LoadingWindow(window, "Rendering", &renderBarPct, [](GLFWwindow* window){ 
+                // Stopped before a whole pass, not a finished render (a progressive one keeps its done passes)
+                i32 spp = renderSettings.renderJob ? renderSettings.renderJob->samplesDone() : RENDER_SETTINGS_LOAD(rtSamples);
+                if(spp == 0)
+                    return;
+
                 lastRenderRes = RENDER_SETTINGS_LOAD(rtImageH);
-                lastRenderSpp = RENDER_SETTINGS_LOAD(rtSamples);
+                lastRenderSpp = spp;
                 lastRenderTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(
                     std::chrono::steady_clock::now() - loadStart
                 ).count();
@@ -1,10 +1,13 @@
 #pragma once
 #include "../../common.h"
 #include "../scene.h"
+#include "../../thread/tile_scheduler.h"
+#include "../../thread/topology.h"
+#include "../../math/sampler.h"
 
 struct GLFWwindow;
 
-class ThreadPool;
+class RenderJob;
 
 namespace Overlay
 {
@@ -17,20 +20,32 @@ namespace Overlay
     struct RenderSettings
     {
         std::atomic<i32> rtSamples = 8;
-        std::atomic<i32> rtThreads = 1;
-
-        std::atomic<i32> rtBlocksX = 8;
-        std::atomic<i32> rtBlocksY = 8;
+        std::atomic<SamplerType> rtSampler = SamplerType::SOBOL;
+        std::atomic<bool> rtProgressive = false; // Whole image passes of rtPassSamples into a float buffer, stop any time
+        std::atomic<i32> rtPassSamples = 1;
+        std::atomic<bool> rtAdaptive = false; // Stops converged pixels, the rest of the budget goes to the noisy ones
+        std::atomic<f32> rtAdaptiveThreshold = 0.02f;
+        std::atomic<i32> rtAdaptiveMinSamples = 16;
+        std::atomic<bool> rtAdaptiveHeatmap = false; // Shows the samples per pixel instead of the image
+        std::atomic<i32> rtThreads = 0; // Size of the shared ThreadPool while rendering, 0 uses every hardware thread
+        std::atomic<WorkerPlacement> rtPlacement = WorkerPlacement::NONE; // Pins the pool workers to cores
+
+        std::atomic<i32> rtTileSize = 32; // Pixels per tile side, the scheduler splits them further at the end
+        std::atomic<TileOrder> rtTileOrder = TileOrder::SPIRAL;
+        std::atomic<bool> rtTileSortByCost = false; // Low spp pre-pass, then the most expensive tiles go first
 
         std::atomic<u32> rtImageW = 1280;
         std::atomic<u32> rtImageH = 720;
 
+        std::atomic<i32> rtPacketSize = 1; // Primary rays per packet (1, 4, 8 or 16)
+        std::atomic<bool> rtWavefront = false; // Breadth-first integrator (packets are not used there)
+
         std::atomic<bool> rtRender = false;
 
         std::atomic<bool> rasterRender = false;
 
 
-        ThreadPool* workingPool = nullptr;
+        RenderJob* renderJob = nullptr;
         Scene world;
     };
 
@@ -393,6 +393,8 @@ void Raster::RenderRaster(GLFWwindow* window, Scene* world, Overlay::RenderSetti
     i32 i = 0;
     for(auto o : world->objList)
     {
+        if(rasterDataArray[o->model->mesh->type].empty()) continue; // No preview geometry (sphere sets)
+
         if(i >= rasterRandomColors.size())
         {
             rasterRandomColors.push_back(Vector3(
@@ -401,7 +403,6 @@ void Raster::RenderRaster(GLFWwindow* window, Scene* world, Overlay::RenderSetti
                 Random::RandomF32Range(0, 1)
             ));
         }
-        // FIX: Redo the bvh's for transform coordinates ....
         Matrix4 M = o->transform.tmatrix;
         glUniformMatrix4fv(
             glGetUniformLocation(program, "model"), 1, GL_FALSE,
@@ -0,0 +1,65 @@
+#pragma once
+#include "../../../common.h"
+
+enum class BVHBuildMode
+{
+    MEDIAN,     // Random axis, full sort and median split (at most 2 primitives per leaf)
+    SAH_BINNED, // Binned surface area heuristic (up to maxLeafSize primitives per leaf)
+    LBVH,       // Morton code sort and radix tree emission, fastest build (triangle meshes only)
+    SBVH        // SAH with spatial splits, duplicates triangles straddling split planes (triangle meshes only)
+};
+
+enum class BVHLayout
+{
+    TREE,  // Heap allocated BVHNodeTri nodes, recursive traversal
+    FLAT,  // Contiguous depth-first FlatBVHNode array, stack traversal
+    WIDE4, // Collapsed 4-wide tree, SSE child box tests
+    WIDE8  // Collapsed 8-wide tree, AVX child box tests (2x SSE without AVX)
+};
+
+struct BVHBuildSettings
+{
+    BVHBuildMode mode = BVHBuildMode::SAH_BINNED;
+    BVHLayout layout = BVHLayout::WIDE8;
+    bool cache = true; // Load/save the built mesh next to its file (FLAT and WIDE layouts only)
+    u32 triangleBlockWidth = 4; // FLAT and WIDE only: leaves are tested as SoA blocks of 4 (SSE) or 8 (AVX) triangles, 0 tests each Triangle
+
+    // SAH_BINNED, LBVH and SBVH
+    u32 binCount = 16;
+    u32 maxLeafSize = 4; // NOTE: BVHNode leaves can only hold 2 objects, this is clamped there
+    f32 traversalCost = 1.0f;
+    f32 intersectionCost = 1.0f;
+    u32 buildThreads = 0; // Parallel tasks on the shared ThreadPool, 0 uses one per pool thread, 1 builds serially (same tree either way)
+
+    // LBVH only
+    u32 mortonBits = 30;  // 30 (10 per axis) or 63 (21 per axis)
+    u32 treeletBits = 12; // Treelets sharing these top Morton bits get an SAH top level (HLBVH), 0 disables it
+
+    // SBVH only
+    f32 splitAlpha = 1e-5f;        // Spatial splits are tried when object split children overlap more than this fraction of the root area
+    f32 duplicationBudget = 0.3f;  // Extra triangle references allowed, as a fraction of the triangle count
+};
+
+POSSIBLE_INLINE const char* BVHBuildModeName(BVHBuildMode mode)
+{
+    switch(mode)
+    {
+        case BVHBuildMode::MEDIAN:     return "Median";
+        case BVHBuildMode::SAH_BINNED: return "SAH";
+        case BVHBuildMode::LBVH:       return "LBVH";
+        case BVHBuildMode::SBVH:       return "SBVH";
+    }
+    return "Unknown";
+}
+
+POSSIBLE_INLINE const char* BVHLayoutName(BVHLayout layout)
+{
+    switch(layout)
+    {
+        case BVHLayout::TREE:  return "Tree";
+        case BVHLayout::FLAT:  return "Flat";
+        case BVHLayout::WIDE4: return "BVH4";
+        case BVHLayout::WIDE8: return "BVH8";
+    }
+    return "Unknown";
+}
@@ -2,12 +2,29 @@
 #include "../../../math/random.h"
 #include "../hittable/object.h"
 #include "../hittable/model.h"
+#include "../../../thread/threadpool.h"
 #include <algorithm>
+#include <limits>
+
+internal void CollectBVHObjects(const BVHNode* node, std::vector<Object*>* out)
+{
+    if(node->nleft != nullptr)
+    {
+        CollectBVHObjects(node->nleft, out);
+        CollectBVHObjects(node->nright, out);
+        return;
+    }
+
+    out->push_back(node->left);
+    if(node->left != node->right)
+        out->push_back(node->right);
+}
 
 std::vector<Object*> BVHNode::GetAllObjectsList()
 {
-    // TODO: Usefull for bvh caching maybe (???)
-    return std::vector<Object*>();
+    std::vector<Object*> objects;
+    CollectBVHObjects(this, &objects);
+    return objects;
 }
 
 bool BVHNode::traverse(const Ray* r, f32 tmin, f32 tmax, HitRecord* rec)
@@ -54,16 +71,50 @@ bool BVHNodeTri::traverse(const Ray* r, f32 tmin, f32 tmax, HitRecord* rec)
         return hit_left || hit_right;
     }
 
-    // This is a leaf with 2 Objects
-    if(this->left != this->right)
+    // This is a leaf with the triangles [left, right]
+    bool hit = false;
+    for(Triangle* t = this->left; t <= this->right; t++)
     {
-        bool hit_left  = this->left->hit(this->mesh, r, tmin, tmax, rec);
-        bool hit_right = this->right->hit(this->mesh, r, tmin, hit_left ? rec->t : tmax, rec);
-        return hit_left || hit_right;
+        if(t->hit(this->mesh, r, tmin, hit ? rec->t : tmax, rec))
+            hit = true;
     }
-    
-    // This is a leaf with 1 Object (left == right)
-    return this->left->hit(this->mesh, r, tmin, tmax, rec);
+    return hit;
+}
+
+bool BVHNode::occluded(const Ray* r, f32 tmin, f32 tmax)
+{
+    if(!this->box.hit(r, tmin, tmax))
+    {
+        return false;
+    }
+
+    if(this->nleft != nullptr)
+    {
+        return this->nleft->occluded(r, tmin, tmax) || this->nright->occluded(r, tmin, tmax);
+    }
+
+    return this->left->occluded(this->left, r, tmin, tmax) ||
+           (this->left != this->right && this->right->occluded(this->right, r, tmin, tmax));
+}
+
+bool BVHNodeTri::occluded(const Ray* r, f32 tmin, f32 tmax)
+{
+    if(!this->box.hit(r, tmin, tmax))
+    {
+        return false;
+    }
+
+    if(this->nleft != nullptr)
+    {
+        return this->nleft->occluded(r, tmin, tmax) || this->nright->occluded(r, tmin, tmax);
+    }
+
+    for(Triangle* t = this->left; t <= this->right; t++)
+    {
+        if(t->occluded(this->mesh, r, tmin, tmax))
+            return true;
+    }
+    return false;
 }
 
 internal bool BoxCompare(Object* o0, Object* o1, i32 axis)
@@ -136,9 +187,431 @@ internal BVHNode* NewBVHNodeIter(const std::vector<Object*>& objects, i32 start,
     return parent;
 }
 
-BVHNode* BVHNode::NewBVHTree(std::vector<Object*> objects)
+#define MAX_SAH_BINS 64
+#define PARALLEL_BIN_THRESHOLD  (1 << 16) // Primitives needed before binning is split across threads
+#define PARALLEL_TASK_THRESHOLD (1 << 12) // Primitives needed before a subtree is built on another thread
+
+struct SAHBin
+{
+    AABB box = AABB::Empty();
+    u32 count = 0;
+};
+
+struct SAHBinning
+{
+    SAHBin bins[3][MAX_SAH_BINS];
+};
+
+struct SAHSplit
+{
+    i32 axis = -1; // -1 when no valid split was found
+    i32 bin  = -1; // Last bin that goes to the left child
+    f32 cost = std::numeric_limits<f32>::max();
+    AABB leftBox;
+    AABB rightBox;
+};
+
+struct SAHBuildContext
+{
+    const BVHBuildSettings* settings;
+    i32 nbins;
+    i32 maxLeafSize;
+};
+
+struct BVHObjectRef
+{
+    Object* object;
+    AABB box;
+};
+
+internal POSSIBLE_INLINE i32 SAHBinIndex(f32 c, f32 cmin, f32 scale, i32 nbins)
+{
+    i32 b = (i32)((c - cmin) * scale);
+    if(b < 0) b = 0;
+    if(b >= nbins) b = nbins - 1;
+    return b;
+}
+
+internal POSSIBLE_INLINE i32 SAHBinCount(const BVHBuildSettings& settings)
 {
-    return NewBVHNodeIter(objects, 0, (i32)objects.size());
+    i32 nbins = (i32)settings.binCount;
+    if(nbins < 2) nbins = 2;
+    if(nbins > MAX_SAH_BINS) nbins = MAX_SAH_BINS;
+    return nbins;
+}
+
+internal POSSIBLE_INLINE u32 BuildThreadCount(const BVHBuildSettings& settings)
+{
+    if(settings.buildThreads > 0) return settings.buildThreads;
+    return ThreadPool::Get()->size();
+}
+
+internal POSSIBLE_INLINE i32 LargestAxis(const AABB& box)
+{
+    Vector3 d = box.max - box.min;
+    if(d.x > d.y && d.x > d.z) return 0;
+    return d.y > d.z ? 1 : 2;
+}
+
+// Splits [0, count) into one chunk per thread and runs func(begin, end, chunk) for each of them on the shared pool
+template<typename Func>
+internal void ParallelChunks(i32 count, u32 threads, Func func)
+{
+    if(threads <= 1)
+    {
+        func(0, count, 0u);
+        return;
+    }
+
+    i32 step = (count + (i32)threads - 1) / (i32)threads;
+    ThreadPool::Get()->parallelFor(0, threads, 1, [&](i64 first, i64 last) {
+        for(i64 c = first; c < last; c++)
+        {
+            i32 begin = std::min((i32)c * step, count);
+            i32 end = std::min(begin + step, count);
+            func(begin, end, (u32)c);
+        }
+    });
+}
+
+// NOTE: Every reduction below is a min/max or an integer sum, so the results (and the tree)
+//       are exactly the same no matter how many threads are used.
+template<typename Prim>
+internal void ComputeSAHBounds(const Prim* prims, i32 count, u32 threads, AABB* box, AABB* centroidBox)
+{
+    if(count < PARALLEL_BIN_THRESHOLD) threads = 1;
+
+    std::vector<AABB> local(2 * threads, AABB::Empty());
+    ParallelChunks(count, threads, [&](i32 begin, i32 end, u32 chunk) {
+        AABB b = AABB::Empty();
+        AABB c = AABB::Empty();
+        for(i32 i = begin; i < end; i++)
+        {
+            b = AABB::SurroundingBox(b, prims[i].box);
+            c = AABB::SurroundingPoint(c, prims[i].box.centroid());
+        }
+        local[2 * chunk] = b;
+        local[2 * chunk + 1] = c;
+    });
+
+    *box = AABB::Empty();
+    *centroidBox = AABB::Empty();
+    for(u32 i = 0; i < threads; i++)
+    {
+        *box = AABB::SurroundingBox(*box, local[2 * i]);
+        *centroidBox = AABB::SurroundingBox(*centroidBox, local[2 * i + 1]);
+    }
+}
+
+// Bins the primitives by centroid along every axis and returns the cheapest split plane
+template<typename Prim>
+internal SAHSplit FindBinnedSAHSplit(const Prim* prims, i32 count, const AABB& nodeBox, const AABB& centroidBox, const SAHBuildContext& ctx, u32 threads)
+{
+    if(count < PARALLEL_BIN_THRESHOLD) threads = 1;
+
+    const i32 nbins = ctx.nbins;
+    f32 cmin[3];
+    f32 scale[3];
+    for(i32 axis = 0; axis < 3; axis++)
+    {
+        f32 extent = centroidBox.max.data[axis] - centroidBox.min.data[axis];
+        cmin[axis] = centroidBox.min.data[axis];
+        scale[axis] = extent > 0.0f ? nbins / extent : 0.0f;
+    }
+
+    // Every chunk bins into its own copy, merged afterwards
+    std::vector<SAHBinning> local(threads);
+    ParallelChunks(count, threads, [&](i32 begin, i32 end, u32 chunk) {
+        SAHBinning& binning = local[chunk];
+        for(i32 i = begin; i < end; i++)
+        {
+            Vector3 c = prims[i].box.centroid();
+            for(i32 axis = 0; axis < 3; axis++)
+            {
+                if(scale[axis] == 0.0f) continue;
+                SAHBin& bin = binning.bins[axis][SAHBinIndex(c.data[axis], cmin[axis], scale[axis], nbins)];
+                bin.box = AABB::SurroundingBox(bin.box, prims[i].box);
+                bin.count++;
+            }
+        }
+    });
+
+    for(u32 t = 1; t < threads; t++)
+    {
+        for(i32 axis = 0; axis < 3; axis++)
+        {
+            for(i32 i = 0; i < nbins; i++)
+            {
+                SAHBin& dst = local[0].bins[axis][i];
+                const SAHBin& src = local[t].bins[axis][i];
+                dst.box = AABB::SurroundingBox(dst.box, src.box);
+                dst.count += src.count;
+            }
+        }
+    }
+
+    SAHSplit best;
+    const BVHBuildSettings& settings = *ctx.settings;
+    f32 nodeArea = nodeBox.surfaceArea();
+    f32 invNodeArea = nodeArea > 0.0f ? 1.0f / nodeArea : 1.0f;
+
+    for(i32 axis = 0; axis < 3; axis++)
+    {
+        if(scale[axis] == 0.0f) continue;
+        const SAHBin* bins = local[0].bins[axis];
+
+        // Sweep from the right to accumulate the right side of every plane
+        AABB rightBox[MAX_SAH_BINS];
+        u32 rightCount[MAX_SAH_BINS];
+        AABB acc = AABB::Empty();
+        u32 accCount = 0;
+        for(i32 i = nbins - 1; i > 0; i--)
+        {
+            acc = AABB::SurroundingBox(acc, bins[i].box);
+            accCount += bins[i].count;
+            rightBox[i - 1] = acc;
+            rightCount[i - 1] = accCount;
+        }
+
+        // Then sweep from the left evaluating the cost of every plane
+        acc = AABB::Empty();
+        accCount = 0;
+        for(i32 i = 0; i < nbins - 1; i++)
+        {
+            acc = AABB::SurroundingBox(acc, bins[i].box);
+            accCount += bins[i].count;
+            if(accCount == 0 || rightCount[i] == 0) continue;
+
+            f32 cost = settings.traversalCost + settings.intersectionCost * invNodeArea *
+                (accCount * acc.surfaceArea() + rightCount[i] * rightBox[i].surfaceArea());
+            if(cost < best.cost)
+            {
+                best.axis = axis;
+                best.bin  = i;
+                best.cost = cost;
+                best.leftBox  = acc;
+                best.rightBox = rightBox[i];
+            }
+        }
+    }
+    return best;
+}
+
+// Moves the primitives left of the split plane to the front, returns the first one on the right
+template<typename Prim>
+internal i32 PartitionSAHSplit(Prim* prims, i32 count, const SAHSplit& split, const AABB& box, const AABB& centroidBox, const SAHBuildContext& ctx)
+{
+    i32 mid = 0;
+    if(split.axis >= 0)
+    {
+        f32 cmin = centroidBox.min.data[split.axis];
+        f32 scale = ctx.nbins / (centroidBox.max.data[split.axis] - cmin);
+        Prim* m = std::partition(prims, prims + count, [&](const Prim& p) -> bool {
+            return SAHBinIndex(p.box.centroid().data[split.axis], cmin, scale, ctx.nbins) <= split.bin;
+        });
+        mid = (i32)(m - prims);
+    }
+
+    if(split.axis < 0 || mid == 0 || mid == count)
+    {
+        // All the centroids are coincident - just split in half
+        i32 axis = LargestAxis(box);
+        mid = count / 2;
+        std::nth_element(prims, prims + mid, prims + count, [axis](const Prim& a, const Prim& b) -> bool {
+            return a.box.centroid().data[axis] < b.box.centroid().data[axis];
+        });
+    }
+    return mid;
+}
+
+internal POSSIBLE_INLINE void SetSAHLeaf(BVHNode* node, BVHObjectRef* prims, i32 count)
+{
+    node->left  = prims[0].object;
+    node->right = prims[count - 1].object;
+}
+
+internal POSSIBLE_INLINE void SetSAHLeaf(BVHNodeTri* node, Triangle* prims, i32 count)
+{
+    node->left  = &prims[0];
+    node->right = &prims[count - 1];
+}
+
+internal POSSIBLE_INLINE void SetSAHLeaf(BVHNodeBox* node, BVHBoxRef* prims, i32 count)
+{
+    node->left  = &prims[0];
+    node->right = &prims[count - 1];
+}
+
+// Builds the subtree over prims[0, count), reordering them in place so every leaf is a contiguous range.
+// With threads > 1, large subtrees are built concurrently (the output is the same as the serial build).
+template<typename Node, typename Prim, typename NewNode>
+internal Node* NewBVHNodeSAH(Prim* prims, i32 count, u32 threads, const SAHBuildContext& ctx, NewNode newNode)
+{
+    Node* parent = newNode();
+
+    AABB box, centroidBox;
+    ComputeSAHBounds(prims, count, threads, &box, &centroidBox);
+    parent->box = box;
+
+    SAHSplit split;
+    if(count > 1)
+        split = FindBinnedSAHSplit(prims, count, box, centroidBox, ctx, threads);
+
+    // Stop when intersecting everything is cheaper than splitting (and the leaf is small enough)
+    f32 leafCost = ctx.settings->intersectionCost * count;
+    if(count <= ctx.maxLeafSize && (split.axis < 0 || leafCost <= split.cost))
+    {
+        parent->nleft = parent->nright = nullptr;
+        SetSAHLeaf(parent, prims, count);
+        return parent;
+    }
+
+    i32 mid = PartitionSAHSplit(prims, count, split, box, centroidBox, ctx);
+
+    parent->left = parent->right = nullptr;
+    if(threads > 1 && count >= PARALLEL_TASK_THRESHOLD)
+    {
+        // The halves are independent, the left one becomes a pool task (stolen by an idle worker)
+        u32 leftThreads = threads / 2;
+        ThreadPool* pool = ThreadPool::Get();
+        std::future<Node*> left = pool->submit([&]() -> Node* {
+            return NewBVHNodeSAH<Node>(prims, mid, leftThreads, ctx, newNode);
+        });
+        parent->nright = NewBVHNodeSAH<Node>(prims + mid, count - mid, threads - leftThreads, ctx, newNode);
+        parent->nleft  = pool->wait(left);
+    }
+    else
+    {
+        parent->nleft  = NewBVHNodeSAH<Node>(prims, mid, 1, ctx, newNode);
+        parent->nright = NewBVHNodeSAH<Node>(prims + mid, count - mid, 1, ctx, newNode);
+    }
+    return parent;
+}
+
+// Sets the parent and build area of every node and points the objects to their leaf
+internal void LinkBVHNodes(BVHNode* node, BVHNode* parent)
+{
+    node->parent = parent;
+    node->buildArea = node->box.surfaceArea();
+    if(node->nleft != nullptr)
+    {
+        LinkBVHNodes(node->nleft, node);
+        LinkBVHNodes(node->nright, node);
+    }
+    else
+    {
+        node->left->bvhLeaf = node;
+        node->right->bvhLeaf = node;
+    }
+}
+
+internal BVHNode* NewBVHTreeUnlinked(const std::vector<Object*>& objects, const BVHBuildSettings& settings)
+{
+    // Nothing to build, callers treat a null tree as an empty scene
+    if(objects.empty()) return nullptr;
+
+    if(settings.mode == BVHBuildMode::MEDIAN)
+    {
+        return NewBVHNodeIter(objects, 0, (i32)objects.size());
+    }
+
+    // NOTE: There are too few top level objects for the LBVH to pay off and objects can't be split (SBVH),
+    //       both fall back to the SAH
+    std::vector<BVHObjectRef> refs;
+    refs.reserve(objects.size());
+    for(auto o : objects)
+    {
+        refs.push_back({ o, o->getAABB(o) });
+    }
+
+    SAHBuildContext ctx;
+    ctx.settings = &settings;
+    ctx.nbins = SAHBinCount(settings);
+    ctx.maxLeafSize = std::min(std::max((i32)settings.maxLeafSize, 1), 2); // BVHNode leaves only have room for 2 objects
+
+    return NewBVHNodeSAH<BVHNode>(refs.data(), (i32)refs.size(), BuildThreadCount(settings), ctx, []() -> BVHNode* {
+        return new BVHNode();
+    });
+}
+
+BVHNode* BVHNode::NewBVHTree(std::vector<Object*> objects, const BVHBuildSettings& settings)
+{
+    BVHNode* root = NewBVHTreeUnlinked(objects, settings);
+    if(root != nullptr) LinkBVHNodes(root, nullptr);
+    return root;
+}
+
+internal POSSIBLE_INLINE bool SameAABB(const AABB& a, const AABB& b)
+{
+    return a.min.x == b.min.x && a.min.y == b.min.y && a.min.z == b.min.z &&
+           a.max.x == b.max.x && a.max.y == b.max.y && a.max.z == b.max.z;
+}
+
+void BVHNode::Refit(Object* obj)
+{
+    BVHNode* node = obj->bvhLeaf;
+    if(node == nullptr) return;
+
+    AABB box;
+    if(node->left != node->right)
+        box = AABB::SurroundingBox(node->left->getAABB(node->left), node->right->getAABB(node->right));
+    else
+        box = node->left->getAABB(node->left);
+
+    while(node != nullptr)
+    {
+        // Everything above is already up to date
+        if(SameAABB(box, node->box)) return;
+        node->box = box;
+
+        node = node->parent;
+        if(node != nullptr)
+            box = AABB::SurroundingBox(node->nleft->box, node->nright->box);
+    }
+}
+
+BVHNode* BVHNode::Update(BVHNode* root, const std::vector<Object*>& changed, bool* rebuilt, f32 maxAreaGrowth, const BVHBuildSettings& settings)
+{
+    if(rebuilt != nullptr) *rebuilt = false;
+    if(root == nullptr) return nullptr;
+
+    for(auto o : changed)
+    {
+        Refit(o);
+    }
+
+    // Only the highest degraded node above each object is rebuilt - any lower one is contained in it
+    std::vector<BVHNode*> degraded;
+    for(auto o : changed)
+    {
+        BVHNode* highest = nullptr;
+        for(BVHNode* node = o->bvhLeaf; node != nullptr; node = node->parent)
+        {
+            if(node->nleft != nullptr && node->buildArea > 0.0f && node->box.surfaceArea() > maxAreaGrowth * node->buildArea)
+                highest = node;
+        }
+        if(highest != nullptr && std::find(degraded.begin(), degraded.end(), highest) == degraded.end())
+            degraded.push_back(highest);
+    }
+
+    for(auto node : degraded)
+    {
+        BVHNode* parent = node->parent;
+        BVHNode* subtree = NewBVHTree(node->GetAllObjectsList(), settings);
+        subtree->parent = parent;
+
+        if(parent == nullptr)
+            root = subtree;
+        else if(parent->nleft == node)
+            parent->nleft = subtree;
+        else
+            parent->nright = subtree;
+        FreeBVHTree(node);
+
+        // The subtree holds the same objects, so its box (and the ones above) is unchanged
+        if(rebuilt != nullptr) *rebuilt = true;
+    }
+    return root;
 }
 
 internal AABB GetTriangleAABB(TriangleMesh* mesh, Triangle* t)
@@ -200,7 +673,6 @@ internal BVHNodeTri* NewBVHNodeIterTriangle(TriangleMesh* mesh, i32 start, i32 s
     i32 count = stop - start;
     if(count == mesh->triangleCount) mesh->bvh = parent;
 
-    auto RandomBoxCompare = [axis](Triangle* a, Triangle* b) -> bool { return BoxCompareTriangle(a, b, axis); };
     auto RandomBoxCompareRef = [axis](Triangle& a, Triangle& b) -> bool { return BoxCompareTriangle(&a, &b, axis); };
 
     if(count == 1)
@@ -214,18 +686,9 @@ internal BVHNodeTri* NewBVHNodeIterTriangle(TriangleMesh* mesh, i32 start, i32 s
         parent->nleft = parent->nright = nullptr;
         parent->mesh = mesh;
 
-        Triangle* a = &mesh->triangles[start];
-        Triangle* b = &mesh->triangles[start + 1];
-        if(RandomBoxCompare(a, b))
-        {
-            parent->left = a;
-            parent->right = b;
-        }
-        else
-        {
-            parent->left = b;
-            parent->right = a;
-        }
+        // Leaves reference a contiguous range, so the order here does not matter
+        parent->left  = &mesh->triangles[start];
+        parent->right = &mesh->triangles[start + 1];
     }
     else
     {
@@ -258,13 +721,639 @@ internal BVHNodeTri* NewBVHNodeIterTriangle(TriangleMesh* mesh, i32 start, i32 s
     return parent;
 }
 
-BVHNodeTri* BVHNodeTri::NewBVHTriTree(TriangleMesh* mesh)
+struct MortonPrim
+{
+    u64 code;
+    u32 index;
+};
+
+struct LBVHTreelet
+{
+    BVHNodeTri* root;
+    AABB box;
+};
+
+struct LBVHContext
+{
+    TriangleMesh* mesh;
+    const MortonPrim* prims;
+    i32 maxLeafSize;
+};
+
+// Spreads the low 10 bits of v so there are 2 zero bits between each of them
+internal POSSIBLE_INLINE u64 ExpandBits10(u64 v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v <<  8)) & 0x0300f00f;
+    v = (v | (v <<  4)) & 0x030c30c3;
+    v = (v | (v <<  2)) & 0x09249249;
+    return v;
+}
+
+// Same for the low 21 bits
+internal POSSIBLE_INLINE u64 ExpandBits21(u64 v)
 {
-    return NewBVHNodeIterTriangle(mesh, 0, (i32)mesh->triangleCount);
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x001f00000000ffffull;
+    v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+    v = (v | (v <<  8)) & 0x100f00f00f00f00full;
+    v = (v | (v <<  4)) & 0x10c30c30c30c30c3ull;
+    v = (v | (v <<  2)) & 0x1249249249249249ull;
+    return v;
+}
+
+// p is normalized to [0, 1] in the centroid box
+internal POSSIBLE_INLINE u64 MortonCode(const Vector3& p, u32 bitsPerAxis)
+{
+    f32 scale = (f32)(1u << bitsPerAxis);
+    u64 q[3];
+    for(i32 axis = 0; axis < 3; axis++)
+    {
+        q[axis] = (u64)std::min(std::max(p.data[axis] * scale, 0.0f), scale - 1.0f);
+    }
+
+    if(bitsPerAxis == 10)
+        return (ExpandBits10(q[0]) << 2) | (ExpandBits10(q[1]) << 1) | ExpandBits10(q[2]);
+    return (ExpandBits21(q[0]) << 2) | (ExpandBits21(q[1]) << 1) | ExpandBits21(q[2]);
+}
+
+// Stable LSD radix sort on the codes, 8 bits per pass with one histogram per chunk
+internal void RadixSortMorton(std::vector<MortonPrim>& prims, u32 keyBits, u32 threads)
+{
+    i32 count = (i32)prims.size();
+    if(count < PARALLEL_BIN_THRESHOLD) threads = 1;
+
+    std::vector<MortonPrim> tmp(count);
+    std::vector<u32> histograms(256 * threads);
+    MortonPrim* src = prims.data();
+    MortonPrim* dst = tmp.data();
+
+    for(u32 shift = 0; shift < keyBits; shift += 8)
+    {
+        std::fill(histograms.begin(), histograms.end(), 0);
+        ParallelChunks(count, threads, [&](i32 begin, i32 end, u32 chunk) {
+            u32* h = &histograms[256 * chunk];
+            for(i32 i = begin; i < end; i++)
+            {
+                h[(src[i].code >> shift) & 0xff]++;
+            }
+        });
+
+        // Digit major, then chunk order - keeps equal digits in their previous order
+        u32 offset = 0;
+        for(u32 d = 0; d < 256; d++)
+        {
+            for(u32 c = 0; c < threads; c++)
+            {
+                u32 n = histograms[256 * c + d];
+                histograms[256 * c + d] = offset;
+                offset += n;
+            }
+        }
+
+        ParallelChunks(count, threads, [&](i32 begin, i32 end, u32 chunk) {
+            u32* h = &histograms[256 * chunk];
+            for(i32 i = begin; i < end; i++)
+            {
+                dst[h[(src[i].code >> shift) & 0xff]++] = src[i];
+            }
+        });
+        std::swap(src, dst);
+    }
+
+    if(src != prims.data())
+    {
+        std::copy(src, src + count, prims.data());
+    }
+}
+
+// Last index of the range whose code still has the highest differing bit of the range cleared
+internal i32 FindMortonSplit(const MortonPrim* prims, i32 first, i32 last)
+{
+    u64 diff = prims[first].code ^ prims[last].code;
+    if(diff == 0)
+    {
+        // Duplicated codes - just split in half
+        return (first + last) / 2;
+    }
+
+    // Keep only the highest set bit
+    diff |= diff >> 1;
+    diff |= diff >> 2;
+    diff |= diff >> 4;
+    diff |= diff >> 8;
+    diff |= diff >> 16;
+    diff |= diff >> 32;
+    u64 bit = diff ^ (diff >> 1);
+
+    const MortonPrim* split = std::partition_point(prims + first, prims + last + 1, [bit](const MortonPrim& p) -> bool {
+        return (p.code & bit) == 0;
+    });
+    return (i32)(split - prims) - 1;
+}
+
+// Emits the radix tree over the sorted range [first, last], boxes are merged bottom up
+internal BVHNodeTri* NewBVHNodeLBVH(const LBVHContext& ctx, i32 first, i32 last, u32 threads)
+{
+    BVHNodeTri* node = new BVHNodeTri();
+    node->mesh = ctx.mesh;
+
+    i32 count = last - first + 1;
+    if(count <= ctx.maxLeafSize)
+    {
+        node->nleft = node->nright = nullptr;
+        node->left  = &ctx.mesh->triangles[first];
+        node->right = &ctx.mesh->triangles[last];
+        node->box = AABB::Empty();
+        for(i32 i = first; i <= last; i++)
+        {
+            node->box = AABB::SurroundingBox(node->box, ctx.mesh->triangles[i].box);
+        }
+        return node;
+    }
+
+    i32 split = FindMortonSplit(ctx.prims, first, last);
+    node->left = node->right = nullptr;
+    if(threads > 1 && count >= PARALLEL_TASK_THRESHOLD)
+    {
+        u32 leftThreads = threads / 2;
+        ThreadPool* pool = ThreadPool::Get();
+        std::future<BVHNodeTri*> left = pool->submit([&]() -> BVHNodeTri* {
+            return NewBVHNodeLBVH(ctx, first, split, leftThreads);
+        });
+        node->nright = NewBVHNodeLBVH(ctx, split + 1, last, threads - leftThreads);
+        node->nleft  = pool->wait(left);
+    }
+    else
+    {
+        node->nleft  = NewBVHNodeLBVH(ctx, first, split, 1);
+        node->nright = NewBVHNodeLBVH(ctx, split + 1, last, 1);
+    }
+    node->box = AABB::SurroundingBox(node->nleft->box, node->nright->box);
+    return node;
+}
+
+// The SAH top level has a single treelet per leaf (maxLeafSize is 1), which becomes the node itself
+internal POSSIBLE_INLINE void SetSAHLeaf(BVHNodeTri* node, LBVHTreelet* prims, i32)
+{
+    *node = *prims[0].root;
+    delete prims[0].root;
+}
+
+internal BVHNodeTri* NewBVHLBVHTree(TriangleMesh* mesh, const BVHBuildSettings& settings, u32 threads)
+{
+    i32 count = (i32)mesh->triangleCount;
+    u32 chunkThreads = count >= PARALLEL_BIN_THRESHOLD ? threads : 1;
+    u32 bitsPerAxis = settings.mortonBits > 30 ? 21 : 10;
+    u32 keyBits = 3 * bitsPerAxis;
+
+    AABB box, centroidBox;
+    ComputeSAHBounds(mesh->triangles, count, threads, &box, &centroidBox);
+
+    Vector3 extent = centroidBox.max - centroidBox.min;
+    Vector3 invExtent(extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+                      extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+                      extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+
+    std::vector<MortonPrim> prims(count);
+    ParallelChunks(count, chunkThreads, [&](i32 begin, i32 end, u32) {
+        for(i32 i = begin; i < end; i++)
+        {
+            Vector3 c = mesh->triangles[i].box.centroid() - centroidBox.min;
+            Vector3 p(c.x * invExtent.x, c.y * invExtent.y, c.z * invExtent.z);
+            prims[i].code = MortonCode(p, bitsPerAxis);
+            prims[i].index = (u32)i;
+        }
+    });
+
+    RadixSortMorton(prims, keyBits, threads);
+
+    // Reorder the triangles so every leaf is a contiguous range
+    std::vector<Triangle> sorted(count);
+    ParallelChunks(count, chunkThreads, [&](i32 begin, i32 end, u32) {
+        for(i32 i = begin; i < end; i++)
+        {
+            sorted[i] = mesh->triangles[prims[i].index];
+        }
+    });
+    std::copy(sorted.begin(), sorted.end(), mesh->triangles);
+
+    LBVHContext lctx;
+    lctx.mesh = mesh;
+    lctx.prims = prims.data();
+    lctx.maxLeafSize = std::max((i32)settings.maxLeafSize, 1);
+
+    if(settings.treeletBits == 0 || settings.treeletBits >= keyBits)
+    {
+        return NewBVHNodeLBVH(lctx, 0, count - 1, threads);
+    }
+
+    // HLBVH - the upper levels of a Morton tree are poor, so every treelet sharing the
+    // top treeletBits of its codes gets its own radix tree and the SAH joins them
+    u32 shift = keyBits - settings.treeletBits;
+    std::vector<i32> treeletStart;
+    for(i32 i = 0; i < count; i++)
+    {
+        if(i == 0 || (prims[i].code >> shift) != (prims[i - 1].code >> shift))
+            treeletStart.push_back(i);
+    }
+    treeletStart.push_back(count);
+
+    i32 treeletCount = (i32)treeletStart.size() - 1;
+    std::vector<LBVHTreelet> treelets(treeletCount);
+    ParallelChunks(treeletCount, treeletCount >= (i32)threads ? threads : 1, [&](i32 begin, i32 end, u32) {
+        for(i32 i = begin; i < end; i++)
+        {
+            treelets[i].root = NewBVHNodeLBVH(lctx, treeletStart[i], treeletStart[i + 1] - 1, 1);
+            treelets[i].box = treelets[i].root->box;
+        }
+    });
+
+    SAHBuildContext ctx;
+    ctx.settings = &settings;
+    ctx.nbins = SAHBinCount(settings);
+    ctx.maxLeafSize = 1;
+
+    return NewBVHNodeSAH<BVHNodeTri>(treelets.data(), treeletCount, threads, ctx, [mesh]() -> BVHNodeTri* {
+        BVHNodeTri* node = new BVHNodeTri();
+        node->mesh = mesh;
+        return node;
+    });
+}
+
+struct SBVHRef
+{
+    u32 index; // Triangle in the original mesh->triangles
+    AABB box;  // Clipped by the spatial splits above it
+};
+
+struct SBVHSpatialSplit
+{
+    i32 axis = -1; // -1 when no valid split was found
+    f32 position = 0.0f;
+    f32 cost = std::numeric_limits<f32>::max();
+};
+
+struct SBVHLeaf
+{
+    BVHNodeTri* node;
+    u32 first;
+    u32 count;
+};
+
+struct SBVHContext
+{
+    TriangleMesh* mesh;
+    SAHBuildContext sah;
+    f32 minOverlapArea; // Object splits overlapping less than this are kept as is
+    u64 maxRefs;        // Triangle count plus the duplication budget
+    u64 refCount;
+    std::vector<Triangle> out; // Leaf triangles, in leaf order
+    std::vector<SBVHLeaf> leaves;
+};
+
+#define SBVH_MAX_SPLIT_DEPTH 48
+
+internal POSSIBLE_INLINE AABB IntersectAABB(const AABB& a, const AABB& b)
+{
+    AABB r;
+    r.min = Vector3(fmaxf(a.min.x, b.min.x), fmaxf(a.min.y, b.min.y), fmaxf(a.min.z, b.min.z));
+    r.max = Vector3(fminf(a.max.x, b.max.x), fminf(a.max.y, b.max.y), fminf(a.max.z, b.max.z));
+    return r;
+}
+
+internal POSSIBLE_INLINE bool ValidAABB(const AABB& a)
+{
+    return a.min.x <= a.max.x && a.min.y <= a.max.y && a.min.z <= a.max.z;
+}
+
+// Splits a reference at an axis aligned plane, clipping the triangle edges against it
+internal void SplitReference(const TriangleMesh* mesh, const SBVHRef& ref, i32 axis, f32 pos, SBVHRef* left, SBVHRef* right)
+{
+    const Triangle& t = mesh->triangles[ref.index];
+    left->index = right->index = ref.index;
+    left->box = right->box = AABB::Empty();
+
+    for(i32 i = 0; i < 3; i++)
+    {
+        const Vector3& v0 = mesh->vertices[t.indicesVertex[i]];
+        const Vector3& v1 = mesh->vertices[t.indicesVertex[(i + 1) % 3]];
+        f32 a = v0.data[axis];
+        f32 b = v1.data[axis];
+
+        if(a <= pos) left->box  = AABB::SurroundingPoint(left->box, v0);
+        if(a >= pos) right->box = AABB::SurroundingPoint(right->box, v0);
+
+        if((a < pos && b > pos) || (a > pos && b < pos))
+        {
+            Vector3 p = v0 + (v1 - v0) * ((pos - a) / (b - a));
+            p.data[axis] = pos;
+            left->box  = AABB::SurroundingPoint(left->box, p);
+            right->box = AABB::SurroundingPoint(right->box, p);
+        }
+    }
+
+    left->box.max.data[axis]  = fminf(left->box.max.data[axis], pos);
+    right->box.min.data[axis] = fmaxf(right->box.min.data[axis], pos);
+    left->box  = IntersectAABB(left->box, ref.box);
+    right->box = IntersectAABB(right->box, ref.box);
+}
+
+// Bins the clipped references into equally sized slabs of the node box,
+// counting where each reference enters and exits (Stich et al. 2009)
+internal SBVHSpatialSplit FindSpatialSplit(const SBVHContext& ctx, const SBVHRef* refs, i32 count, const AABB& nodeBox)
+{
+    const i32 nbins = ctx.sah.nbins;
+    const BVHBuildSettings& settings = *ctx.sah.settings;
+    f32 nodeArea = nodeBox.surfaceArea();
+    f32 invNodeArea = nodeArea > 0.0f ? 1.0f / nodeArea : 1.0f;
+
+    SBVHSpatialSplit best;
+    for(i32 axis = 0; axis < 3; axis++)
+    {
+        f32 origin = nodeBox.min.data[axis];
+        f32 extent = nodeBox.max.data[axis] - origin;
+        if(extent <= 0.0f) continue;
+        f32 binWidth = extent / nbins;
+        f32 scale = nbins / extent;
+
+        SAHBin bins[MAX_SAH_BINS];
+        u32 entries[MAX_SAH_BINS] = { 0 };
+        u32 exits[MAX_SAH_BINS]   = { 0 };
+        for(i32 i = 0; i < count; i++)
+        {
+            i32 lo = SAHBinIndex(refs[i].box.min.data[axis], origin, scale, nbins);
+            i32 hi = SAHBinIndex(refs[i].box.max.data[axis], origin, scale, nbins);
+            entries[lo]++;
+            exits[hi]++;
+
+            SBVHRef rest = refs[i];
+            for(i32 b = lo; b < hi; b++)
+            {
+                SBVHRef l, r;
+                SplitReference(ctx.mesh, rest, axis, origin + (b + 1) * binWidth, &l, &r);
+                bins[b].box = AABB::SurroundingBox(bins[b].box, l.box);
+                rest = r;
+            }
+            bins[hi].box = AABB::SurroundingBox(bins[hi].box, rest.box);
+        }
+
+        AABB rightBox[MAX_SAH_BINS];
+        u32 rightCount[MAX_SAH_BINS];
+        AABB acc = AABB::Empty();
+        u32 accCount = 0;
+        for(i32 i = nbins - 1; i > 0; i--)
+        {
+            acc = AABB::SurroundingBox(acc, bins[i].box);
+            accCount += exits[i];
+            rightBox[i - 1] = acc;
+            rightCount[i - 1] = accCount;
+        }
+
+        acc = AABB::Empty();
+        accCount = 0;
+        for(i32 i = 0; i < nbins - 1; i++)
+        {
+            acc = AABB::SurroundingBox(acc, bins[i].box);
+            accCount += entries[i];
+            if(accCount == 0 || rightCount[i] == 0) continue;
+
+            f32 cost = settings.traversalCost + settings.intersectionCost * invNodeArea *
+                (accCount * acc.surfaceArea() + rightCount[i] * rightBox[i].surfaceArea());
+            if(cost < best.cost)
+            {
+                best.axis = axis;
+                best.position = origin + (i + 1) * binWidth;
+                best.cost = cost;
+            }
+        }
+    }
+    return best;
+}
+
+// Splits the references straddling the plane, unless keeping one whole on a single side is cheaper
+internal void PartitionSpatialSplit(const SBVHContext& ctx, const std::vector<SBVHRef>& refs, const SBVHSpatialSplit& split,
+                                    std::vector<SBVHRef>* left, std::vector<SBVHRef>* right)
+{
+    i32 axis = split.axis;
+    f32 pos = split.position;
+    AABB lbox = AABB::Empty();
+    AABB rbox = AABB::Empty();
+
+    std::vector<const SBVHRef*> straddling;
+    for(const auto& ref : refs)
+    {
+        if(ref.box.max.data[axis] <= pos)
+        {
+            left->push_back(ref);
+            lbox = AABB::SurroundingBox(lbox, ref.box);
+        }
+        else if(ref.box.min.data[axis] >= pos)
+        {
+            right->push_back(ref);
+            rbox = AABB::SurroundingBox(rbox, ref.box);
+        }
+        else
+        {
+            straddling.push_back(&ref);
+        }
+    }
+
+    u64 allowed = ctx.maxRefs > ctx.refCount ? ctx.maxRefs - ctx.refCount : 0;
+    for(auto ref : straddling)
+    {
+        f32 nl = (f32)left->size();
+        f32 nr = (f32)right->size();
+        AABB lwhole = AABB::SurroundingBox(lbox, ref->box);
+        AABB rwhole = AABB::SurroundingBox(rbox, ref->box);
+        f32 costLeft  = lwhole.surfaceArea() * (nl + 1) + rbox.surfaceArea() * nr;
+        f32 costRight = lbox.surfaceArea() * nl + rwhole.surfaceArea() * (nr + 1);
+
+        if(allowed > 0)
+        {
+            SBVHRef l, r;
+            SplitReference(ctx.mesh, *ref, axis, pos, &l, &r);
+            if(ValidAABB(l.box) && ValidAABB(r.box))
+            {
+                AABB lsplit = AABB::SurroundingBox(lbox, l.box);
+                AABB rsplit = AABB::SurroundingBox(rbox, r.box);
+                f32 costSplit = lsplit.surfaceArea() * (nl + 1) + rsplit.surfaceArea() * (nr + 1);
+                if(costSplit < costLeft && costSplit < costRight)
+                {
+                    left->push_back(l);
+                    right->push_back(r);
+                    lbox = lsplit;
+                    rbox = rsplit;
+                    allowed--;
+                    continue;
+                }
+            }
+        }
+
+        if(costLeft <= costRight)
+        {
+            left->push_back(*ref);
+            lbox = lwhole;
+        }
+        else
+        {
+            right->push_back(*ref);
+            rbox = rwhole;
+        }
+    }
+}
+
+internal BVHNodeTri* NewBVHNodeSBVH(SBVHContext& ctx, std::vector<SBVHRef>& refs, i32 depth)
+{
+    BVHNodeTri* node = new BVHNodeTri();
+    node->mesh = ctx.mesh;
+
+    i32 count = (i32)refs.size();
+    AABB box, centroidBox;
+    ComputeSAHBounds(refs.data(), count, 1, &box, &centroidBox);
+    node->box = box;
+
+    SAHSplit object;
+    SBVHSpatialSplit spatial;
+    if(count > 1)
+    {
+        object = FindBinnedSAHSplit(refs.data(), count, box, centroidBox, ctx.sah, 1);
+
+        // Spatial splits only pay off when the object split children overlap a lot
+        if(depth < SBVH_MAX_SPLIT_DEPTH && ctx.refCount < ctx.maxRefs)
+        {
+            AABB overlap = IntersectAABB(object.leftBox, object.rightBox);
+            if(object.axis < 0 || (ValidAABB(overlap) && overlap.surfaceArea() > ctx.minOverlapArea))
+                spatial = FindSpatialSplit(ctx, refs.data(), count, box);
+        }
+    }
+
+    f32 leafCost = ctx.sah.settings->intersectionCost * count;
+    if(count <= ctx.sah.maxLeafSize && leafCost <= std::min(object.cost, spatial.cost))
+    {
+        ctx.leaves.push_back({ node, (u32)ctx.out.size(), (u32)count });
+        for(const auto& ref : refs)
+        {
+            Triangle t = ctx.mesh->triangles[ref.index];
+            t.box = ref.box;
+            ctx.out.push_back(t);
+        }
+        node->nleft = node->nright = nullptr;
+        return node;
+    }
+
+    std::vector<SBVHRef> left, right;
+    if(spatial.axis >= 0 && spatial.cost < object.cost)
+    {
+        PartitionSpatialSplit(ctx, refs, spatial, &left, &right);
+        if(left.empty() || right.empty())
+        {
+            left.clear();
+            right.clear();
+        }
+    }
+
+    if(left.empty())
+    {
+        i32 mid = PartitionSAHSplit(refs.data(), count, object, box, centroidBox, ctx.sah);
+        left.assign(refs.begin(), refs.begin() + mid);
+        right.assign(refs.begin() + mid, refs.end());
+    }
+    ctx.refCount += left.size() + right.size() - count;
+
+    // Free this level before going deeper
+    std::vector<SBVHRef>().swap(refs);
+
+    node->left = node->right = nullptr;
+    node->nleft  = NewBVHNodeSBVH(ctx, left, depth + 1);
+    node->nright = NewBVHNodeSBVH(ctx, right, depth + 1);
+    return node;
+}
+
+internal BVHNodeTri* NewBVHSBVHTree(TriangleMesh* mesh, const BVHBuildSettings& settings)
+{
+    i32 count = (i32)mesh->triangleCount;
+    std::vector<SBVHRef> refs(count);
+    AABB rootBox = AABB::Empty();
+    for(i32 i = 0; i < count; i++)
+    {
+        refs[i].index = (u32)i;
+        refs[i].box = mesh->triangles[i].box;
+        rootBox = AABB::SurroundingBox(rootBox, refs[i].box);
+    }
+
+    SBVHContext ctx;
+    ctx.mesh = mesh;
+    ctx.sah.settings = &settings;
+    ctx.sah.nbins = SAHBinCount(settings);
+    ctx.sah.maxLeafSize = std::max((i32)settings.maxLeafSize, 1);
+    ctx.minOverlapArea = settings.splitAlpha * rootBox.surfaceArea();
+    ctx.maxRefs = (u64)count + (u64)(count * std::max(settings.duplicationBudget, 0.0f));
+    ctx.refCount = (u64)count;
+    ctx.out.reserve(count);
+
+    BVHNodeTri* root = NewBVHNodeSBVH(ctx, refs, 0);
+
+    // The leaves get their own copy of every (possibly duplicated) triangle, in leaf order
+    delete[] mesh->triangles;
+    mesh->triangleCount = ctx.out.size();
+    mesh->triangles = new Triangle[mesh->triangleCount];
+    std::copy(ctx.out.begin(), ctx.out.end(), mesh->triangles);
+
+    for(const auto& leaf : ctx.leaves)
+    {
+        leaf.node->left  = &mesh->triangles[leaf.first];
+        leaf.node->right = &mesh->triangles[leaf.first + leaf.count - 1];
+    }
+    return root;
+}
+
+BVHNodeTri* BVHNodeTri::NewBVHTriTree(TriangleMesh* mesh, const BVHBuildSettings& settings)
+{
+    if(mesh->triangleCount == 0) return nullptr;
+
+    if(settings.mode == BVHBuildMode::MEDIAN)
+    {
+        return NewBVHNodeIterTriangle(mesh, 0, (i32)mesh->triangleCount);
+    }
+
+    i32 count = (i32)mesh->triangleCount;
+    u32 threads = BuildThreadCount(settings);
+
+    // Every other mode needs the triangle boxes upfront
+    ParallelChunks(count, count >= PARALLEL_BIN_THRESHOLD ? threads : 1, [mesh](i32 begin, i32 end, u32) {
+        for(i32 i = begin; i < end; i++)
+        {
+            mesh->triangles[i].box = GetTriangleAABB(mesh, &mesh->triangles[i]);
+        }
+    });
+
+    if(settings.mode == BVHBuildMode::LBVH)
+    {
+        return NewBVHLBVHTree(mesh, settings, threads);
+    }
+
+    if(settings.mode == BVHBuildMode::SBVH)
+    {
+        return NewBVHSBVHTree(mesh, settings);
+    }
+
+    SAHBuildContext ctx;
+    ctx.settings = &settings;
+    ctx.nbins = SAHBinCount(settings);
+    ctx.maxLeafSize = std::max((i32)settings.maxLeafSize, 1);
+
+    return NewBVHNodeSAH<BVHNodeTri>(mesh->triangles, count, threads, ctx, [mesh]() -> BVHNodeTri* {
+        BVHNodeTri* node = new BVHNodeTri();
+        node->mesh = mesh;
+        return node;
+    });
 }
 
 void BVHNodeTri::FreeBVHTriTree(BVHNodeTri* parent)
 {
+    if(parent == nullptr) return;
     if(parent->nleft != nullptr)
         FreeBVHTriTree(parent->nleft);
     if(parent->nright != nullptr)
@@ -279,8 +1368,8 @@ void BVHNodeTri::PrintBVHTriTree(BVHNodeTri* parent)
 
     if(!parent->nleft)
     {
-        std::cout << "Child left : " << std::hex << parent->left << "\n";
-        std::cout << "Child right: " << std::hex << parent->right << "\n";
+        std::cout << "Child first: " << std::hex << parent->left << "\n";
+        std::cout << "Child last : " << std::hex << parent->right << "\n";
     }
     else
     {
@@ -290,8 +1379,34 @@ void BVHNodeTri::PrintBVHTriTree(BVHNodeTri* parent)
     }
 }
 
+BVHNodeBox* BVHNodeBox::NewBVHBoxTree(BVHBoxRef* refs, u32 count, const BVHBuildSettings& settings)
+{
+    if(count == 0) return nullptr;
+
+    SAHBuildContext ctx;
+    ctx.settings = &settings;
+    ctx.nbins = SAHBinCount(settings);
+    ctx.maxLeafSize = std::max((i32)settings.maxLeafSize, 1);
+
+    return NewBVHNodeSAH<BVHNodeBox>(refs, (i32)count, BuildThreadCount(settings), ctx, []() -> BVHNodeBox* {
+        return new BVHNodeBox();
+    });
+}
+
+void BVHNodeBox::FreeBVHBoxTree(BVHNodeBox* parent)
+{
+    if(parent == nullptr) return;
+    if(parent->nleft != nullptr)
+        FreeBVHBoxTree(parent->nleft);
+    if(parent->nright != nullptr)
+        FreeBVHBoxTree(parent->nright);
+
+    delete parent;
+}
+
 void BVHNode::FreeBVHTree(BVHNode* parent)
 {
+    if(parent == nullptr) return;
     if(parent->nleft != nullptr)
         FreeBVHTree(parent->nleft);
     if(parent->nright != nullptr)
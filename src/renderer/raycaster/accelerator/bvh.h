@@ -4,6 +4,7 @@
 #include "../../../math/aabb.h"
 #include "../hittable/object.h"
 #include "../geometry.h"
+#include "build_settings.h"
 #include <vector>
 
 struct BVHNode
@@ -13,14 +14,26 @@ struct BVHNode
     BVHNode* nright;
     Object* left;
     Object* right;
+    BVHNode* parent = nullptr;
+    f32 buildArea = 0.0f; // Box surface area when the node was built
+    u32 flatIndex = 0;    // Matching node in the FlatBVH (if any)
 
-    static BVHNode* NewBVHTree(std::vector<Object*> objects);
+    static BVHNode* NewBVHTree(std::vector<Object*> objects, const BVHBuildSettings& settings = BVHBuildSettings());
     static void FreeBVHTree(BVHNode* parent);
     static void PrintBVHTree(BVHNode* parent);
 
+    // Recomputes the boxes from the object's leaf up (same topology), stops once a box doesn't change
+    static void Refit(Object* obj);
+
+    // Refits every changed object, then rebuilds the highest subtree above each of them whose
+    // area grew past maxAreaGrowth times its build area. Returns the (possibly new) root.
+    static BVHNode* Update(BVHNode* root, const std::vector<Object*>& changed, bool* rebuilt = nullptr,
+                           f32 maxAreaGrowth = 2.0f, const BVHBuildSettings& settings = BVHBuildSettings());
+
     std::vector<Object*> GetAllObjectsList();
 
     bool traverse(const Ray* r, f32 tmin, f32 tmax, HitRecord* rec);
+    bool occluded(const Ray* r, f32 tmin, f32 tmax); // Stops at the first hit found
 };
 
 struct BVHNodeTri
@@ -28,13 +41,34 @@ struct BVHNodeTri
     AABB box;
     BVHNodeTri* nleft;
     BVHNodeTri* nright;
-    Triangle* left;
-    Triangle* right;
+    Triangle* left;  // First triangle of the leaf
+    Triangle* right; // Last triangle of the leaf (inclusive, contiguous in mesh->triangles)
     TriangleMesh* mesh;
 
-    static BVHNodeTri* NewBVHTriTree(TriangleMesh* mesh);
+    static BVHNodeTri* NewBVHTriTree(TriangleMesh* mesh, const BVHBuildSettings& settings = BVHBuildSettings());
     static void FreeBVHTriTree(BVHNodeTri* parent);
     static void PrintBVHTriTree(BVHNodeTri* parent);
 
     bool traverse(const Ray* r, f32 tmin, f32 tmax, HitRecord* rec);
+    bool occluded(const Ray* r, f32 tmin, f32 tmax); // Stops at the first hit found
+};
+
+struct BVHBoxRef
+{
+    u32 index; // Primitive index in the owner's storage
+    AABB box;
+};
+
+// Binary tree over bare boxes, for geometry that keeps its own primitive storage (SphereSet)
+struct BVHNodeBox
+{
+    AABB box;
+    BVHNodeBox* nleft;
+    BVHNodeBox* nright;
+    BVHBoxRef* left;  // First reference of the leaf
+    BVHBoxRef* right; // Last reference of the leaf (inclusive, contiguous in the build array)
+
+    // Binned SAH build (MEDIAN is not supported here), refs are reordered so every leaf is a contiguous range
+    static BVHNodeBox* NewBVHBoxTree(BVHBoxRef* refs, u32 count, const BVHBuildSettings& settings = BVHBuildSettings());
+    static void FreeBVHBoxTree(BVHNodeBox* parent);
 };
@@ -0,0 +1,435 @@
+// Ahead of common.h, whose internal macro breaks the locale headers <filesystem> pulls in
+#include <filesystem>
+
+#include "bvh_cache.h"
+#include "../geometry.h"
+#include "flat_bvh.h"
+#include "wide_bvh.h"
+#include "../../../utils/mapped_file.h"
+#include <fstream>
+#include <cstring>
+#include <chrono>
+#include <vector>
+
+#define BVH_CACHE_VERSION 2
+#define BVH_CACHE_ALIGNMENT 64 // Sections are aligned for the node arrays (the mapping itself is page aligned)
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME        0x100000001b3ull
+
+#define HASH_PRIME_1 0x9e3779b185ebca87ull
+#define HASH_PRIME_2 0xc2b2ae3d27d4eb4full
+
+internal const char BVHCacheMagic[8] = { 'L', 'Q', 'B', 'V', 'H', 0, 0, 0 };
+
+enum BVHCacheSection
+{
+    SECTION_VERTICES,
+    SECTION_NORMALS,
+    SECTION_TEXCOORDS,
+    SECTION_TRIANGLES,
+    SECTION_NODES,
+    SECTION_COUNT
+};
+
+struct BVHCacheHeader
+{
+    char magic[8];
+    u32 version;
+    u32 layout;
+    u64 sourceSize;  // Mesh file size and modification time, checked first
+    u64 sourceTime;
+    u64 contentHash; // Mesh file content, only checked when the time does not match
+    u64 settingsHash;
+
+    // Catches struct layout changes between builds of the renderer
+    u32 vertexSize;
+    u32 triangleSize;
+    u32 nodeSize;
+    u32 pad;
+
+    AABB box;
+    u64 count[SECTION_COUNT];
+    u64 offset[SECTION_COUNT];
+};
+
+internal u64 Fnv1a(const void* data, u64 size, u64 hash = FNV_OFFSET_BASIS)
+{
+    const u8* bytes = (const u8*)data;
+    for(u64 i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+internal POSSIBLE_INLINE u64 RotateLeft(u64 x, u32 r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// Final avalanche, every input bit flips about half of the output bits
+internal POSSIBLE_INLINE u64 Mix64(u64 h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+template<typename T>
+internal POSSIBLE_INLINE u64 Fnv1aValue(const T& value, u64 hash)
+{
+    return Fnv1a(&value, sizeof(T), hash);
+}
+
+internal POSSIBLE_INLINE u64 AlignCacheOffset(u64 offset)
+{
+    return (offset + BVH_CACHE_ALIGNMENT - 1) / BVH_CACHE_ALIGNMENT * BVH_CACHE_ALIGNMENT;
+}
+
+internal u32 LayoutNodeSize(BVHLayout layout)
+{
+    switch(layout)
+    {
+        case BVHLayout::FLAT:  return sizeof(FlatBVHNode);
+        case BVHLayout::WIDE4: return sizeof(WideBVHNode<4>);
+        case BVHLayout::WIDE8: return sizeof(WideBVHNode<8>);
+        default:               return 0;
+    }
+}
+
+std::string BVHCache::CachePath(const std::string& meshFile)
+{
+    return meshFile + ".lqbvh";
+}
+
+u64 BVHCache::HashFile(const std::string& filename)
+{
+    MappedFile* file = MappedFile::Open(filename);
+    if(file == nullptr) return 0;
+
+    const u8* bytes = file->data;
+    const u64 size = file->size;
+    u64 hash = size * HASH_PRIME_1;
+    u64 i = 0;
+    for(; i + 8 <= size; i += 8)
+    {
+        u64 word;
+        memcpy(&word, bytes + i, sizeof(u64));
+        hash = RotateLeft(hash ^ (word * HASH_PRIME_2), 31) * HASH_PRIME_1;
+    }
+    u64 tail = 0;
+    memcpy(&tail, bytes + i, (size_t)(size - i));
+    hash = RotateLeft(hash ^ (tail * HASH_PRIME_2), 31) * HASH_PRIME_1;
+
+    MappedFile::Close(file);
+    return Mix64(hash);
+}
+
+// Size and modification time of the mesh file, false if it can't be read
+internal bool SourceStamp(const std::string& filename, u64* size, u64* time)
+{
+    std::error_code error;
+    *size = (u64)std::filesystem::file_size(filename, error);
+    if(error) return false;
+    *time = (u64)std::filesystem::last_write_time(filename, error).time_since_epoch().count();
+    return !error;
+}
+
+// Every node is reached from a lower index (children follow their parent), so one forward pass gives the
+// depths. Rejects child links out of range or backwards, leaves outside the triangles and trees deeper
+// than the traversal stacks.
+internal bool ValidFlatNodes(const FlatBVHNode* nodes, u64 nodeCount, u64 triangleCount)
+{
+    std::vector<u8> depth(nodeCount, 0);
+    depth[0] = 1;
+    for(u64 i = 0; i < nodeCount; i++)
+    {
+        const FlatBVHNode& node = nodes[i];
+        if(depth[i] == 0 || depth[i] > FLAT_BVH_MAX_DEPTH)
+            return false;
+
+        if(node.primCount > 0)
+        {
+            if((u64)node.primOffset + node.primCount > triangleCount) return false;
+            continue;
+        }
+        if(i + 1 >= nodeCount || node.secondChild <= i + 1 || node.secondChild >= nodeCount)
+            return false;
+        depth[i + 1] = std::max(depth[i + 1], (u8)(depth[i] + 1));
+        depth[node.secondChild] = std::max(depth[node.secondChild], (u8)(depth[i] + 1));
+    }
+    return true;
+}
+
+template<u32 Width>
+internal bool ValidWideNodes(const WideBVHNode<Width>* nodes, u64 nodeCount, u64 triangleCount)
+{
+    std::vector<u8> depth(nodeCount, 0);
+    depth[0] = 1;
+    for(u64 i = 0; i < nodeCount; i++)
+    {
+        const WideBVHNode<Width>& node = nodes[i];
+        if(depth[i] == 0 || depth[i] > WIDE_BVH_MAX_DEPTH || (node.validMask >> Width) != 0)
+            return false;
+
+        for(u32 c = 0; c < Width; c++)
+        {
+            if((node.validMask & (1u << c)) == 0) continue;
+
+            if(node.count[c] > 0)
+            {
+                if((u64)node.child[c] + node.count[c] > triangleCount) return false;
+                continue;
+            }
+            if(node.child[c] <= i || node.child[c] >= nodeCount)
+                return false;
+            depth[node.child[c]] = std::max(depth[node.child[c]], (u8)(depth[i] + 1));
+        }
+    }
+    return true;
+}
+
+internal bool ValidTriangles(const Triangle* triangles, u64 triangleCount, u64 vertexCount, u64 normalCount, u64 texCoordCount)
+{
+    for(u64 t = 0; t < triangleCount; t++)
+    {
+        for(u32 k = 0; k < 3; k++)
+        {
+            if(triangles[t].indicesVertex[k] >= vertexCount
+            || triangles[t].indicesNormal[k] >= normalCount
+            || triangles[t].indicesTexCoord[k] >= texCoordCount)
+                return false;
+        }
+    }
+    return true;
+}
+
+u64 BVHCache::HashSettings(const BVHBuildSettings& settings)
+{
+    // Field by field, the struct padding is not guaranteed to be zero
+    // NOTE: buildThreads and triangleBlockWidth are left out - they don't change the cached data
+    u64 hash = FNV_OFFSET_BASIS;
+    hash = Fnv1aValue((u32)settings.mode, hash);
+    hash = Fnv1aValue((u32)settings.layout, hash);
+    hash = Fnv1aValue(settings.binCount, hash);
+    hash = Fnv1aValue(settings.maxLeafSize, hash);
+    hash = Fnv1aValue(settings.traversalCost, hash);
+    hash = Fnv1aValue(settings.intersectionCost, hash);
+    hash = Fnv1aValue(settings.mortonBits, hash);
+    hash = Fnv1aValue(settings.treeletBits, hash);
+    hash = Fnv1aValue(settings.splitAlpha, hash);
+    hash = Fnv1aValue(settings.duplicationBudget, hash);
+    return hash;
+}
+
+TriangleMesh* BVHCache::Load(const std::string& meshFile, const BVHBuildSettings& settings)
+{
+    u64 sourceSize, sourceTime;
+    if(!SourceStamp(meshFile, &sourceSize, &sourceTime)) return nullptr;
+
+    MappedFile* file = MappedFile::Open(CachePath(meshFile));
+    if(file == nullptr) return nullptr;
+
+    BVHCacheHeader header;
+    bool valid = file->size >= sizeof(BVHCacheHeader);
+    if(valid)
+    {
+        memcpy(&header, file->data, sizeof(BVHCacheHeader));
+        valid = memcmp(header.magic, BVHCacheMagic, sizeof(BVHCacheMagic)) == 0
+             && header.version == BVH_CACHE_VERSION
+             && header.layout == (u32)settings.layout
+             && header.sourceSize == sourceSize
+             && header.settingsHash == HashSettings(settings)
+             && header.vertexSize == sizeof(Vector3)
+             && header.triangleSize == sizeof(Triangle)
+             && header.nodeSize == LayoutNodeSize(settings.layout)
+             && header.nodeSize > 0;
+    }
+
+    const u64 elementSize[SECTION_COUNT] = { sizeof(Vector3), sizeof(Vector3), sizeof(Vector2), sizeof(Triangle), header.nodeSize };
+    for(i32 i = 0; valid && i < SECTION_COUNT; i++)
+    {
+        // Also rejects files that were cut short while writing
+        valid = header.offset[i] % BVH_CACHE_ALIGNMENT == 0
+             && header.offset[i] <= file->size
+             && header.count[i] <= (file->size - header.offset[i]) / elementSize[i];
+    }
+
+    // Touched or copied but the same size, it's the same mesh if the content is
+    if(valid && header.sourceTime != sourceTime)
+        valid = header.contentHash == HashFile(meshFile);
+
+    u8* base = (u8*)file->data;
+    if(valid)
+    {
+        const u64 nodeCount = header.count[SECTION_NODES];
+        const u64 triangleCount = header.count[SECTION_TRIANGLES];
+        const void* nodes = base + header.offset[SECTION_NODES];
+        valid = nodeCount > 0 && nodeCount <= 0xFFFFFFFFull
+             && ValidTriangles((const Triangle*)(base + header.offset[SECTION_TRIANGLES]), triangleCount,
+                    header.count[SECTION_VERTICES], header.count[SECTION_NORMALS], header.count[SECTION_TEXCOORDS]);
+        switch(settings.layout)
+        {
+            case BVHLayout::FLAT:  valid = valid && ValidFlatNodes((const FlatBVHNode*)nodes, nodeCount, triangleCount); break;
+            case BVHLayout::WIDE4: valid = valid && ValidWideNodes((const WideBVHNode<4>*)nodes, nodeCount, triangleCount); break;
+            case BVHLayout::WIDE8: valid = valid && ValidWideNodes((const WideBVHNode<8>*)nodes, nodeCount, triangleCount); break;
+            default:               valid = false; break;
+        }
+        if(!valid)
+            std::cerr << "warn: BVHCache " << CachePath(meshFile) << " is damaged, rebuilding." << std::endl;
+    }
+
+    if(!valid)
+    {
+        MappedFile::Close(file);
+        return nullptr;
+    }
+
+    TriangleMesh* m = new TriangleMesh();
+    m->cacheFile = file;
+    m->bvhSettings = settings;
+    m->box = header.box;
+    m->boxConstructed = true;
+    m->vertices = (Vector3*)(base + header.offset[SECTION_VERTICES]);
+    m->vertexCount = header.count[SECTION_VERTICES];
+    m->normals = (Vector3*)(base + header.offset[SECTION_NORMALS]);
+    m->normalCount = header.count[SECTION_NORMALS];
+    m->texCoords = (Vector2*)(base + header.offset[SECTION_TEXCOORDS]);
+    m->texCoordCount = header.count[SECTION_TEXCOORDS];
+    m->triangles = (Triangle*)(base + header.offset[SECTION_TRIANGLES]);
+    m->triangleCount = header.count[SECTION_TRIANGLES];
+
+    void* nodes = base + header.offset[SECTION_NODES];
+    u32 nodeCount = (u32)header.count[SECTION_NODES];
+    switch(settings.layout)
+    {
+        case BVHLayout::FLAT:
+            m->flatBvh = new FlatBVHTri();
+            m->flatBvh->nodes = (FlatBVHNode*)nodes;
+            m->flatBvh->nodeCount = nodeCount;
+            m->flatBvh->mesh = m;
+            m->flatBvh->mapped = true;
+            break;
+        case BVHLayout::WIDE4:
+            m->wideBvh4 = new WideBVHTri4();
+            m->wideBvh4->nodes = (WideBVHNode<4>*)nodes;
+            m->wideBvh4->nodeCount = nodeCount;
+            m->wideBvh4->mesh = m;
+            m->wideBvh4->mapped = true;
+            break;
+        case BVHLayout::WIDE8:
+            m->wideBvh8 = new WideBVHTri8();
+            m->wideBvh8->nodes = (WideBVHNode<8>*)nodes;
+            m->wideBvh8->nodeCount = nodeCount;
+            m->wideBvh8->mesh = m;
+            m->wideBvh8->mapped = true;
+            break;
+        default:
+            break;
+    }
+    return m;
+}
+
+bool BVHCache::Save(const std::string& meshFile, const TriangleMesh* mesh)
+{
+    const BVHLayout layout = mesh->bvhSettings.layout;
+    const void* nodes = nullptr;
+    u64 nodeCount = 0;
+    switch(layout)
+    {
+        case BVHLayout::FLAT:
+            if(mesh->flatBvh) { nodes = mesh->flatBvh->nodes; nodeCount = mesh->flatBvh->nodeCount; }
+            break;
+        case BVHLayout::WIDE4:
+            if(mesh->wideBvh4) { nodes = mesh->wideBvh4->nodes; nodeCount = mesh->wideBvh4->nodeCount; }
+            break;
+        case BVHLayout::WIDE8:
+            if(mesh->wideBvh8) { nodes = mesh->wideBvh8->nodes; nodeCount = mesh->wideBvh8->nodeCount; }
+            break;
+        default:
+            break;
+    }
+    if(nodes == nullptr) return false;
+
+    u64 sourceSize, sourceTime;
+    if(!SourceStamp(meshFile, &sourceSize, &sourceTime)) return false;
+
+    BVHCacheHeader header;
+    memset((void*)&header, 0, sizeof(BVHCacheHeader)); // Zeroes the padding too, so the files are reproducible
+    memcpy(header.magic, BVHCacheMagic, sizeof(BVHCacheMagic));
+    header.version = BVH_CACHE_VERSION;
+    header.layout = (u32)layout;
+    header.sourceSize = sourceSize;
+    header.sourceTime = sourceTime;
+    header.contentHash = HashFile(meshFile);
+    header.settingsHash = HashSettings(mesh->bvhSettings);
+    header.vertexSize = sizeof(Vector3);
+    header.triangleSize = sizeof(Triangle);
+    header.nodeSize = LayoutNodeSize(layout);
+    header.box = mesh->box;
+
+    const void* data[SECTION_COUNT] = { mesh->vertices, mesh->normals, mesh->texCoords, mesh->triangles, nodes };
+    const u64 size[SECTION_COUNT] = {
+        mesh->vertexCount * sizeof(Vector3),
+        mesh->normalCount * sizeof(Vector3),
+        mesh->texCoordCount * sizeof(Vector2),
+        mesh->triangleCount * sizeof(Triangle),
+        nodeCount * header.nodeSize
+    };
+    header.count[SECTION_VERTICES]  = mesh->vertexCount;
+    header.count[SECTION_NORMALS]   = mesh->normalCount;
+    header.count[SECTION_TEXCOORDS] = mesh->texCoordCount;
+    header.count[SECTION_TRIANGLES] = mesh->triangleCount;
+    header.count[SECTION_NODES]     = nodeCount;
+
+    u64 offset = AlignCacheOffset(sizeof(BVHCacheHeader));
+    for(i32 i = 0; i < SECTION_COUNT; i++)
+    {
+        header.offset[i] = offset;
+        offset = AlignCacheOffset(offset + size[i]);
+    }
+
+    // Unique per writer, two processes loading the same mesh don't write the same temporary file
+    const std::string path = CachePath(meshFile);
+    const std::string tmpPath = path + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+    std::ofstream f(tmpPath, std::ios::binary | std::ios::trunc);
+    if(!f)
+    {
+        std::cerr << "warn: BVHCache could not write " << tmpPath << "." << std::endl;
+        return false;
+    }
+
+    const char zeros[BVH_CACHE_ALIGNMENT] = { 0 };
+    f.write((const char*)&header, sizeof(BVHCacheHeader));
+    u64 written = sizeof(BVHCacheHeader);
+    for(i32 i = 0; i < SECTION_COUNT; i++)
+    {
+        f.write(zeros, header.offset[i] - written);
+        f.write((const char*)data[i], size[i]);
+        written = header.offset[i] + size[i];
+    }
+
+    f.close();
+
+    std::error_code error;
+    if(!f)
+    {
+        std::cerr << "warn: BVHCache failed writing " << tmpPath << "." << std::endl;
+        std::filesystem::remove(tmpPath, error);
+        return false;
+    }
+
+    std::filesystem::rename(tmpPath, path, error);
+    if(error)
+    {
+        std::cerr << "warn: BVHCache could not replace " << path << " (" << error.message() << ")." << std::endl;
+        std::filesystem::remove(tmpPath, error);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include "../../../common.h"
+#include "build_settings.h"
+#include <string>
+
+struct TriangleMesh;
+
+// Binary cache of a mesh and its acceleration structure, stored next to the mesh file.
+// Only the pointer free layouts (FLAT, WIDE4, WIDE8) are cached, they are traversed straight from the mapping.
+namespace BVHCache
+{
+    std::string CachePath(const std::string& meshFile);
+    u64 HashFile(const std::string& filename);          // 64 bit hash of the file content, 8 bytes at a time
+    u64 HashSettings(const BVHBuildSettings& settings); // Only the fields that change the built structure
+
+    // Returns nullptr if there is no valid cache for the mesh file and settings. The mesh file is matched by
+    // size and modification time, its content is only hashed when the time changed but the size did not.
+    // Every index and node offset is checked against the mapped counts, a damaged cache is rebuilt.
+    TriangleMesh* Load(const std::string& meshFile, const BVHBuildSettings& settings);
+
+    // Writes a temporary file next to the cache and renames it over, readers never see a partial cache
+    bool Save(const std::string& meshFile, const TriangleMesh* mesh);
+}
@@ -0,0 +1,291 @@
+#include "flat_bvh.h"
+#include "../../../utils/memory.h"
+#include "../../../math/math.h"
+#include "../ray_packet.h"
+#include "triangle_blocks.h"
+#include <utility>
+
+// Picks the axis along which the children are furthest apart (the binary trees don't keep the split axis)
+internal u8 ChildSeparationAxis(const AABB& a, const AABB& b)
+{
+    Vector3 d = a.centroid() - b.centroid();
+    f32 dx = fabsf(d.x);
+    f32 dy = fabsf(d.y);
+    f32 dz = fabsf(d.z);
+    if(dx > dy && dx > dz) return 0;
+    return dy > dz ? 1 : 2;
+}
+
+internal FlatBVHNode* AllocateNodes(u32 count)
+{
+    // Align to the cache line so nodes never straddle two lines
+    return (FlatBVHNode*)Memory::AlignedAlloc(count * sizeof(FlatBVHNode), 64);
+}
+
+template<typename Node>
+internal void CountNodes(const Node* node, u32 depth, u32* count, u32* maxDepth)
+{
+    (*count)++;
+    if(depth > *maxDepth) *maxDepth = depth;
+    if(node->nleft != nullptr)
+    {
+        CountNodes(node->nleft, depth + 1, count, maxDepth);
+        CountNodes(node->nright, depth + 1, count, maxDepth);
+    }
+}
+
+internal u32 FlattenBVHNode(FlatBVH* flat, BVHNode* node, u32* offset)
+{
+    u32 index = (*offset)++;
+    FlatBVHNode* out = &flat->nodes[index];
+    out->box = node->box;
+    out->pad = 0;
+    node->flatIndex = index;
+
+    if(node->nleft == nullptr)
+    {
+        out->primOffset = flat->objectCount;
+        out->primCount = (node->left == node->right) ? 1 : 2;
+        out->axis = 0;
+        flat->objects[flat->objectCount++] = node->left;
+        if(node->left != node->right)
+            flat->objects[flat->objectCount++] = node->right;
+    }
+    else
+    {
+        out->primCount = 0;
+        out->axis = ChildSeparationAxis(node->nleft->box, node->nright->box);
+
+        // The first child is always the one on the lower side of the axis
+        BVHNode* first  = node->nleft;
+        BVHNode* second = node->nright;
+        if(first->box.centroid().data[out->axis] > second->box.centroid().data[out->axis])
+            std::swap(first, second);
+
+        FlattenBVHNode(flat, first, offset);
+        out->secondChild = FlattenBVHNode(flat, second, offset);
+    }
+    return index;
+}
+
+internal u32 FlattenBVHNodeTri(FlatBVHTri* flat, const BVHNodeTri* node, u32* offset)
+{
+    u32 index = (*offset)++;
+    FlatBVHNode* out = &flat->nodes[index];
+    out->box = node->box;
+    out->pad = 0;
+
+    if(node->nleft == nullptr)
+    {
+        out->primOffset = (u32)(node->left - flat->mesh->triangles);
+        out->primCount = (u16)(node->right - node->left + 1);
+        out->axis = 0;
+    }
+    else
+    {
+        out->primCount = 0;
+        out->axis = ChildSeparationAxis(node->nleft->box, node->nright->box);
+
+        // The first child is always the one on the lower side of the axis
+        const BVHNodeTri* first  = node->nleft;
+        const BVHNodeTri* second = node->nright;
+        if(first->box.centroid().data[out->axis] > second->box.centroid().data[out->axis])
+            std::swap(first, second);
+
+        FlattenBVHNodeTri(flat, first, offset);
+        out->secondChild = FlattenBVHNodeTri(flat, second, offset);
+    }
+    return index;
+}
+
+FlatBVH* FlatBVH::FromBVHTree(BVHNode* root)
+{
+    if(root == nullptr) return nullptr;
+
+    u32 count = 0;
+    u32 depth = 0;
+    CountNodes(root, 1, &count, &depth);
+    if(depth > FLAT_BVH_MAX_DEPTH)
+    {
+        std::cerr << "warn: FlatBVH cannot flatten a tree with depth " << depth << " (max " << FLAT_BVH_MAX_DEPTH << ")." << std::endl;
+        return nullptr;
+    }
+
+    FlatBVH* flat = new FlatBVH();
+    flat->nodeCount = count;
+    flat->nodes = AllocateNodes(count);
+    flat->objects = new Object*[2 * count]; // Upper bound - at most 2 per leaf
+    flat->objectCount = 0;
+
+    u32 offset = 0;
+    FlattenBVHNode(flat, root, &offset);
+    return flat;
+}
+
+void FlatBVH::FreeFlatBVH(FlatBVH* bvh)
+{
+    if(bvh == nullptr) return;
+    Memory::AlignedFree(bvh->nodes);
+    delete[] bvh->objects;
+    delete bvh;
+}
+
+void FlatBVH::Refit(FlatBVH* bvh, const std::vector<Object*>& changed)
+{
+    for(auto o : changed)
+    {
+        for(BVHNode* node = o->bvhLeaf; node != nullptr; node = node->parent)
+        {
+            bvh->nodes[node->flatIndex].box = node->box;
+        }
+    }
+}
+
+FlatBVHTri* FlatBVHTri::FromBVHTriTree(BVHNodeTri* root)
+{
+    u32 count = 0;
+    u32 depth = 0;
+    CountNodes(root, 1, &count, &depth);
+    if(depth > FLAT_BVH_MAX_DEPTH)
+    {
+        std::cerr << "warn: FlatBVHTri cannot flatten a tree with depth " << depth << " (max " << FLAT_BVH_MAX_DEPTH << ")." << std::endl;
+        return nullptr;
+    }
+
+    FlatBVHTri* flat = new FlatBVHTri();
+    flat->nodeCount = count;
+    flat->nodes = AllocateNodes(count);
+    flat->mesh = root->mesh;
+
+    u32 offset = 0;
+    FlattenBVHNodeTri(flat, root, &offset);
+    return flat;
+}
+
+void FlatBVHTri::FreeFlatBVHTri(FlatBVHTri* bvh)
+{
+    if(bvh == nullptr) return;
+    if(!bvh->mapped) Memory::AlignedFree(bvh->nodes);
+    delete bvh;
+}
+
+// Packet version of TraverseFlat, each node is tested once for all the lanes still active in it
+template<typename LeafFunc>
+internal POSSIBLE_INLINE u32 TraverseFlatPacket(const FlatBVHNode* nodes, RayPacket* p, u32 active, f32 tmin, LeafFunc leafHit)
+{
+    struct StackEntry
+    {
+        u32 node;
+        u32 mask; // Lanes that hit the parent
+    };
+
+    const f32* invDir[3] = { p->ix, p->iy, p->iz };
+
+    StackEntry stack[FLAT_BVH_MAX_DEPTH];
+    i32 sp = 0;
+    StackEntry current = { 0, active };
+    u32 hit = 0;
+    while(true)
+    {
+        const FlatBVHNode* node = &nodes[current.node];
+        u32 mask = PacketMayHitBox(p, node->box, tmin) ? PacketHitBox(p, node->box, tmin, current.mask) : 0;
+        if(mask)
+        {
+            if(node->primCount > 0)
+            {
+                hit |= leafHit(node->primOffset, node->primCount, mask);
+            }
+            else if(invDir[node->axis][LowestSetBit(mask)] < 0.0f) // Near child of the first active lane
+            {
+                stack[sp++] = { current.node + 1, mask };
+                current = { node->secondChild, mask };
+                continue;
+            }
+            else
+            {
+                stack[sp++] = { node->secondChild, mask };
+                current = { current.node + 1, mask };
+                continue;
+            }
+        }
+        if(sp == 0) break;
+        current = stack[--sp];
+    }
+    return hit;
+}
+
+bool FlatBVH::traverse(const Ray* r, f32 tmin, f32 tmax, HitRecord* rec) const
+{
+    return TraverseFlat(nodes, r, tmin, tmax, rec, [&](u32 first, u32 count, f32 t) -> bool {
+        bool hit = false;
+        for(u32 i = first; i < first + count; i++)
+        {
+            if(objects[i]->hit(objects[i], r, tmin, t, rec))
+            {
+                hit = true;
+                t = rec->t;
+            }
+        }
+        return hit;
+    });
+}
+
+bool FlatBVHTri::traverse(const Ray* r, f32 tmin, f32 tmax, HitRecord* rec) const
+{
+    const WatertightRay wr = WatertightRay::From(r);
+    return TraverseFlat(nodes, r, tmin, tmax, rec, [&](u32 first, u32 count, f32 t) -> bool {
+        return mesh->hitLeaf(first, count, r, wr, tmin, t, rec);
+    });
+}
+
+bool FlatBVH::occluded(const Ray* r, f32 tmin, f32 tmax) const
+{
+    return OccludedFlat(nodes, r, tmin, tmax, [&](u32 first, u32 count) -> bool {
+        for(u32 i = first; i < first + count; i++)
+        {
+            if(objects[i]->occluded(objects[i], r, tmin, tmax)) return true;
+        }
+        return false;
+    });
+}
+
+bool FlatBVHTri::occluded(const Ray* r, f32 tmin, f32 tmax) const
+{
+    const WatertightRay wr = WatertightRay::From(r);
+    return OccludedFlat(nodes, r, tmin, tmax, [&](u32 first, u32 count) -> bool {
+        return mesh->occludedLeaf(first, count, r, wr, tmin, tmax);
+    });
+}
+
+u32 FlatBVH::traversePacket(RayPacket* p, u32 active, f32 tmin, HitRecord* recs) const
+{
+    return TraverseFlatPacket(nodes, p, active, tmin, [&](u32 first, u32 count, u32 mask) -> u32 {
+        u32 hit = 0;
+        for(u32 i = first; i < first + count; i++)
+        {
+            hit |= objects[i]->hitPacket(objects[i], p, mask, tmin, recs);
+        }
+        return hit;
+    });
+}
+
+u32 FlatBVHTri::traversePacket(RayPacket* p, u32 active, f32 tmin, HitRecord* recs) const
+{
+    WatertightRay wr[RAY_PACKET_MAX];
+    for(u32 l = 0; l < p->count; l++) wr[l] = WatertightRay::From(&p->rays[l]);
+
+    return TraverseFlatPacket(nodes, p, active, tmin, [&](u32 first, u32 count, u32 mask) -> u32 {
+        u32 hit = 0;
+        while(mask)
+        {
+            u32 l = LowestSetBit(mask);
+            mask &= mask - 1;
+            if(mesh->hitLeaf(first, count, &p->rays[l], wr[l], tmin, p->tmax[l], &recs[l]))
+            {
+                p->tmax[l] = recs[l].t;
+                hit |= 1u << l;
+            }
+        }
+        return hit;
+    });
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "../../../common.h"
+#include "../../../math/aabb.h"
+#include "bvh.h"
+
+struct RayPacket;
+
+#define FLAT_BVH_MAX_DEPTH 64
+
+// Pointer free BVH node, stored in depth-first order.
+// An interior node's first child is the node right after it, the second one is at secondChild.
+struct FlatBVHNode
+{
+    AABB box;
+    union
+    {
+        u32 primOffset;  // Leaf: index of the first primitive
+        u32 secondChild; // Interior: index of the second child
+    };
+    u16 primCount;       // Zero for interior nodes
+    u8 axis;             // Interior: axis that best separates the children
+    u8 pad;
+};
+
+static_assert(sizeof(FlatBVHNode) == 32, "FlatBVHNode should fit two per cache line");
+
+// Stack traversal over a FlatBVHNode array, shared by every flat structure.
+// leafHit(first, count, tmax) tests a leaf's primitives and fills rec on a closer hit.
+// Visits the child on the near side of the split axis first, so tmax shrinks faster.
+template<typename LeafFunc>
+POSSIBLE_INLINE bool TraverseFlat(const FlatBVHNode* nodes, const Ray* r, f32 tmin, f32 tmax, HitRecord* rec, LeafFunc leafHit)
+{
+    Vector3 invDir(1.0f / r->direction.x, 1.0f / r->direction.y, 1.0f / r->direction.z);
+    const bool dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+
+    u32 stack[FLAT_BVH_MAX_DEPTH];
+    i32 sp = 0;
+    u32 current = 0;
+    bool hit = false;
+    while(true)
+    {
+        const FlatBVHNode* node = &nodes[current];
+        if(node->box.hit(r->origin, invDir, tmin, tmax))
+        {
+            if(node->primCount > 0)
+            {
+                if(leafHit(node->primOffset, node->primCount, tmax))
+                {
+                    hit = true;
+                    tmax = rec->t;
+                }
+            }
+            else if(dirIsNeg[node->axis])
+            {
+                stack[sp++] = current + 1;
+                current = node->secondChild;
+                continue;
+            }
+            else
+            {
+                stack[sp++] = node->secondChild;
+                current = current + 1;
+                continue;
+            }
+        }
+        if(sp == 0) break;
+        current = stack[--sp];
+    }
+    return hit;
+}
+
+// Any hit - returns as soon as one leaf primitive blocks the ray
+template<typename LeafFunc>
+POSSIBLE_INLINE bool OccludedFlat(const FlatBVHNode* nodes, const Ray* r, f32 tmin, f32 tmax, LeafFunc leafOccluded)
+{
+    Vector3 invDir(1.0f / r->direction.x, 1.0f / r->direction.y, 1.0f / r->direction.z);
+
+    u32 stack[FLAT_BVH_MAX_DEPTH];
+    i32 sp = 0;
+    u32 current = 0;
+    while(true)
+    {
+        const FlatBVHNode* node = &nodes[current];
+        if(node->box.hit(r->origin, invDir, tmin, tmax))
+        {
+            if(node->primCount > 0)
+            {
+                if(leafOccluded(node->primOffset, node->primCount)) return true;
+            }
+            else
+            {
+                stack[sp++] = node->secondChild;
+                current = current + 1;
+                continue;
+            }
+        }
+        if(sp == 0) break;
+        current = stack[--sp];
+    }
+    return false;
+}
+
+// Flattened version of BVHNode (top level, objects)
+struct FlatBVH
+{
+    FlatBVHNode* nodes;
+    u32 nodeCount;
+    Object** objects; // Leaf objects, in leaf order
+    u32 objectCount;
+
+    static FlatBVH* FromBVHTree(BVHNode* root);
+    static void FreeFlatBVH(FlatBVH* bvh);
+
+    // Copies the boxes above each object's leaf from the (already refitted) source tree
+    static void Refit(FlatBVH* bvh, const std::vector<Object*>& changed);
+
+    bool traverse(const Ray* r, f32 tmin, f32 tmax, HitRecord* rec) const;
+    bool occluded(const Ray* r, f32 tmin, f32 tmax) const;
+    u32 traversePacket(RayPacket* p, u32 active, f32 tmin, HitRecord* recs) const; // Closest hit per lane, returns the lanes that hit
+};
+
+// Flattened version of BVHNodeTri (bottom level, triangles)
+struct FlatBVHTri
+{
+    FlatBVHNode* nodes;
+    u32 nodeCount;
+    TriangleMesh* mesh; // Leaves index mesh->triangles directly
+    bool mapped = false; // Nodes live in the mesh's BVH cache mapping (not owned)
+
+    static FlatBVHTri* FromBVHTriTree(BVHNodeTri* root);
+    static void FreeFlatBVHTri(FlatBVHTri* bvh);
+
+    bool traverse(const Ray* r, f32 tmin, f32 tmax, HitRecord* rec) const;
+    bool occluded(const Ray* r, f32 tmin, f32 tmax) const;
+    u32 traversePacket(RayPacket* p, u32 active, f32 tmin, HitRecord* recs) const; // Closest hit per lane, returns the lanes that hit
+};
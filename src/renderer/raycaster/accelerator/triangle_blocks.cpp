@@ -0,0 +1,290 @@
+#include "triangle_blocks.h"
+#include "../geometry.h"
+#include "../../../utils/memory.h"
+#include "../../../math/math.h"
+
+#ifdef LIQUID_SSE
+#include <immintrin.h>
+#endif
+#include <cstring>
+#include <cmath>
+#include <limits>
+
+WatertightRay WatertightRay::From(const Ray* r)
+{
+    WatertightRay wr;
+    wr.origin = r->origin;
+
+    const Vector3& d = r->direction;
+    f32 ax = fabsf(d.x);
+    f32 ay = fabsf(d.y);
+    f32 az = fabsf(d.z);
+    wr.kz = (ax > ay) ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+    wr.kx = (wr.kz + 1) % 3;
+    wr.ky = (wr.kx + 1) % 3;
+
+    // Keep the winding when the dominant axis points backwards
+    if(d.data[wr.kz] < 0.0f)
+    {
+        i32 tmp = wr.kx;
+        wr.kx = wr.ky;
+        wr.ky = tmp;
+    }
+
+    wr.sx = d.data[wr.kx] / d.data[wr.kz];
+    wr.sy = d.data[wr.ky] / d.data[wr.kz];
+    wr.sz = 1.0f / d.data[wr.kz];
+    return wr;
+}
+
+template<u32 Width>
+TriangleBlocks<Width>* TriangleBlocks<Width>::FromLeaves(TriangleMesh* mesh, const std::vector<TriangleLeaf>& leaves)
+{
+    u32 count = 0;
+    for(const TriangleLeaf& leaf : leaves)
+    {
+        count += (leaf.count + Width - 1) / Width;
+    }
+
+    TriangleBlocks<Width>* tb = new TriangleBlocks<Width>();
+    tb->mesh = mesh;
+    tb->blockCount = count;
+    tb->blocks = (TriangleBlock<Width>*)Memory::AlignedAlloc(count * sizeof(TriangleBlock<Width>), 64);
+    tb->leafBlock = new u32[mesh->triangleCount];
+
+    // Padding lanes are NaN, every comparison fails on them. A zeroed (degenerate) lane is not enough,
+    // with FMA contraction its edge functions come out as rounding noise instead of exact zeros.
+    const f32 nan = std::numeric_limits<f32>::quiet_NaN();
+    for(u32 b = 0; b < count; b++)
+    {
+        for(u32 i = 0; i < 3 * 3 * Width; i++) (&tb->blocks[b].v[0][0][0])[i] = nan;
+        memset(tb->blocks[b].tri, 0, sizeof(tb->blocks[b].tri));
+    }
+
+    u32 next = 0;
+    for(const TriangleLeaf& leaf : leaves)
+    {
+        tb->leafBlock[leaf.first] = next;
+        for(u32 k = 0; k < leaf.count; k++)
+        {
+            TriangleBlock<Width>* b = &tb->blocks[next + k / Width];
+            u32 lane = k % Width;
+            const Triangle& t = mesh->triangles[leaf.first + k];
+            for(u32 vtx = 0; vtx < 3; vtx++)
+            {
+                const Vector3& p = mesh->vertices[t.indicesVertex[vtx]];
+                b->v[vtx][0][lane] = p.x;
+                b->v[vtx][1][lane] = p.y;
+                b->v[vtx][2][lane] = p.z;
+            }
+            b->tri[lane] = leaf.first + k;
+        }
+        next += (leaf.count + Width - 1) / Width;
+    }
+    return tb;
+}
+
+template<u32 Width>
+void TriangleBlocks<Width>::FreeTriangleBlocks(TriangleBlocks<Width>* blocks)
+{
+    if(blocks == nullptr) return;
+    Memory::AlignedFree(blocks->blocks);
+    delete[] blocks->leafBlock;
+    delete blocks;
+}
+
+#ifdef LIQUID_SSE
+// Watertight test of 4 lanes starting at lane g. Returns the hit mask and writes the distances.
+template<u32 Width>
+internal POSSIBLE_INLINE u32 IntersectLanesSSE(const TriangleBlock<Width>* b, u32 g, const WatertightRay& wr, f32 tmin, f32 tmax, f32* t)
+{
+    const __m128 ox = _mm_set1_ps(wr.origin.data[wr.kx]);
+    const __m128 oy = _mm_set1_ps(wr.origin.data[wr.ky]);
+    const __m128 oz = _mm_set1_ps(wr.origin.data[wr.kz]);
+    const __m128 sx = _mm_set1_ps(wr.sx);
+    const __m128 sy = _mm_set1_ps(wr.sy);
+    const __m128 sz = _mm_set1_ps(wr.sz);
+    const __m128 zero = _mm_setzero_ps();
+
+    // Vertices relative to the origin, sheared so the ray runs along +z
+    __m128 x[3], y[3], z[3];
+    for(u32 v = 0; v < 3; v++)
+    {
+        __m128 pz = _mm_sub_ps(_mm_load_ps(b->v[v][wr.kz] + g), oz);
+        x[v] = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(b->v[v][wr.kx] + g), ox), _mm_mul_ps(sx, pz));
+        y[v] = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(b->v[v][wr.ky] + g), oy), _mm_mul_ps(sy, pz));
+        z[v] = _mm_mul_ps(sz, pz);
+    }
+
+    // Scaled barycentrics (2D edge functions)
+    __m128 U = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+    __m128 V = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+    __m128 W = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+
+    __m128 anyNeg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(U, zero), _mm_cmplt_ps(V, zero)), _mm_cmplt_ps(W, zero));
+    __m128 anyPos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(U, zero), _mm_cmpgt_ps(V, zero)), _mm_cmpgt_ps(W, zero));
+    __m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+
+    __m128 T = _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, z[0]), _mm_mul_ps(V, z[1])), _mm_mul_ps(W, z[2]));
+    __m128 dist = _mm_div_ps(T, det);
+
+    __m128 ok = _mm_andnot_ps(_mm_and_ps(anyNeg, anyPos), _mm_cmpneq_ps(det, zero));
+    ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(dist, _mm_set1_ps(tmin)), _mm_cmplt_ps(dist, _mm_set1_ps(tmax))));
+
+    _mm_storeu_ps(t, dist);
+    return (u32)_mm_movemask_ps(ok);
+}
+
+internal POSSIBLE_INLINE u32 IntersectBlock(const TriangleBlock<4>* b, const WatertightRay& wr, f32 tmin, f32 tmax, f32* t)
+{
+    return IntersectLanesSSE(b, 0, wr, tmin, tmax, t);
+}
+
+#ifdef __AVX__
+internal POSSIBLE_INLINE u32 IntersectBlock(const TriangleBlock<8>* b, const WatertightRay& wr, f32 tmin, f32 tmax, f32* t)
+{
+    const __m256 ox = _mm256_set1_ps(wr.origin.data[wr.kx]);
+    const __m256 oy = _mm256_set1_ps(wr.origin.data[wr.ky]);
+    const __m256 oz = _mm256_set1_ps(wr.origin.data[wr.kz]);
+    const __m256 sx = _mm256_set1_ps(wr.sx);
+    const __m256 sy = _mm256_set1_ps(wr.sy);
+    const __m256 sz = _mm256_set1_ps(wr.sz);
+    const __m256 zero = _mm256_setzero_ps();
+
+    __m256 x[3], y[3], z[3];
+    for(u32 v = 0; v < 3; v++)
+    {
+        __m256 pz = _mm256_sub_ps(_mm256_load_ps(b->v[v][wr.kz]), oz);
+        x[v] = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(b->v[v][wr.kx]), ox), _mm256_mul_ps(sx, pz));
+        y[v] = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(b->v[v][wr.ky]), oy), _mm256_mul_ps(sy, pz));
+        z[v] = _mm256_mul_ps(sz, pz);
+    }
+
+    __m256 U = _mm256_sub_ps(_mm256_mul_ps(x[2], y[1]), _mm256_mul_ps(y[2], x[1]));
+    __m256 V = _mm256_sub_ps(_mm256_mul_ps(x[0], y[2]), _mm256_mul_ps(y[0], x[2]));
+    __m256 W = _mm256_sub_ps(_mm256_mul_ps(x[1], y[0]), _mm256_mul_ps(y[1], x[0]));
+
+    __m256 anyNeg = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(U, zero, _CMP_LT_OQ), _mm256_cmp_ps(V, zero, _CMP_LT_OQ)), _mm256_cmp_ps(W, zero, _CMP_LT_OQ));
+    __m256 anyPos = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(U, zero, _CMP_GT_OQ), _mm256_cmp_ps(V, zero, _CMP_GT_OQ)), _mm256_cmp_ps(W, zero, _CMP_GT_OQ));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(U, V), W);
+
+    __m256 T = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(U, z[0]), _mm256_mul_ps(V, z[1])), _mm256_mul_ps(W, z[2]));
+    __m256 dist = _mm256_div_ps(T, det);
+
+    __m256 ok = _mm256_andnot_ps(_mm256_and_ps(anyNeg, anyPos), _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+    ok = _mm256_and_ps(ok, _mm256_and_ps(
+        _mm256_cmp_ps(dist, _mm256_set1_ps(tmin), _CMP_GE_OQ),
+        _mm256_cmp_ps(dist, _mm256_set1_ps(tmax), _CMP_LT_OQ)
+    ));
+
+    _mm256_storeu_ps(t, dist);
+    return (u32)_mm256_movemask_ps(ok);
+}
+#else
+// No AVX - test both halves with SSE
+internal POSSIBLE_INLINE u32 IntersectBlock(const TriangleBlock<8>* b, const WatertightRay& wr, f32 tmin, f32 tmax, f32* t)
+{
+    return IntersectLanesSSE(b, 0, wr, tmin, tmax, t) | (IntersectLanesSSE(b, 4, wr, tmin, tmax, t + 4) << 4);
+}
+#endif
+#else
+// No SSE - one lane at a time, same operations as the SIMD paths
+template<u32 Width>
+internal POSSIBLE_INLINE u32 IntersectBlock(const TriangleBlock<Width>* b, const WatertightRay& wr, f32 tmin, f32 tmax, f32* t)
+{
+    u32 mask = 0;
+    for(u32 l = 0; l < Width; l++)
+    {
+        f32 x[3], y[3], z[3];
+        for(u32 v = 0; v < 3; v++)
+        {
+            f32 pz = b->v[v][wr.kz][l] - wr.origin.data[wr.kz];
+            x[v] = (b->v[v][wr.kx][l] - wr.origin.data[wr.kx]) - wr.sx * pz;
+            y[v] = (b->v[v][wr.ky][l] - wr.origin.data[wr.ky]) - wr.sy * pz;
+            z[v] = wr.sz * pz;
+        }
+
+        f32 U = x[2] * y[1] - y[2] * x[1];
+        f32 V = x[0] * y[2] - y[0] * x[2];
+        f32 W = x[1] * y[0] - y[1] * x[0];
+        bool anyNeg = U < 0.0f || V < 0.0f || W < 0.0f;
+        bool anyPos = U > 0.0f || V > 0.0f || W > 0.0f;
+        f32 det = (U + V) + W;
+
+        f32 T = (U * z[0] + V * z[1]) + W * z[2];
+        t[l] = T / det;
+
+        if(!(anyNeg && anyPos) && det != 0.0f && t[l] >= tmin && t[l] < tmax) mask |= 1u << l;
+    }
+    return mask;
+}
+#endif
+
+template<u32 Width>
+bool TriangleBlocks<Width>::hit(u32 first, u32 count, const Ray* r, const WatertightRay& wr, f32 tmin, f32 tmax, HitRecord* rec) const
+{
+    const TriangleBlock<Width>* b = &blocks[leafBlock[first]];
+    const TriangleBlock<Width>* end = b + (count + Width - 1) / Width;
+
+    const TriangleBlock<Width>* best = nullptr;
+    u32 bestLane = 0;
+    for(; b < end; b++)
+    {
+        f32 t[Width];
+        u32 mask = IntersectBlock(b, wr, tmin, tmax, t);
+        while(mask)
+        {
+            u32 l = LowestSetBit(mask);
+            mask &= mask - 1;
+            if(t[l] < tmax)
+            {
+                tmax = t[l];
+                best = b;
+                bestLane = l;
+            }
+        }
+    }
+    if(best == nullptr) return false;
+
+    // Barycentrics of the closest hit only (same edge functions as the kernel)
+    f32 x[3], y[3];
+    for(u32 v = 0; v < 3; v++)
+    {
+        f32 pz = best->v[v][wr.kz][bestLane] - wr.origin.data[wr.kz];
+        x[v] = best->v[v][wr.kx][bestLane] - wr.origin.data[wr.kx] - wr.sx * pz;
+        y[v] = best->v[v][wr.ky][bestLane] - wr.origin.data[wr.ky] - wr.sy * pz;
+    }
+    f32 U = x[2] * y[1] - y[2] * x[1];
+    f32 V = x[0] * y[2] - y[0] * x[2];
+    f32 W = x[1] * y[0] - y[1] * x[0];
+    f32 invDet = 1.0f / (U + V + W);
+
+    // Same attribute convention as Triangle::hit (uv are the weights of vertices 1 and 2)
+    const Triangle& tri = mesh->triangles[best->tri[bestLane]];
+    f32 u = V * invDet;
+    f32 v = W * invDet;
+    f32 w = U * invDet;
+    rec->t = tmax;
+    rec->uv = Vector2(u, v);
+    rec->n = mesh->normals[tri.indicesNormal[1]] * u
+           + mesh->normals[tri.indicesNormal[2]] * v
+           + mesh->normals[tri.indicesNormal[0]] * w;
+    rec->p = r->at(tmax);
+    return true;
+}
+
+template<u32 Width>
+bool TriangleBlocks<Width>::occluded(u32 first, u32 count, const WatertightRay& wr, f32 tmin, f32 tmax) const
+{
+    const TriangleBlock<Width>* b = &blocks[leafBlock[first]];
+    const TriangleBlock<Width>* end = b + (count + Width - 1) / Width;
+    for(; b < end; b++)
+    {
+        f32 t[Width];
+        if(IntersectBlock(b, wr, tmin, tmax, t)) return true;
+    }
+    return false;
+}
+
+template struct TriangleBlocks<4>;
+template struct TriangleBlocks<8>;
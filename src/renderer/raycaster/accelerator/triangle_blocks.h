@@ -0,0 +1,53 @@
+#pragma once
+
+#include "../../../common.h"
+#include "../../../math/ray.h"
+#include "../hit_record.h"
+
+#include <vector>
+
+struct TriangleMesh;
+
+// Per ray setup of the watertight test (Woop et al. 2013), done once per traversal
+struct WatertightRay
+{
+    Vector3 origin;
+    i32 kx, ky, kz; // kz is the dominant direction axis
+    f32 sx, sy, sz; // Shear that maps the direction to +z
+
+    static WatertightRay From(const Ray* r);
+};
+
+// Width triangles of one leaf, pre-gathered SoA. Padding lanes hold NaNs so they never hit.
+template<u32 Width>
+struct alignas(64) TriangleBlock
+{
+    f32 v[3][3][Width]; // [vertex][axis][lane]
+    u32 tri[Width];     // Source triangle, only read for the closest hit's attributes
+};
+
+struct TriangleLeaf
+{
+    u32 first;
+    u32 count;
+};
+
+// Leaf ordered triangle blocks, built next to a FLAT or WIDE layout
+template<u32 Width>
+struct TriangleBlocks
+{
+    TriangleBlock<Width>* blocks;
+    u32 blockCount;
+    u32* leafBlock; // First block of the leaf starting at each triangle (only leaf starts are set)
+    TriangleMesh* mesh;
+
+    static TriangleBlocks<Width>* FromLeaves(TriangleMesh* mesh, const std::vector<TriangleLeaf>& leaves);
+    static void FreeTriangleBlocks(TriangleBlocks<Width>* blocks);
+
+    // Closest hit among the leaf's triangles in [tmin, tmax), attributes are only fetched for it
+    bool hit(u32 first, u32 count, const Ray* r, const WatertightRay& wr, f32 tmin, f32 tmax, HitRecord* rec) const;
+    bool occluded(u32 first, u32 count, const WatertightRay& wr, f32 tmin, f32 tmax) const; // Any of them in [tmin, tmax)
+};
+
+typedef TriangleBlocks<4> TriangleBlocks4;
+typedef TriangleBlocks<8> TriangleBlocks8;
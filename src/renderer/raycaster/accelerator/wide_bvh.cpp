@@ -0,0 +1,549 @@
+#include "wide_bvh.h"
+#include "../../../utils/memory.h"
+#include "../../../math/math.h"
+#include "../ray_packet.h"
+#include "triangle_blocks.h"
+
+#ifdef LIQUID_SSE
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+internal void CountBinaryNodes(const BVHNodeTri* node, u32* count)
+{
+    (*count)++;
+    if(node->nleft != nullptr)
+    {
+        CountBinaryNodes(node->nleft, count);
+        CountBinaryNodes(node->nright, count);
+    }
+}
+
+internal POSSIBLE_INLINE f32 NodeArea(const BVHNodeTri* node)
+{
+    return node->box.surfaceArea();
+}
+
+template<u32 Width>
+internal void SetChildSlot(WideBVHNode<Width>* node, u32 slot, const AABB& box)
+{
+    node->minX[slot] = box.min.x;
+    node->minY[slot] = box.min.y;
+    node->minZ[slot] = box.min.z;
+    node->maxX[slot] = box.max.x;
+    node->maxY[slot] = box.max.y;
+    node->maxZ[slot] = box.max.z;
+}
+
+// Collapses the binary subtree at node into wide nodes (depth-first), returns the index of the new node
+template<u32 Width>
+internal u32 CollapseNode(WideBVHTri<Width>* wide, const BVHNodeTri* node, u32 depth, u32* maxDepth)
+{
+    if(depth > *maxDepth) *maxDepth = depth;
+
+    // Keep opening the largest interior child until all slots are used
+    const BVHNodeTri* children[Width];
+    u32 n = 0;
+    if(node->nleft == nullptr)
+    {
+        children[n++] = node; // Only happens for a root leaf
+    }
+    else
+    {
+        children[n++] = node->nleft;
+        children[n++] = node->nright;
+    }
+
+    while(n < Width)
+    {
+        i32 best = -1;
+        f32 bestArea = -1.0f;
+        for(u32 i = 0; i < n; i++)
+        {
+            if(children[i]->nleft != nullptr && NodeArea(children[i]) > bestArea)
+            {
+                best = (i32)i;
+                bestArea = NodeArea(children[i]);
+            }
+        }
+        if(best < 0) break;
+
+        const BVHNodeTri* open = children[best];
+        children[best] = open->nleft;
+        children[n++]  = open->nright;
+    }
+
+    u32 index = wide->nodeCount++;
+    WideBVHNode<Width>* out = &wide->nodes[index];
+    out->validMask = (1u << n) - 1;
+
+    // Unused slots get an empty box (they are masked out anyway)
+    AABB empty = AABB::Empty();
+    for(u32 i = n; i < Width; i++)
+    {
+        SetChildSlot(out, i, empty);
+        out->child[i] = 0;
+        out->count[i] = 0;
+    }
+
+    for(u32 i = 0; i < n; i++)
+    {
+        SetChildSlot(out, i, children[i]->box);
+        if(children[i]->nleft == nullptr)
+        {
+            out->child[i] = (u32)(children[i]->left - wide->mesh->triangles);
+            out->count[i] = (u16)(children[i]->right - children[i]->left + 1);
+        }
+        else
+        {
+            // NOTE: nodes is preallocated, so out stays valid through the recursion
+            out->child[i] = CollapseNode(wide, children[i], depth + 1, maxDepth);
+            out->count[i] = 0;
+        }
+    }
+    return index;
+}
+
+template<u32 Width>
+WideBVHTri<Width>* WideBVHTri<Width>::FromBVHTriTree(BVHNodeTri* root)
+{
+    // A wide tree never has more nodes than the binary one
+    u32 binaryCount = 0;
+    CountBinaryNodes(root, &binaryCount);
+
+    WideBVHTri<Width>* wide = new WideBVHTri<Width>();
+    wide->mesh = root->mesh;
+    wide->nodeCount = 0;
+    wide->nodes = (WideBVHNode<Width>*)Memory::AlignedAlloc(binaryCount * sizeof(WideBVHNode<Width>), 64);
+
+    u32 depth = 0;
+    CollapseNode(wide, root, 1, &depth);
+    if(depth > WIDE_BVH_MAX_DEPTH)
+    {
+        std::cerr << "warn: WideBVHTri cannot traverse a tree with depth " << depth << " (max " << WIDE_BVH_MAX_DEPTH << ")." << std::endl;
+        FreeWideBVHTri(wide);
+        return nullptr;
+    }
+    return wide;
+}
+
+template<u32 Width>
+void WideBVHTri<Width>::FreeWideBVHTri(WideBVHTri<Width>* bvh)
+{
+    if(bvh == nullptr) return;
+    if(!bvh->mapped) Memory::AlignedFree(bvh->nodes);
+    delete bvh;
+}
+
+struct WideRay
+{
+    Vector3 origin;
+    Vector3 invDir;
+};
+
+// Slab tests all the children of a node. Returns the hit mask and writes the entry distances.
+#ifdef LIQUID_SSE
+internal POSSIBLE_INLINE u32 IntersectChildren(const WideBVHNode<4>* node, const WideRay& ray, f32 tmin, f32 tmax, f32* dist)
+{
+    const __m128 ox = _mm_set1_ps(ray.origin.x);
+    const __m128 oy = _mm_set1_ps(ray.origin.y);
+    const __m128 oz = _mm_set1_ps(ray.origin.z);
+    const __m128 ix = _mm_set1_ps(ray.invDir.x);
+    const __m128 iy = _mm_set1_ps(ray.invDir.y);
+    const __m128 iz = _mm_set1_ps(ray.invDir.z);
+
+    __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->minX), ox), ix);
+    __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->maxX), ox), ix);
+    __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->minY), oy), iy);
+    __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->maxY), oy), iy);
+    __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->minZ), oz), iz);
+    __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->maxZ), oz), iz);
+
+    __m128 tnear = _mm_max_ps(
+        _mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+        _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_set1_ps(tmin))
+    );
+    __m128 tfar = _mm_min_ps(
+        _mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+        _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(tmax))
+    );
+
+    _mm_storeu_ps(dist, tnear);
+    return (u32)_mm_movemask_ps(_mm_cmple_ps(tnear, _mm_mul_ps(tfar, _mm_set1_ps(AABB_ROBUST_FAR)))) & node->validMask;
+}
+
+#ifdef __AVX__
+internal POSSIBLE_INLINE u32 IntersectChildren(const WideBVHNode<8>* node, const WideRay& ray, f32 tmin, f32 tmax, f32* dist)
+{
+    const __m256 ox = _mm256_set1_ps(ray.origin.x);
+    const __m256 oy = _mm256_set1_ps(ray.origin.y);
+    const __m256 oz = _mm256_set1_ps(ray.origin.z);
+    const __m256 ix = _mm256_set1_ps(ray.invDir.x);
+    const __m256 iy = _mm256_set1_ps(ray.invDir.y);
+    const __m256 iz = _mm256_set1_ps(ray.invDir.z);
+
+    __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node->minX), ox), ix);
+    __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node->maxX), ox), ix);
+    __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node->minY), oy), iy);
+    __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node->maxY), oy), iy);
+    __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node->minZ), oz), iz);
+    __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node->maxZ), oz), iz);
+
+    __m256 tnear = _mm256_max_ps(
+        _mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)),
+        _mm256_max_ps(_mm256_min_ps(t0z, t1z), _mm256_set1_ps(tmin))
+    );
+    __m256 tfar = _mm256_min_ps(
+        _mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)),
+        _mm256_min_ps(_mm256_max_ps(t0z, t1z), _mm256_set1_ps(tmax))
+    );
+
+    _mm256_storeu_ps(dist, tnear);
+    return (u32)_mm256_movemask_ps(_mm256_cmp_ps(tnear, _mm256_mul_ps(tfar, _mm256_set1_ps(AABB_ROBUST_FAR)), _CMP_LE_OQ)) & node->validMask;
+}
+#else
+// No AVX - test both halves with SSE
+internal POSSIBLE_INLINE u32 IntersectChildren(const WideBVHNode<8>* node, const WideRay& ray, f32 tmin, f32 tmax, f32* dist)
+{
+    const __m128 ox = _mm_set1_ps(ray.origin.x);
+    const __m128 oy = _mm_set1_ps(ray.origin.y);
+    const __m128 oz = _mm_set1_ps(ray.origin.z);
+    const __m128 ix = _mm_set1_ps(ray.invDir.x);
+    const __m128 iy = _mm_set1_ps(ray.invDir.y);
+    const __m128 iz = _mm_set1_ps(ray.invDir.z);
+
+    u32 mask = 0;
+    for(u32 h = 0; h < 8; h += 4)
+    {
+        __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->minX + h), ox), ix);
+        __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->maxX + h), ox), ix);
+        __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->minY + h), oy), iy);
+        __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->maxY + h), oy), iy);
+        __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->minZ + h), oz), iz);
+        __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->maxZ + h), oz), iz);
+
+        __m128 tnear = _mm_max_ps(
+            _mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+            _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_set1_ps(tmin))
+        );
+        __m128 tfar = _mm_min_ps(
+            _mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+            _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(tmax))
+        );
+
+        _mm_storeu_ps(dist + h, tnear);
+        mask |= (u32)_mm_movemask_ps(_mm_cmple_ps(tnear, _mm_mul_ps(tfar, _mm_set1_ps(AABB_ROBUST_FAR)))) << h;
+    }
+    return mask & node->validMask;
+}
+#endif
+#else
+// No SSE - one child at a time, same operations as the SIMD paths
+template<u32 Width>
+internal POSSIBLE_INLINE u32 IntersectChildren(const WideBVHNode<Width>* node, const WideRay& ray, f32 tmin, f32 tmax, f32* dist)
+{
+    u32 mask = 0;
+    for(u32 c = 0; c < Width; c++)
+    {
+        f32 t0x = (node->minX[c] - ray.origin.x) * ray.invDir.x;
+        f32 t1x = (node->maxX[c] - ray.origin.x) * ray.invDir.x;
+        f32 t0y = (node->minY[c] - ray.origin.y) * ray.invDir.y;
+        f32 t1y = (node->maxY[c] - ray.origin.y) * ray.invDir.y;
+        f32 t0z = (node->minZ[c] - ray.origin.z) * ray.invDir.z;
+        f32 t1z = (node->maxZ[c] - ray.origin.z) * ray.invDir.z;
+
+        f32 tnear = fmaxf(fmaxf(fminf(t0x, t1x), fminf(t0y, t1y)), fmaxf(fminf(t0z, t1z), tmin));
+        f32 tfar  = fminf(fminf(fmaxf(t0x, t1x), fmaxf(t0y, t1y)), fminf(fmaxf(t0z, t1z), tmax));
+
+        dist[c] = tnear;
+        if(tnear <= tfar * AABB_ROBUST_FAR) mask |= 1u << c;
+    }
+    return mask & node->validMask;
+}
+#endif
+
+// Interval arithmetic version of IntersectChildren for a whole packet (as PacketMayHitBox): a child is left out
+// when no origin and inverse direction within the packet's bounds can reach it before tmax. Incoherent packets
+// have no valid intervals and get every child.
+template<u32 Width>
+internal POSSIBLE_INLINE u32 PacketMayHitChildren(const WideBVHNode<Width>* node, const RayPacket* p, f32 tmin, f32 tmax)
+{
+    if(!p->coherent) return node->validMask;
+
+    // Near and far planes of each axis, picked once by the packet's direction signs
+    const f32* planes[3][2] = {
+        { node->minX, node->maxX },
+        { node->minY, node->maxY },
+        { node->minZ, node->maxZ }
+    };
+
+#ifdef LIQUID_SSE
+    u32 mask = 0;
+    for(u32 h = 0; h < Width; h += 4)
+    {
+        __m128 nearLo = _mm_set1_ps(tmin);
+        __m128 farHi  = _mm_set1_ps(tmax);
+        for(i32 a = 0; a < 3; a++)
+        {
+            const u32 neg = p->invDirMin.data[a] < 0.0f;
+            const __m128 i0 = _mm_set1_ps(p->invDirMin.data[a]);
+            const __m128 i1 = _mm_set1_ps(p->invDirMax.data[a]);
+            const __m128 oMin = _mm_set1_ps(p->originMin.data[a]);
+            const __m128 oMax = _mm_set1_ps(p->originMax.data[a]);
+            const __m128 nearPlane = _mm_load_ps(planes[a][neg] + h);
+            const __m128 farPlane  = _mm_load_ps(planes[a][1 - neg] + h);
+
+            __m128 n0 = _mm_sub_ps(nearPlane, oMax);
+            __m128 n1 = _mm_sub_ps(nearPlane, oMin);
+            nearLo = _mm_max_ps(nearLo, _mm_min_ps(
+                _mm_min_ps(_mm_mul_ps(n0, i0), _mm_mul_ps(n0, i1)),
+                _mm_min_ps(_mm_mul_ps(n1, i0), _mm_mul_ps(n1, i1))
+            ));
+
+            __m128 f0 = _mm_sub_ps(farPlane, oMax);
+            __m128 f1 = _mm_sub_ps(farPlane, oMin);
+            farHi = _mm_min_ps(farHi, _mm_max_ps(
+                _mm_max_ps(_mm_mul_ps(f0, i0), _mm_mul_ps(f0, i1)),
+                _mm_max_ps(_mm_mul_ps(f1, i0), _mm_mul_ps(f1, i1))
+            ));
+        }
+        mask |= (u32)_mm_movemask_ps(_mm_cmple_ps(nearLo, _mm_mul_ps(farHi, _mm_set1_ps(AABB_ROBUST_FAR)))) << h;
+    }
+#else
+    u32 mask = 0;
+    for(u32 c = 0; c < Width; c++)
+    {
+        f32 nearLo = tmin;
+        f32 farHi  = tmax;
+        for(i32 a = 0; a < 3; a++)
+        {
+            const u32 neg = p->invDirMin.data[a] < 0.0f;
+            const f32 i0 = p->invDirMin.data[a];
+            const f32 i1 = p->invDirMax.data[a];
+
+            f32 n0 = planes[a][neg][c] - p->originMax.data[a];
+            f32 n1 = planes[a][neg][c] - p->originMin.data[a];
+            nearLo = fmaxf(nearLo, fminf(fminf(n0 * i0, n0 * i1), fminf(n1 * i0, n1 * i1)));
+
+            f32 f0 = planes[a][1 - neg][c] - p->originMax.data[a];
+            f32 f1 = planes[a][1 - neg][c] - p->originMin.data[a];
+            farHi = fminf(farHi, fmaxf(fmaxf(f0 * i0, f0 * i1), fmaxf(f1 * i0, f1 * i1)));
+        }
+        if(nearLo <= farHi * AABB_ROBUST_FAR) mask |= 1u << c;
+    }
+#endif
+    return mask & node->validMask;
+}
+
+template<u32 Width>
+bool WideBVHTri<Width>::traverse(const Ray* r, f32 tmin, f32 tmax, HitRecord* rec) const
+{
+    struct StackEntry
+    {
+        u32 node;
+        f32 dist;
+    };
+
+    WideRay ray;
+    ray.origin = r->origin;
+    ray.invDir = Vector3(1.0f / r->direction.x, 1.0f / r->direction.y, 1.0f / r->direction.z);
+    const WatertightRay wr = WatertightRay::From(r);
+
+    StackEntry stack[WIDE_BVH_MAX_DEPTH * (Width - 1) + 1];
+    i32 sp = 0;
+    stack[sp++] = { 0, tmin };
+
+    bool hit = false;
+    while(sp > 0)
+    {
+        StackEntry entry = stack[--sp];
+        if(entry.dist > tmax) continue; // Something closer was found after this was pushed
+
+        const WideBVHNode<Width>* node = &nodes[entry.node];
+        f32 dist[Width];
+        u32 mask = IntersectChildren(node, ray, tmin, tmax, dist);
+
+        // Test leaves right away, they might shrink tmax before anything gets pushed
+        StackEntry inner[Width];
+        u32 innerCount = 0;
+        while(mask)
+        {
+            u32 i = LowestSetBit(mask);
+            mask &= mask - 1;
+
+            if(node->count[i] > 0)
+            {
+                if(mesh->hitLeaf(node->child[i], node->count[i], r, wr, tmin, tmax, rec))
+                {
+                    hit = true;
+                    tmax = rec->t;
+                }
+            }
+            else
+            {
+                inner[innerCount++] = { node->child[i], dist[i] };
+            }
+        }
+
+        // Push far to near, so the nearest child is popped first
+        for(u32 i = 1; i < innerCount; i++)
+        {
+            StackEntry e = inner[i];
+            i32 j = (i32)i - 1;
+            while(j >= 0 && inner[j].dist < e.dist)
+            {
+                inner[j + 1] = inner[j];
+                j--;
+            }
+            inner[j + 1] = e;
+        }
+
+        for(u32 i = 0; i < innerCount; i++)
+        {
+            if(inner[i].dist <= tmax)
+                stack[sp++] = inner[i];
+        }
+    }
+    return hit;
+}
+
+template<u32 Width>
+bool WideBVHTri<Width>::occluded(const Ray* r, f32 tmin, f32 tmax) const
+{
+    WideRay ray;
+    ray.origin = r->origin;
+    ray.invDir = Vector3(1.0f / r->direction.x, 1.0f / r->direction.y, 1.0f / r->direction.z);
+    const WatertightRay wr = WatertightRay::From(r);
+
+    // Any hit ends the query, so there is no point in ordering the children
+    u32 stack[WIDE_BVH_MAX_DEPTH * (Width - 1) + 1];
+    i32 sp = 0;
+    stack[sp++] = 0;
+
+    while(sp > 0)
+    {
+        const WideBVHNode<Width>* node = &nodes[stack[--sp]];
+        f32 dist[Width];
+        u32 mask = IntersectChildren(node, ray, tmin, tmax, dist);
+
+        while(mask)
+        {
+            u32 i = LowestSetBit(mask);
+            mask &= mask - 1;
+
+            if(node->count[i] > 0)
+            {
+                if(mesh->occludedLeaf(node->child[i], node->count[i], r, wr, tmin, tmax))
+                    return true;
+            }
+            else
+            {
+                stack[sp++] = node->child[i];
+            }
+        }
+    }
+    return false;
+}
+
+template<u32 Width>
+u32 WideBVHTri<Width>::traversePacket(RayPacket* p, u32 active, f32 tmin, HitRecord* recs) const
+{
+    struct StackEntry
+    {
+        u32 node;
+        u32 mask; // Lanes that hit this node
+        f32 dist; // Entry distance of the first of them (for the ordering only)
+    };
+
+    WatertightRay wr[RAY_PACKET_MAX];
+    for(u32 l = 0; l < p->count; l++) wr[l] = WatertightRay::From(&p->rays[l]);
+
+    StackEntry stack[WIDE_BVH_MAX_DEPTH * (Width - 1) + 1];
+    i32 sp = 0;
+    stack[sp++] = { 0, active, tmin };
+
+    u32 hit = 0;
+    while(sp > 0)
+    {
+        StackEntry entry = stack[--sp];
+        const WideBVHNode<Width>* node = &nodes[entry.node];
+
+        // Children the packet as a whole misses are culled first, then each lane tests the rest at once
+        // (as in traverse), the node fetch is shared
+        f32 farthest = tmin;
+        for(u32 lanes = entry.mask; lanes; lanes &= lanes - 1) farthest = fmaxf(farthest, p->tmax[LowestSetBit(lanes)]);
+        const u32 mayHit = PacketMayHitChildren(node, p, tmin, farthest);
+        if(mayHit == 0) continue;
+
+        u32 childLanes[Width] = {};
+        f32 leadDist[Width];
+        u32 lanes = entry.mask;
+        while(lanes)
+        {
+            u32 l = LowestSetBit(lanes);
+            lanes &= lanes - 1;
+
+            WideRay ray;
+            ray.origin = Vector3(p->ox[l], p->oy[l], p->oz[l]);
+            ray.invDir = Vector3(p->ix[l], p->iy[l], p->iz[l]);
+            f32 dist[Width];
+            u32 mask = IntersectChildren(node, ray, tmin, p->tmax[l], dist) & mayHit;
+            while(mask)
+            {
+                u32 i = LowestSetBit(mask);
+                mask &= mask - 1;
+                if(childLanes[i] == 0) leadDist[i] = dist[i];
+                childLanes[i] |= 1u << l;
+            }
+        }
+
+        StackEntry inner[Width];
+        u32 innerCount = 0;
+        for(u32 i = 0; i < Width; i++)
+        {
+            if(childLanes[i] == 0) continue;
+            if(node->count[i] > 0)
+            {
+                u32 tl = childLanes[i];
+                while(tl)
+                {
+                    u32 l = LowestSetBit(tl);
+                    tl &= tl - 1;
+                    if(mesh->hitLeaf(node->child[i], node->count[i], &p->rays[l], wr[l], tmin, p->tmax[l], &recs[l]))
+                    {
+                        p->tmax[l] = recs[l].t;
+                        hit |= 1u << l;
+                    }
+                }
+            }
+            else
+            {
+                inner[innerCount++] = { node->child[i], childLanes[i], leadDist[i] };
+            }
+        }
+
+        // Push far to near, so the nearest child is popped first
+        for(u32 i = 1; i < innerCount; i++)
+        {
+            StackEntry e = inner[i];
+            i32 j = (i32)i - 1;
+            while(j >= 0 && inner[j].dist < e.dist)
+            {
+                inner[j + 1] = inner[j];
+                j--;
+            }
+            inner[j + 1] = e;
+        }
+
+        for(u32 i = 0; i < innerCount; i++)
+        {
+            stack[sp++] = inner[i];
+        }
+    }
+    return hit;
+}
+
+template struct WideBVHTri<4>;
+template struct WideBVHTri<8>;
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "../../../common.h"
+#include "../../../math/aabb.h"
+#include "bvh.h"
+
+struct RayPacket;
+
+#define WIDE_BVH_MAX_DEPTH 64
+
+// N-ary BVH node with the child bounds stored SoA, so all children are slab tested at once.
+// Each child slot is either an interior node (count == 0) or a leaf with count triangles.
+template<u32 Width>
+struct alignas(64) WideBVHNode
+{
+    f32 minX[Width];
+    f32 minY[Width];
+    f32 minZ[Width];
+    f32 maxX[Width];
+    f32 maxY[Width];
+    f32 maxZ[Width];
+    u32 child[Width];  // Interior: node index, Leaf: first triangle
+    u16 count[Width];  // Leaf triangle count (0 for interior children)
+    u32 validMask;     // Bit set for every used child slot
+};
+
+// Wide version of BVHNodeTri, made by collapsing the binary tree
+template<u32 Width>
+struct WideBVHTri
+{
+    WideBVHNode<Width>* nodes;
+    u32 nodeCount;
+    TriangleMesh* mesh; // Leaves index mesh->triangles directly
+    bool mapped = false; // Nodes live in the mesh's BVH cache mapping (not owned)
+
+    static WideBVHTri<Width>* FromBVHTriTree(BVHNodeTri* root);
+    static void FreeWideBVHTri(WideBVHTri<Width>* bvh);
+
+    bool traverse(const Ray* r, f32 tmin, f32 tmax, HitRecord* rec) const;
+    bool occluded(const Ray* r, f32 tmin, f32 tmax) const;
+    u32 traversePacket(RayPacket* p, u32 active, f32 tmin, HitRecord* recs) const; // Closest hit per lane, returns the lanes that hit
+};
+
+typedef WideBVHTri<4> WideBVHTri4;
+typedef WideBVHTri<8> WideBVHTri8;
@@ -1,76 +1,55 @@
 #include "caster.h"
 #include "accelerator/bvh.h"
 #include "material.h"
+#include "ray_packet.h"
 #include "../../math/random.h"
 #include "../../thread/threadpool.h"
 
-void calculateChunk(JobContext* ctx, std::mutex* img_mtx)
-{
-    // img_mtx->lock();
-    // std::cerr << "info: Starting Job " << ctx->id << "\n";
-    // img_mtx->unlock();
-
-    f32 scale = 1.0f / ctx->spp;
-    f32 localLinePct = 100 / (f32)(ctx->jspan * ctx->numJobs);
-    for(i32 j = ctx->jstart; j < ctx->jstart + ctx->jspan; j++)
-    {
-        for(i32 i = ctx->istart; i < ctx->istart + ctx->ispan; i++)
-        {
-            Vector3 pixel_color(0, 0, 0);
-            for(i32 s = 0; s < ctx->spp; s++)
-            {
-                f32 u = (f32)(i + Random::RandomF32()) / ctx->img->w;
-                f32 v = (f32)(j + Random::RandomF32()) / ctx->img->h;
+#include <algorithm>
 
-                Ray r = ctx->cam->shootRay(u, v);
-                
-                pixel_color = pixel_color + RayCast(&r, ctx->world, 8);
-            }
-
-            pixel_color = pixel_color * scale;
-            pixel_color = pixel_color.sqrtComponents(); // For a gamma of 2.0
-            
-            { // TODO: Better minimize the locks, place line by line instead in j loop (?)
-                std::lock_guard<std::mutex> lock(*img_mtx);
-                ctx->img->setPixel(i, ctx->img->h - j - 1, pixel_color);
-            }
-        }
-        std::lock_guard<std::mutex> lock(*ctx->globalDoneMtx);
-        *ctx->globalDonePct += localLinePct;
-    }
-}
-
-internal bool ClosestIntersect(const Ray* r, const Scene* scene, HitRecord* rec_out)
+bool ClosestIntersect(const Ray* r, const Scene* scene, HitRecord* rec_out)
 {
-    bool hit = scene->top->traverse(r, 0.001f, std::numeric_limits<f32>::max(), rec_out);
+    if(scene->top == nullptr) return false; // Empty scene
+    bool hit = scene->flat ? scene->flat->traverse(r, 0.001f, std::numeric_limits<f32>::max(), rec_out)
+                           : scene->top->traverse(r, 0.001f, std::numeric_limits<f32>::max(), rec_out);
 
     // TODO: Get background sample here (or the uvs)
     return hit;
 }
 
-Vector3 RayCast(const Ray* r, Scene* world, i32 depth)
+internal u32 ClosestIntersectPacket(RayPacket* p, const Scene* scene, HitRecord* recs_out)
 {
-    if(depth <= 0)
+    if(scene->flat) return scene->flat->traversePacket(p, p->fullMask(), 0.001f, recs_out);
+    if(scene->top == nullptr) return 0; // Empty scene
+
+    // No flat top level (too deep to flatten), fall back to single rays
+    u32 hit = 0;
+    for(u32 l = 0; l < p->count; l++)
     {
-        return Vector3(0, 0, 0);
+        if(scene->top->traverse(&p->rays[l], 0.001f, std::numeric_limits<f32>::max(), &recs_out[l]))
+            hit |= 1u << l;
     }
-    HitRecord rec;
-    if(ClosestIntersect(r, world, &rec))
-    {
-        Ray scatter;
-        Vector3 color;
-        Vector3 emit;
+    return hit;
+}
 
-        if(rec.m->emit) emit = rec.m->emit(rec.m, 0, 0, Vector3());
+internal Vector3 ShadeHit(const Ray* r, HitRecord* rec, Scene* world, i32 depth)
+{
+    Ray scatter;
+    Vector3 color;
+    Vector3 emit;
 
-        if(rec.m->scatter(rec.m, r, &scatter, &rec, &color))
-        {
-            // TODO: Don't add emit value when it is (0, 0, 0) - spare the FPU
-            return emit + color * RayCast(&scatter, world, depth - 1);
-        }
-        return emit;
+    if(rec->m->emit) emit = rec->m->emit(rec->m, 0, 0, Vector3());
+
+    if(rec->m->scatter(rec->m, r, &scatter, rec, &color))
+    {
+        // TODO: Don't add emit value when it is (0, 0, 0) - spare the FPU
+        return emit + color * RayCast(&scatter, world, depth - 1);
     }
+    return emit;
+}
 
+Vector3 ShadeMiss(const Ray* r, Scene* world)
+{
     // Naive texture sky
     if(world->sky)
     {
@@ -90,4 +69,161 @@ Vector3 RayCast(const Ray* r, Scene* world, i32 depth)
     // static const Vector3 white  (1.0f, 1.0f, 1.0f);
     // static const Vector3 blueish(0.5f, 0.7f, 1.0f);
     // return white * (1.0f - t) + blueish * t;
-}
\ No newline at end of file
+}
+
+Vector3 RayCast(const Ray* r, Scene* world, i32 depth)
+{
+    if(depth <= 0)
+    {
+        return Vector3(0, 0, 0);
+    }
+    HitRecord rec;
+    if(ClosestIntersect(r, world, &rec))
+    {
+        return ShadeHit(r, &rec, world, depth);
+    }
+    return ShadeMiss(r, world);
+}
+
+void RayCastPacket(const Ray* rays, u32 count, Scene* world, i32 depth, Vector3* colors, Random::Stream* rngs)
+{
+    if(depth <= 0) return;
+
+    RayPacket p;
+    p.set(rays, count, std::numeric_limits<f32>::max());
+
+    HitRecord recs[RAY_PACKET_MAX];
+    u32 hit = ClosestIntersectPacket(&p, world, recs);
+
+    // The bounces are no longer coherent, each lane carries on as a single ray
+    Random::Stream& rng = Random::ThreadStream();
+    for(u32 l = 0; l < count; l++)
+    {
+        if(rngs) rng = rngs[l];
+        Vector3 c = ((hit >> l) & 1) ? ShadeHit(&rays[l], &recs[l], world, depth) : ShadeMiss(&rays[l], world);
+        if(rngs) rngs[l] = rng;
+        colors[l] = colors[l] + c;
+    }
+}
+
+// Writes render pixel (i, j) of the chunk to its buffer, top row first
+internal POSSIBLE_INLINE void EncodeChunkPixel(const JobContext* ctx, u8* tile, i32 i, i32 j, Vector3 pixel_color)
+{
+    pixel_color = pixel_color.sqrtComponents(); // For a gamma of 2.0
+    i32 row = ctx->jstart + ctx->jspan - 1 - j;
+    Image::EncodePixel(&tile[IMAGE_FORMAT_BPP * (row * ctx->ispan + i - ctx->istart)], pixel_color);
+}
+
+internal void CalculateChunkPackets(JobContext* ctx)
+{
+    // Square-ish pixel blocks: 4 = 2x2, 8 = 4x2, 16 = 4x4
+    const i32 bw = ctx->packetSize >= 8 ? 4 : 2;
+    const i32 bh = ctx->packetSize / bw;
+
+    std::vector<u8>& tile = *ctx->tileBuffer;
+    tile.resize((size_t)ctx->ispan * ctx->jspan * IMAGE_FORMAT_BPP);
+    for(i32 bj = ctx->jstart; bj < ctx->jstart + ctx->jspan; bj += bh)
+    {
+        i32 rows = std::min(bh, ctx->jstart + ctx->jspan - bj);
+        u32 sampled = 0;
+        for(i32 bi = ctx->istart; bi < ctx->istart + ctx->ispan; bi += bw)
+        {
+            i32 cols = std::min(bw, ctx->istart + ctx->ispan - bi);
+
+            // Edge blocks and blocks with converged pixels just get smaller packets
+            i32 pi[RAY_PACKET_MAX];
+            i32 pj[RAY_PACKET_MAX];
+            u32 count = 0;
+            for(i32 y = 0; y < rows; y++)
+            {
+                for(i32 x = 0; x < cols; x++)
+                {
+                    if(!PixelActive(ctx, bi + x, bj + y))
+                    {
+                        EncodeChunkPixel(ctx, tile.data(), bi + x, bj + y, ResolvePixel(ctx, bi + x, bj + y));
+                        continue;
+                    }
+                    pi[count] = bi + x;
+                    pj[count] = bj + y;
+                    count++;
+                }
+            }
+            if(count == 0)
+                continue;
+            sampled += count;
+
+            Vector3 pixel_colors[RAY_PACKET_MAX];
+            for(i32 s = 0; s < ctx->spp; s++)
+            {
+                if(ctx->cancel->load(std::memory_order_relaxed))
+                    return;
+
+                // Every lane on its own pixel sample stream, the same numbers the single ray path draws
+                Ray rays[RAY_PACKET_MAX];
+                Random::Stream rngs[RAY_PACKET_MAX];
+                for(u32 k = 0; k < count; k++)
+                {
+                    Random::SeedPixel((u64)pj[k] * ctx->img->w + pi[k], ctx->sppBefore + s, ctx->frame, ctx->sampler, ctx->sampleCount);
+                    f32 u = (f32)(pi[k] + Random::RandomF32()) / ctx->img->w;
+                    f32 v = (f32)(pj[k] + Random::RandomF32()) / ctx->img->h;
+                    rays[k] = ctx->cam->shootRay(u, v);
+                    rngs[k] = Random::ThreadStream();
+                }
+                RayCastPacket(rays, count, ctx->world, 8, pixel_colors, rngs);
+            }
+
+            for(u32 k = 0; k < count; k++)
+            {
+                EncodeChunkPixel(ctx, tile.data(), pi[k], pj[k], AccumulatePixel(ctx, pi[k], pj[k], pixel_colors[k]));
+            }
+        }
+        ctx->progress->fetch_add((u64)sampled * ctx->spp, std::memory_order_relaxed);
+    }
+    PublishChunk(ctx, tile.data());
+}
+
+void calculateChunk(JobContext* ctx)
+{
+    if(ctx->packetSize > 1)
+    {
+        CalculateChunkPackets(ctx);
+        return;
+    }
+
+    // The chunk is rendered into the worker's private buffer and published once finished (dropped when cancelled)
+    std::vector<u8>& tile = *ctx->tileBuffer;
+    tile.resize((size_t)ctx->ispan * ctx->jspan * IMAGE_FORMAT_BPP);
+    for(i32 j = ctx->jstart; j < ctx->jstart + ctx->jspan; j++)
+    {
+        u32 sampled = 0;
+        for(i32 i = ctx->istart; i < ctx->istart + ctx->ispan; i++)
+        {
+            if(ctx->cancel->load(std::memory_order_relaxed))
+                return;
+
+            // Converged pixels of an adaptive render keep what they have
+            if(!PixelActive(ctx, i, j))
+            {
+                EncodeChunkPixel(ctx, tile.data(), i, j, ResolvePixel(ctx, i, j));
+                continue;
+            }
+
+            Vector3 pixel_color(0, 0, 0);
+            for(i32 s = 0; s < ctx->spp; s++)
+            {
+                Random::SeedPixel((u64)j * ctx->img->w + i, ctx->sppBefore + s, ctx->frame, ctx->sampler, ctx->sampleCount);
+                f32 u = (f32)(i + Random::RandomF32()) / ctx->img->w;
+                f32 v = (f32)(j + Random::RandomF32()) / ctx->img->h;
+
+                Ray r = ctx->cam->shootRay(u, v);
+                
+                pixel_color = pixel_color + RayCast(&r, ctx->world, 8);
+            }
+
+            EncodeChunkPixel(ctx, tile.data(), i, j, AccumulatePixel(ctx, i, j, pixel_color));
+            sampled++;
+        }
+        ctx->progress->fetch_add((u64)sampled * ctx->spp, std::memory_order_relaxed);
+    }
+    PublishChunk(ctx, tile.data());
+}
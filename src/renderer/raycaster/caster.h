@@ -1,11 +1,19 @@
 #pragma once
 #include "hittable/object.h"
 #include "../scene.h"
+#include "../../math/random.h"
 
 #include <mutex>
 
 struct JobContext;
 
+bool ClosestIntersect(const Ray* r, const Scene* scene, HitRecord* rec_out);
+Vector3 ShadeMiss(const Ray* r, Scene* world); // Radiance of a ray leaving the scene (sky)
+
 Vector3 RayCast(const Ray* r, Scene* world, i32 depth);
 
-void calculateChunk(JobContext* ctx, std::mutex* img_mtx);
\ No newline at end of file
+// Traces up to RAY_PACKET_MAX coherent primary rays as a packet, adds each lane's radiance to colors.
+// With rngs, each lane's bounces draw from its own stream (left where the lane stopped).
+void RayCastPacket(const Ray* rays, u32 count, Scene* world, i32 depth, Vector3* colors, Random::Stream* rngs = nullptr);
+
+void calculateChunk(JobContext* ctx);
\ No newline at end of file
@@ -1,6 +1,13 @@
 #include "geometry.h"
 #include "../../utils/fileloader.h"
 #include "accelerator/bvh.h"
+#include "accelerator/flat_bvh.h"
+#include "accelerator/wide_bvh.h"
+#include "accelerator/bvh_cache.h"
+#include "accelerator/triangle_blocks.h"
+#include "../../utils/mapped_file.h"
+#include "../../math/math.h"
+#include "ray_packet.h"
 
 #include <unordered_map>
 #include <chrono>
@@ -25,7 +32,7 @@ bool Triangle::hit(const TriangleMesh* mesh, const Ray* r, f32 tmin, f32 tmax, H
 	// IEEE-754 mandates that they compare to false if the left hand side is a NaN.
 	if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f) {
 		float t = Vector3::Dot(n, c) * invDet;
-		if (t >= 0.0f && t < tmax) {
+		if (t >= tmin && t < tmax) {
 			rec->uv = Vector2(u, v);
 			rec->t = t;
             Vector3 nup = mesh->normals[indicesNormal[1]] * u;
@@ -39,6 +46,27 @@ bool Triangle::hit(const TriangleMesh* mesh, const Ray* r, f32 tmin, f32 tmax, H
 	return false;
 }
 
+bool Triangle::occluded(const TriangleMesh* mesh, const Ray* r, f32 tmin, f32 tmax) const
+{
+    // Same test as hit, without the attribute interpolation
+    Vector3 e1 = mesh->vertices[indicesVertex[0]] - mesh->vertices[indicesVertex[1]];
+    Vector3 e2 = mesh->vertices[indicesVertex[2]] - mesh->vertices[indicesVertex[0]];
+    Vector3 n = Vector3::Cross(e1, e2);
+
+    Vector3 c = mesh->vertices[indicesVertex[0]] - r->origin;
+    Vector3 r0 = Vector3::Cross(r->direction, c);
+    f32 invDet = 1.0f / Vector3::Dot(n, r->direction);
+
+    f32 u = Vector3::Dot(r0, e2) * invDet;
+    f32 v = Vector3::Dot(r0, e1) * invDet;
+    if(u >= 0.0f && v >= 0.0f && u + v <= 1.0f)
+    {
+        f32 t = Vector3::Dot(n, c) * invDet;
+        return t >= tmin && t < tmax;
+    }
+    return false;
+}
+
 internal TriangleMesh* ParseWavefrontFile(const std::string& filename)
 {
     TriangleMesh* mesh = new TriangleMesh();
@@ -100,19 +128,85 @@ internal TriangleMesh* ParseWavefrontFile(const std::string& filename)
     return mesh;
 }
 
-TriangleMesh* TriangleMesh::CreateMeshFromFile(const std::string& filename)
+template<u32 Width>
+internal void CollectWideLeaves(const WideBVHTri<Width>* wide, std::vector<TriangleLeaf>* leaves)
+{
+    for(u32 i = 0; i < wide->nodeCount; i++)
+    {
+        const WideBVHNode<Width>& node = wide->nodes[i];
+        for(u32 c = 0; c < Width; c++)
+        {
+            if(((node.validMask >> c) & 1) && node.count[c] > 0) leaves->push_back({ node.child[c], node.count[c] });
+        }
+    }
+}
+
+// Leaves of whichever layout was kept, they are the binary tree leaves in every layout
+internal std::vector<TriangleLeaf> CollectLeaves(const TriangleMesh* m)
+{
+    std::vector<TriangleLeaf> leaves;
+    if(m->flatBvh)
+    {
+        for(u32 i = 0; i < m->flatBvh->nodeCount; i++)
+        {
+            const FlatBVHNode& node = m->flatBvh->nodes[i];
+            if(node.primCount > 0) leaves.push_back({ node.primOffset, node.primCount });
+        }
+    }
+    if(m->wideBvh4) CollectWideLeaves(m->wideBvh4, &leaves);
+    if(m->wideBvh8) CollectWideLeaves(m->wideBvh8, &leaves);
+    return leaves;
+}
+
+internal void BuildTriangleBlocks(TriangleMesh* m)
+{
+    switch(m->bvhSettings.triangleBlockWidth)
+    {
+        case 0: return;
+        case 4: m->triBlocks4 = TriangleBlocks4::FromLeaves(m, CollectLeaves(m)); return;
+        case 8: m->triBlocks8 = TriangleBlocks8::FromLeaves(m, CollectLeaves(m)); return;
+        default:
+            std::cerr << "warn: Unsupported triangle block width " << m->bvhSettings.triangleBlockWidth << " (use 0, 4 or 8) - ignoring..." << std::endl;
+            return;
+    }
+}
+
+TriangleMesh* TriangleMesh::CreateMeshFromFile(const std::string& filename, const BVHBuildSettings& settings)
 {
     auto t0 = std::chrono::steady_clock::now();
+    bool cacheable = settings.cache && settings.layout != BVHLayout::TREE;
+    if(cacheable)
+    {
+        TriangleMesh* cached = BVHCache::Load(filename, settings);
+        if(cached != nullptr)
+        {
+            BuildTriangleBlocks(cached);
+            std::cout << "Loaded BVH cache: " << BVHCache::CachePath(filename) << " [" << cached->triangleCount / 1000 << "k triangles in "
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(
+                          std::chrono::steady_clock::now() - t0
+                         ).count() << "ms].\n";
+            return cached;
+        }
+    }
+
     std::cout << "Parsing wavefront file: " << filename << " ";
     TriangleMesh* m = ParseWavefrontFile(filename.c_str());
+    if(m->triangleCount == 0)
+    {
+        std::cout << "Failed.\n";
+        std::cerr << "error: " << filename << " is missing or has no faces." << std::endl;
+        delete m;
+        return nullptr;
+    }
     std::cout << "Done [" << m->vertexCount / 1000 << "k vertices in " 
               << std::chrono::duration_cast<std::chrono::seconds>(
                   std::chrono::steady_clock::now() - t0
                  ).count() << "s].\n";
 
     t0 = std::chrono::steady_clock::now();
-    std::cout << "Building BVH... ";
-    m->bvh = BVHNodeTri::NewBVHTriTree(m);
+    std::cout << "Building BVH (" << BVHBuildModeName(settings.mode) << ")... ";
+    m->bvhSettings = settings;
+    m->bvh = BVHNodeTri::NewBVHTriTree(m, settings);
 
     BVHNodeTri* node = m->bvh;
     u64 estimatedDepth = 0;
@@ -124,15 +218,127 @@ TriangleMesh* TriangleMesh::CreateMeshFromFile(const std::string& filename)
     }
 
     std::cout << "Done [" << estimatedDepth << " estimated layers in " 
-              << std::chrono::duration_cast<std::chrono::seconds>(
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
                   std::chrono::steady_clock::now() - t0
-                 ).count() << "s].\n";
+                 ).count() << "ms].\n";
+
+    m->box = m->bvh->box;
+    m->boxConstructed = true;
+
+    u32 nodeCount = 0;
+    switch(settings.layout)
+    {
+        case BVHLayout::FLAT:
+            m->flatBvh = FlatBVHTri::FromBVHTriTree(m->bvh);
+            if(m->flatBvh) nodeCount = m->flatBvh->nodeCount;
+            break;
+        case BVHLayout::WIDE4:
+            m->wideBvh4 = WideBVHTri4::FromBVHTriTree(m->bvh);
+            if(m->wideBvh4) nodeCount = m->wideBvh4->nodeCount;
+            break;
+        case BVHLayout::WIDE8:
+            m->wideBvh8 = WideBVHTri8::FromBVHTriTree(m->bvh);
+            if(m->wideBvh8) nodeCount = m->wideBvh8->nodeCount;
+            break;
+        default:
+            break;
+    }
+
+    // The binary tree is only needed as a fallback if the conversion failed
+    if(nodeCount > 0)
+    {
+        std::cout << "Converted BVH to " << BVHLayoutName(settings.layout) << " [" << nodeCount << " nodes].\n";
+        BVHNodeTri::FreeBVHTriTree(m->bvh);
+        m->bvh = nullptr;
+        BuildTriangleBlocks(m);
+
+        if(cacheable)
+        {
+            BVHCache::Save(filename, m);
+        }
+    }
     return m;
 }
 
+bool TriangleMesh::traverse(const Ray* r, f32 tmin, f32 tmax, HitRecord* rec) const
+{
+    if(wideBvh8) return wideBvh8->traverse(r, tmin, tmax, rec);
+    if(wideBvh4) return wideBvh4->traverse(r, tmin, tmax, rec);
+    if(flatBvh)  return flatBvh->traverse(r, tmin, tmax, rec);
+    return bvh->traverse(r, tmin, tmax, rec);
+}
+
+bool TriangleMesh::occluded(const Ray* r, f32 tmin, f32 tmax) const
+{
+    if(wideBvh8) return wideBvh8->occluded(r, tmin, tmax);
+    if(wideBvh4) return wideBvh4->occluded(r, tmin, tmax);
+    if(flatBvh)  return flatBvh->occluded(r, tmin, tmax);
+    return bvh->occluded(r, tmin, tmax);
+}
+
+bool TriangleMesh::hitLeaf(u32 first, u32 count, const Ray* r, const WatertightRay& wr, f32 tmin, f32 tmax, HitRecord* rec) const
+{
+    if(triBlocks4) return triBlocks4->hit(first, count, r, wr, tmin, tmax, rec);
+    if(triBlocks8) return triBlocks8->hit(first, count, r, wr, tmin, tmax, rec);
+
+    bool hit = false;
+    for(u32 t = first; t < first + count; t++)
+    {
+        if(triangles[t].hit(this, r, tmin, tmax, rec))
+        {
+            hit = true;
+            tmax = rec->t;
+        }
+    }
+    return hit;
+}
+
+bool TriangleMesh::occludedLeaf(u32 first, u32 count, const Ray* r, const WatertightRay& wr, f32 tmin, f32 tmax) const
+{
+    if(triBlocks4) return triBlocks4->occluded(first, count, wr, tmin, tmax);
+    if(triBlocks8) return triBlocks8->occluded(first, count, wr, tmin, tmax);
+
+    for(u32 t = first; t < first + count; t++)
+    {
+        if(triangles[t].occluded(this, r, tmin, tmax)) return true;
+    }
+    return false;
+}
+
+u32 TriangleMesh::traversePacket(RayPacket* p, u32 active, f32 tmin, HitRecord* recs) const
+{
+    if(wideBvh8) return wideBvh8->traversePacket(p, active, tmin, recs);
+    if(wideBvh4) return wideBvh4->traversePacket(p, active, tmin, recs);
+    if(flatBvh)  return flatBvh->traversePacket(p, active, tmin, recs);
+
+    // The pointer tree has no packet traversal, trace the lanes one by one
+    u32 hit = 0;
+    while(active)
+    {
+        u32 l = LowestSetBit(active);
+        active &= active - 1;
+        if(bvh->traverse(&p->rays[l], tmin, p->tmax[l], &recs[l]))
+        {
+            p->tmax[l] = recs[l].t;
+            hit |= 1u << l;
+        }
+    }
+    return hit;
+}
+
 TriangleMesh::~TriangleMesh()
 {
-    BVHNodeTri::FreeBVHTriTree(bvh);
+    if(bvh != nullptr) BVHNodeTri::FreeBVHTriTree(bvh);
+    FlatBVHTri::FreeFlatBVHTri(flatBvh);
+    WideBVHTri4::FreeWideBVHTri(wideBvh4);
+    WideBVHTri8::FreeWideBVHTri(wideBvh8);
+    TriangleBlocks4::FreeTriangleBlocks(triBlocks4);
+    TriangleBlocks8::FreeTriangleBlocks(triBlocks8);
+    if(cacheFile != nullptr)
+    {
+        MappedFile::Close(cacheFile);
+        return;
+    }
     delete[] vertices;
     delete[] texCoords;
     delete[] normals;
@@ -5,6 +5,7 @@
 #include "../../math/ray.h"
 #include "hit_record.h"
 #include "../../math/aabb.h"
+#include "accelerator/build_settings.h"
 #include <vector>
 
 struct Geometry
@@ -13,9 +14,12 @@ struct Geometry
     {
         SPHERE,
         TRIMESH,
+        SPHERESET,
         TYPESIZE
     } type;
-    
+
+    virtual ~Geometry() {} // The registry deletes meshes and sphere sets through this
+
     static void RegisterGeometry(std::string name, Geometry* geometry);
     static std::vector<Geometry*> GetAllGeometry();
     static Geometry* GetGeometry(std::string name);
@@ -37,14 +41,30 @@ struct Triangle
     AABB box; // TODO: This should be avoided. use ref to points instead to save space
 
     bool hit(const TriangleMesh* mesh, const Ray* r, f32 tmin, f32 tmax, HitRecord* rec) const;
+    bool occluded(const TriangleMesh* mesh, const Ray* r, f32 tmin, f32 tmax) const; // Any intersection in [tmin, tmax)
 };
 
 struct BVHNodeTri;
+struct FlatBVHTri;
+struct MappedFile;
+struct RayPacket;
+struct WatertightRay;
+template<u32 Width> struct WideBVHTri;
+template<u32 Width> struct TriangleBlocks;
 
 struct TriangleMesh : Geometry
 {
-    BVHNodeTri* bvh;
+    // Only the structure matching bvhSettings.layout is kept after the build
+    BVHNodeTri* bvh = nullptr;
+    FlatBVHTri* flatBvh = nullptr;
+    WideBVHTri<4>* wideBvh4 = nullptr;
+    WideBVHTri<8>* wideBvh8 = nullptr;
+    TriangleBlocks<4>* triBlocks4 = nullptr; // Built next to the FLAT/WIDE layouts (bvhSettings.triangleBlockWidth)
+    TriangleBlocks<8>* triBlocks8 = nullptr;
+    BVHBuildSettings bvhSettings;
+    AABB box;
     bool boxConstructed = false;
+    MappedFile* cacheFile = nullptr; // When loaded from the BVH cache all the arrays below point into it
 
     Vector2* texCoords;
     u64 texCoordCount;
@@ -58,7 +78,16 @@ struct TriangleMesh : Geometry
     Triangle* triangles;
     u64 triangleCount;
 
-    static TriangleMesh* CreateMeshFromFile(const std::string& filename);
+    bool traverse(const Ray* r, f32 tmin, f32 tmax, HitRecord* rec) const;
+    bool occluded(const Ray* r, f32 tmin, f32 tmax) const;
+    u32 traversePacket(RayPacket* p, u32 active, f32 tmin, HitRecord* recs) const;
+
+    // Leaf tests of the FLAT and WIDE traversals (triangles [first, first + count)), use the triangle blocks if any
+    bool hitLeaf(u32 first, u32 count, const Ray* r, const WatertightRay& wr, f32 tmin, f32 tmax, HitRecord* rec) const;
+    bool occludedLeaf(u32 first, u32 count, const Ray* r, const WatertightRay& wr, f32 tmin, f32 tmax) const;
+
+    // Returns nullptr if the file is missing or has no faces
+    static TriangleMesh* CreateMeshFromFile(const std::string& filename, const BVHBuildSettings& settings = BVHBuildSettings());
     static void FreeMesh(TriangleMesh* mesh);
 
     ~TriangleMesh();
@@ -4,6 +4,9 @@
 #include "../../../math/matrix.h"
 #include "../../../math/aabb.h"
 #include "../accelerator/bvh.h"
+#include "../ray_packet.h"
+#include "../sphere_set.h"
+#include "../../../math/math.h"
 #include <vector>
 
 internal std::vector<Object*> internal_refs;
@@ -45,10 +48,10 @@ internal bool HitSphere(const Object* self, const Ray* r, f32 tmin, f32 tmax, Hi
     
     f32 sqrt_d = sqrtf(d);
     f32 root = (-hb - sqrt_d) / a;
-    if(root < tmin || root > tmax)
+    if(root < tmin || root >= tmax)
     {
         root = (-hb + sqrt_d) / a;
-        if(root < tmin || root > tmax)
+        if(root < tmin || root >= tmax)
         {
             return false;
         }
@@ -66,6 +69,46 @@ internal bool HitSphere(const Object* self, const Ray* r, f32 tmin, f32 tmax, Hi
     return true;
 }
 
+internal bool OccludedSphere(const Object* self, const Ray* r, f32 tmin, f32 tmax)
+{
+    Vector3 center = self->transform.position;
+    f32 radius = self->transform.scaleValue.x;
+
+    Vector3 oc = r->origin - center;
+    f32 a  = Vector3::Dot(r->direction, r->direction);
+    f32 hb = Vector3::Dot(oc, r->direction);
+    f32 c  = Vector3::Dot(oc, oc) - radius * radius;
+    f32 d  = hb * hb - a * c;
+
+    if(d < 0)
+    {
+        return false;
+    }
+
+    f32 sqrt_d = sqrtf(d);
+    f32 root = (-hb - sqrt_d) / a;
+    if(root >= tmin && root < tmax) return true;
+    root = (-hb + sqrt_d) / a;
+    return root >= tmin && root < tmax;
+}
+
+// Spheres are cheap enough that a packet is just its lanes one after another
+internal u32 HitSpherePacket(const Object* self, RayPacket* p, u32 active, f32 tmin, HitRecord* recs)
+{
+    u32 hit = 0;
+    while(active)
+    {
+        u32 l = LowestSetBit(active);
+        active &= active - 1;
+        if(HitSphere(self, &p->rays[l], tmin, p->tmax[l], &recs[l]))
+        {
+            p->tmax[l] = recs[l].t;
+            hit |= 1u << l;
+        }
+    }
+    return hit;
+}
+
 internal AABB AABBSphere(const Object* self)
 {
     AABB r;
@@ -83,7 +126,7 @@ Object* Object::CreateSphere(Vector3 center, f32 radius, Material* material)
     o->model->material = material;
     o->model->mesh = Geometry::GetGeometry("Sphere");
     o->model->mesh->type = Geometry::SPHERE;
-    o->transform.tmatrix = Matrix4::Scale(radius, radius, radius) * Matrix4::Translation(center);
+    o->transform.set(Matrix4::Scale(radius, radius, radius) * Matrix4::Translation(center));
     // o->transform.tmatrix.data[0][0] *= 2; // ??? Why ???
     // o->transform.tmatrix.data[1][1] *= 2;
     // o->transform.tmatrix.data[2][2] *= 2;
@@ -91,6 +134,8 @@ Object* Object::CreateSphere(Vector3 center, f32 radius, Material* material)
     o->transform.position = center;
     o->transform.scaleValue.x = radius; // Use scaleValue.x for the radius
     o->hit = HitSphere;
+    o->occluded = OccludedSphere;
+    o->hitPacket = HitSpherePacket;
     o->getAABB = AABBSphere;
     internal_refs.push_back(o);
     return o;
@@ -99,41 +144,181 @@ Object* Object::CreateSphere(Vector3 center, f32 radius, Material* material)
 internal bool HitMesh(const Object* self, const Ray* r, f32 tmin, f32 tmax, HitRecord* rec)
 {
     TriangleMesh* mesh = (TriangleMesh*)self->model->mesh;
-    // rec->m = self->model->material;
-    // return true;
 
-    if(mesh->bvh->traverse(r, tmin, tmax, rec))
+    if(self->transform.identity)
     {
+        if(mesh->traverse(r, tmin, tmax, rec))
+        {
+            rec->m = self->model->material;
+            return true;
+        }
+        return false;
+    }
+
+    // Instance - trace the shared mesh BVH in object space
+    // The direction is not normalized so t is the same in both spaces
+    Ray local;
+    local.origin = self->transform.inverse.transformPoint(r->origin);
+    local.direction = self->transform.inverse.transformVector(r->direction);
+
+    if(mesh->traverse(&local, tmin, tmax, rec))
+    {
+        rec->p = r->at(rec->t);
+        rec->n = self->transform.inverse.transformNormal(rec->n).normalized();
         rec->m = self->model->material;
         return true;
     }
     return false;
 }
 
+internal bool OccludedMesh(const Object* self, const Ray* r, f32 tmin, f32 tmax)
+{
+    TriangleMesh* mesh = (TriangleMesh*)self->model->mesh;
+    if(self->transform.identity)
+    {
+        return mesh->occluded(r, tmin, tmax);
+    }
+
+    Ray local;
+    local.origin = self->transform.inverse.transformPoint(r->origin);
+    local.direction = self->transform.inverse.transformVector(r->direction);
+    return mesh->occluded(&local, tmin, tmax);
+}
+
+internal u32 HitMeshPacket(const Object* self, RayPacket* p, u32 active, f32 tmin, HitRecord* recs)
+{
+    TriangleMesh* mesh = (TriangleMesh*)self->model->mesh;
+    u32 hit;
+
+    if(self->transform.identity)
+    {
+        hit = mesh->traversePacket(p, active, tmin, recs);
+    }
+    else
+    {
+        // Instance - an affine map keeps the packet coherent, so it is traced as a packet in object space too
+        Ray local[RAY_PACKET_MAX];
+        for(u32 l = 0; l < p->count; l++)
+        {
+            local[l].origin = self->transform.inverse.transformPoint(p->rays[l].origin);
+            local[l].direction = self->transform.inverse.transformVector(p->rays[l].direction);
+        }
+
+        RayPacket lp;
+        lp.set(local, p->count, 0.0f);
+        for(u32 l = 0; l < p->count; l++) lp.tmax[l] = p->tmax[l];
+
+        hit = mesh->traversePacket(&lp, active, tmin, recs);
+
+        u32 lanes = hit;
+        while(lanes)
+        {
+            u32 l = LowestSetBit(lanes);
+            lanes &= lanes - 1;
+            p->tmax[l] = lp.tmax[l];
+            recs[l].p = p->rays[l].at(recs[l].t);
+            recs[l].n = self->transform.inverse.transformNormal(recs[l].n).normalized();
+        }
+    }
+
+    u32 lanes = hit;
+    while(lanes)
+    {
+        u32 l = LowestSetBit(lanes);
+        lanes &= lanes - 1;
+        recs[l].m = self->model->material;
+    }
+    return hit;
+}
+
 #define CHECK_ASSIGN_S(lhs, rhs) if(lhs < rhs) rhs = lhs
 #define CHECK_ASSIGN_G(lhs, rhs) if(lhs > rhs) rhs = lhs
 
 internal AABB AABBMesh(const Object* self)
 {
     TriangleMesh* mesh = (TriangleMesh*)self->model->mesh;
-    return mesh->bvh->box;
+    if(self->transform.identity)
+        return mesh->box;
+    return AABB::Transformed(mesh->box, self->transform.tmatrix);
 }
 
 #undef CHECK_ASSIGN_S
 #undef CHECK_ASSIGN_G
 
-Object* Object::CreateMesh(const std::string& geometryName, Material* material)
+Object* Object::CreateMesh(const std::string& geometryName, Material* material, const Matrix4& transform)
 {
+    Geometry* mesh = Geometry::GetGeometry(geometryName);
+    if(mesh == nullptr)
+    {
+        std::cerr << "warn: No geometry named " << geometryName << " - no mesh object created." << std::endl;
+        return nullptr;
+    }
+
     Object* o = new Object();
-    o->model = new Model(); // NOTE: This a pointer for later instancing maybe
+    o->model = new Model(); // NOTE: Only the model is per instance, the mesh and its BVH are shared
     o->model->material = material;
-    o->model->mesh = Geometry::GetGeometry(geometryName);
+    o->model->mesh = mesh;
     o->model->mesh->type = Geometry::TRIMESH;
-    // o->transform.tmatrix = Matrix4::Translation(center) * Matrix4::Scale(radius, radius, radius);
-    // o->transform.position = center;
+    o->transform.set(transform);
     o->transform.scaleValue = Vector3(1, 1, 1);
     o->hit = HitMesh;
+    o->occluded = OccludedMesh;
+    o->hitPacket = HitMeshPacket;
     o->getAABB = AABBMesh;
     internal_refs.push_back(o);
     return o;
 }
+
+internal bool HitSphereSet(const Object* self, const Ray* r, f32 tmin, f32 tmax, HitRecord* rec)
+{
+    return ((SphereSet*)self->model->mesh)->traverse(r, tmin, tmax, rec);
+}
+
+internal bool OccludedSphereSet(const Object* self, const Ray* r, f32 tmin, f32 tmax)
+{
+    return ((SphereSet*)self->model->mesh)->occluded(r, tmin, tmax);
+}
+
+internal u32 HitSphereSetPacket(const Object* self, RayPacket* p, u32 active, f32 tmin, HitRecord* recs)
+{
+    u32 hit = 0;
+    while(active)
+    {
+        u32 l = LowestSetBit(active);
+        active &= active - 1;
+        if(HitSphereSet(self, &p->rays[l], tmin, p->tmax[l], &recs[l]))
+        {
+            p->tmax[l] = recs[l].t;
+            hit |= 1u << l;
+        }
+    }
+    return hit;
+}
+
+internal AABB AABBSphereSet(const Object* self)
+{
+    return ((SphereSet*)self->model->mesh)->box;
+}
+
+Object* Object::CreateSphereSet(const std::string& geometryName)
+{
+    Geometry* set = Geometry::GetGeometry(geometryName);
+    if(set == nullptr)
+    {
+        std::cerr << "warn: No geometry named " << geometryName << " - no sphere set object created." << std::endl;
+        return nullptr;
+    }
+
+    Object* o = new Object();
+    o->model = new Model();
+    o->model->material = nullptr; // Per sphere, see SphereSet::materials
+    o->model->mesh = set;
+    o->model->mesh->type = Geometry::SPHERESET;
+    o->transform.scaleValue = Vector3(1, 1, 1);
+    o->hit = HitSphereSet;
+    o->occluded = OccludedSphereSet;
+    o->hitPacket = HitSphereSetPacket;
+    o->getAABB = AABBSphereSet;
+    internal_refs.push_back(o);
+    return o;
+}
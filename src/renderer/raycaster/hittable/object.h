@@ -6,18 +6,28 @@
 
 struct Model;
 struct RasterData;
+struct BVHNode;
+struct RayPacket;
 
 struct Object
 {
-    // This eliminates the need for virtual functions and their overhead
+    // This eliminates the need for virtual functions and their overhead.
+    // Every test only reports intersections at distances in [tmin, tmax).
     bool (*hit)(const Object* self, const Ray* r, f32 tmin, f32 tmax, HitRecord* rec);
+    bool (*occluded)(const Object* self, const Ray* r, f32 tmin, f32 tmax); // Any hit, no HitRecord
+    u32 (*hitPacket)(const Object* self, RayPacket* p, u32 active, f32 tmin, HitRecord* recs); // Per lane closest hit, returns the lanes that hit
     AABB (*getAABB)(const Object* self);
     Model* model;
     Transform transform;
     RasterData* rasterData = nullptr;
+    BVHNode* bvhLeaf = nullptr; // Leaf holding this object in the last built top level tree (for refits)
 
     static Object* CreateSphere(Vector3 center, f32 radius, Material* material);
-    static Object* CreateMesh(const std::string& file, Material* material);
+    // Every object created from the same geometry shares its mesh and BVH, transform is object to world.
+    // CreateMesh and CreateSphereSet return nullptr if no geometry is registered under the name.
+    static Object* CreateMesh(const std::string& file, Material* material, const Matrix4& transform = Matrix4::Identity());
+    // A registered SphereSet as a single object, materials come from the set
+    static Object* CreateSphereSet(const std::string& geometryName);
 
     static void Delete(Object* obj);
     static void DeleteAll();
@@ -67,11 +67,8 @@ ImageTexture::ImageTexture(const std::string& bitmap, f32 factor)
 internal bool ScatterLambertian(const Material* self, const Ray* r, Ray* scattered, HitRecord* rec, Vector3* outColor)
 {
     scattered->origin = rec->p;
-    scattered->direction = rec->n + Random::RandomUnitNorm();
+    scattered->direction = Random::RandomCosineHemisphere(rec->n.normalized()); // Interpolated mesh normals are not unit
 
-    if (scattered->direction.nearZero())
-        scattered->direction = rec->n;
-    
     Lambertian* ptr = (Lambertian*)self;
     *outColor = ptr->albedo->sample(ptr->albedo, rec->uv, rec->p);
 
@@ -0,0 +1,145 @@
+#include "ray_packet.h"
+
+#ifdef LIQUID_SSE
+#include <immintrin.h>
+#endif
+#include <cmath>
+
+void RayPacket::set(const Ray* r, u32 n, f32 tmaxAll)
+{
+    count = n;
+    originMin = originMax = r[0].origin;
+    invDirMin = invDirMax = Vector3(1.0f / r[0].direction.x, 1.0f / r[0].direction.y, 1.0f / r[0].direction.z);
+    coherent = true;
+
+    for(u32 i = 0; i < RAY_PACKET_MAX; i++)
+    {
+        if(i >= n)
+        {
+            // Padding lanes - tfar is always below tnear
+            ox[i] = oy[i] = oz[i] = 0.0f;
+            ix[i] = iy[i] = iz[i] = 0.0f;
+            tmax[i] = -1.0f;
+            continue;
+        }
+
+        rays[i] = r[i];
+        Vector3 inv(1.0f / r[i].direction.x, 1.0f / r[i].direction.y, 1.0f / r[i].direction.z);
+        ox[i] = r[i].origin.x;
+        oy[i] = r[i].origin.y;
+        oz[i] = r[i].origin.z;
+        ix[i] = inv.x;
+        iy[i] = inv.y;
+        iz[i] = inv.z;
+        tmax[i] = tmaxAll;
+
+        for(i32 a = 0; a < 3; a++)
+        {
+            originMin.data[a] = fminf(originMin.data[a], r[i].origin.data[a]);
+            originMax.data[a] = fmaxf(originMax.data[a], r[i].origin.data[a]);
+            invDirMin.data[a] = fminf(invDirMin.data[a], inv.data[a]);
+            invDirMax.data[a] = fmaxf(invDirMax.data[a], inv.data[a]);
+
+            // Axis aligned directions give infinite intervals (and NaNs further down)
+            if(!std::isfinite(inv.data[a])) coherent = false;
+        }
+    }
+
+    for(i32 a = 0; a < 3; a++)
+    {
+        if((invDirMin.data[a] < 0.0f) != (invDirMax.data[a] < 0.0f)) coherent = false;
+    }
+}
+
+u32 PacketHitBox(const RayPacket* p, const AABB& box, f32 tmin, u32 active, f32* tnear)
+{
+#ifdef LIQUID_SSE
+    const __m128 minX = _mm_set1_ps(box.min.x);
+    const __m128 minY = _mm_set1_ps(box.min.y);
+    const __m128 minZ = _mm_set1_ps(box.min.z);
+    const __m128 maxX = _mm_set1_ps(box.max.x);
+    const __m128 maxY = _mm_set1_ps(box.max.y);
+    const __m128 maxZ = _mm_set1_ps(box.max.z);
+    const __m128 tminV = _mm_set1_ps(tmin);
+
+    u32 mask = 0;
+    for(u32 g = 0; g < p->count; g += 4)
+    {
+        if(((active >> g) & 0xF) == 0) continue;
+
+        const __m128 ox = _mm_load_ps(p->ox + g);
+        const __m128 oy = _mm_load_ps(p->oy + g);
+        const __m128 oz = _mm_load_ps(p->oz + g);
+        const __m128 ix = _mm_load_ps(p->ix + g);
+        const __m128 iy = _mm_load_ps(p->iy + g);
+        const __m128 iz = _mm_load_ps(p->iz + g);
+
+        __m128 t0x = _mm_mul_ps(_mm_sub_ps(minX, ox), ix);
+        __m128 t1x = _mm_mul_ps(_mm_sub_ps(maxX, ox), ix);
+        __m128 t0y = _mm_mul_ps(_mm_sub_ps(minY, oy), iy);
+        __m128 t1y = _mm_mul_ps(_mm_sub_ps(maxY, oy), iy);
+        __m128 t0z = _mm_mul_ps(_mm_sub_ps(minZ, oz), iz);
+        __m128 t1z = _mm_mul_ps(_mm_sub_ps(maxZ, oz), iz);
+
+        __m128 tn = _mm_max_ps(
+            _mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+            _mm_max_ps(_mm_min_ps(t0z, t1z), tminV)
+        );
+        __m128 tf = _mm_min_ps(
+            _mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+            _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_load_ps(p->tmax + g))
+        );
+
+        if(tnear) _mm_storeu_ps(tnear + g, tn);
+        mask |= (u32)_mm_movemask_ps(_mm_cmple_ps(tn, _mm_mul_ps(tf, _mm_set1_ps(AABB_ROBUST_FAR)))) << g;
+    }
+#else
+    u32 mask = 0;
+    for(u32 i = 0; i < p->count; i++)
+    {
+        if(((active >> i) & 1) == 0) continue;
+
+        f32 t0x = (box.min.x - p->ox[i]) * p->ix[i];
+        f32 t1x = (box.max.x - p->ox[i]) * p->ix[i];
+        f32 t0y = (box.min.y - p->oy[i]) * p->iy[i];
+        f32 t1y = (box.max.y - p->oy[i]) * p->iy[i];
+        f32 t0z = (box.min.z - p->oz[i]) * p->iz[i];
+        f32 t1z = (box.max.z - p->oz[i]) * p->iz[i];
+
+        f32 tn = fmaxf(fmaxf(fminf(t0x, t1x), fminf(t0y, t1y)), fmaxf(fminf(t0z, t1z), tmin));
+        f32 tf = fminf(fminf(fmaxf(t0x, t1x), fmaxf(t0y, t1y)), fminf(fmaxf(t0z, t1z), p->tmax[i]));
+
+        if(tnear) tnear[i] = tn;
+        if(tn <= tf * AABB_ROBUST_FAR) mask |= 1u << i;
+    }
+#endif
+    return mask & active;
+}
+
+bool PacketMayHitBox(const RayPacket* p, const AABB& box, f32 tmin)
+{
+    if(!p->coherent) return true;
+
+    // Bounds of (plane - origin) * invDir over every lane, per axis
+    f32 nearLo = tmin;
+    f32 farHi = p->tmax[0];
+    for(u32 i = 1; i < p->count; i++) farHi = fmaxf(farHi, p->tmax[i]);
+
+    for(i32 a = 0; a < 3; a++)
+    {
+        const bool neg = p->invDirMin.data[a] < 0.0f;
+        const f32 nearPlane = neg ? box.max.data[a] : box.min.data[a];
+        const f32 farPlane  = neg ? box.min.data[a] : box.max.data[a];
+        const f32 i0 = p->invDirMin.data[a];
+        const f32 i1 = p->invDirMax.data[a];
+
+        f32 n0 = nearPlane - p->originMax.data[a];
+        f32 n1 = nearPlane - p->originMin.data[a];
+        nearLo = fmaxf(nearLo, fminf(fminf(n0 * i0, n0 * i1), fminf(n1 * i0, n1 * i1)));
+
+        f32 f0 = farPlane - p->originMax.data[a];
+        f32 f1 = farPlane - p->originMin.data[a];
+        farHi = fminf(farHi, fmaxf(fmaxf(f0 * i0, f0 * i1), fmaxf(f1 * i0, f1 * i1)));
+    }
+    return nearLo <= farHi * AABB_ROBUST_FAR;
+}
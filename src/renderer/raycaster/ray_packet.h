@@ -0,0 +1,40 @@
+#pragma once
+#include "../../common.h"
+#include "../../math/ray.h"
+#include "../../math/aabb.h"
+
+#define RAY_PACKET_MAX 16
+
+// Coherent rays (neighbouring primary rays) traced together through the BVHs.
+// Lanes are stored SoA and padded to a multiple of 4 for the SSE box tests.
+struct alignas(64) RayPacket
+{
+    f32 ox[RAY_PACKET_MAX];
+    f32 oy[RAY_PACKET_MAX];
+    f32 oz[RAY_PACKET_MAX];
+    f32 ix[RAY_PACKET_MAX]; // Inverse directions
+    f32 iy[RAY_PACKET_MAX];
+    f32 iz[RAY_PACKET_MAX];
+    f32 tmax[RAY_PACKET_MAX]; // Per lane closest hit so far (padding lanes never hit)
+    Ray rays[RAY_PACKET_MAX]; // For the per lane primitive tests
+    u32 count;
+
+    // Interval bounds over all the lanes, used to cull boxes for the whole packet at once
+    Vector3 originMin, originMax;
+    Vector3 invDirMin, invDirMax;
+    bool coherent; // Every lane has the same direction signs (intervals are only valid then)
+
+    void set(const Ray* r, u32 n, f32 tmaxAll);
+
+    POSSIBLE_INLINE u32 fullMask() const
+    {
+        return (1u << count) - 1;
+    }
+};
+
+// Per lane slab test for the active lanes, returns the lanes that hit.
+// Writes each lane's entry distance to tnear if given.
+u32 PacketHitBox(const RayPacket* p, const AABB& box, f32 tmin, u32 active, f32* tnear = nullptr);
+
+// Conservative interval arithmetic test, false means no lane of the packet can hit the box
+bool PacketMayHitBox(const RayPacket* p, const AABB& box, f32 tmin);
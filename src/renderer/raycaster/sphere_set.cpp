@@ -0,0 +1,286 @@
+#include "sphere_set.h"
+#include "accelerator/bvh.h"
+#include "accelerator/flat_bvh.h"
+#include "../../utils/memory.h"
+#include "../../math/math.h"
+
+#ifdef LIQUID_SSE
+#include <immintrin.h>
+#endif
+#include <limits>
+
+// Picks the axis along which the children are furthest apart (the box tree doesn't keep the split axis)
+internal u8 ChildSeparationAxis(const AABB& a, const AABB& b)
+{
+    Vector3 d = a.centroid() - b.centroid();
+    f32 dx = fabsf(d.x);
+    f32 dy = fabsf(d.y);
+    f32 dz = fabsf(d.z);
+    if(dx > dy && dx > dz) return 0;
+    return dy > dz ? 1 : 2;
+}
+
+internal POSSIBLE_INLINE u32 PaddedCount(u32 count)
+{
+    return (count + SPHERE_SET_LANES - 1) / SPHERE_SET_LANES * SPHERE_SET_LANES;
+}
+
+internal void CountSphereNodes(const BVHNodeBox* node, u32 depth, u32* count, u32* maxDepth, u32* slots)
+{
+    (*count)++;
+    if(depth > *maxDepth) *maxDepth = depth;
+    if(node->nleft != nullptr)
+    {
+        CountSphereNodes(node->nleft, depth + 1, count, maxDepth, slots);
+        CountSphereNodes(node->nright, depth + 1, count, maxDepth, slots);
+    }
+    else
+    {
+        *slots += PaddedCount((u32)(node->right - node->left + 1));
+    }
+}
+
+struct SphereSetSource
+{
+    const std::vector<Vector3>* centers;
+    const std::vector<f32>* radii;
+    const std::vector<u16>* materialIds;
+};
+
+internal u32 FlattenSphereNode(SphereSet* set, const BVHNodeBox* node, const SphereSetSource& src, u32* offset, u32* slot)
+{
+    u32 index = (*offset)++;
+    FlatBVHNode* out = &set->nodes[index];
+    out->box = node->box;
+    out->pad = 0;
+
+    if(node->nleft == nullptr)
+    {
+        u32 count = (u32)(node->right - node->left + 1);
+        out->primOffset = *slot;
+        out->primCount = (u16)count;
+        out->axis = 0;
+        for(u32 k = 0; k < count; k++)
+        {
+            u32 s = *slot + k;
+            u32 i = node->left[k].index;
+            set->centerX[s] = (*src.centers)[i].x;
+            set->centerY[s] = (*src.centers)[i].y;
+            set->centerZ[s] = (*src.centers)[i].z;
+            set->radius[s] = (*src.radii)[i];
+            set->materialId[s] = (*src.materialIds)[i];
+        }
+        *slot += PaddedCount(count);
+    }
+    else
+    {
+        out->primCount = 0;
+        out->axis = ChildSeparationAxis(node->nleft->box, node->nright->box);
+
+        // The first child is always the one on the lower side of the axis
+        const BVHNodeBox* first  = node->nleft;
+        const BVHNodeBox* second = node->nright;
+        if(first->box.centroid().data[out->axis] > second->box.centroid().data[out->axis])
+            std::swap(first, second);
+
+        FlattenSphereNode(set, first, src, offset, slot);
+        out->secondChild = FlattenSphereNode(set, second, src, offset, slot);
+    }
+    return index;
+}
+
+SphereSet* SphereSet::Create(const std::vector<Vector3>& centers, const std::vector<f32>& radii,
+                             const std::vector<u16>& materialIds, const std::vector<Material*>& materials,
+                             const BVHBuildSettings& settings)
+{
+    if(centers.empty() || centers.size() != radii.size() || centers.size() != materialIds.size())
+    {
+        std::cerr << "warn: SphereSet needs one radius and material id per center (got " << centers.size() << "/"
+                  << radii.size() << "/" << materialIds.size() << ")." << std::endl;
+        return nullptr;
+    }
+    for(u16 id : materialIds)
+    {
+        if(id >= materials.size())
+        {
+            std::cerr << "warn: SphereSet material id " << id << " is out of range (" << materials.size() << " materials)." << std::endl;
+            return nullptr;
+        }
+    }
+
+    std::vector<BVHBoxRef> refs(centers.size());
+    for(u32 i = 0; i < (u32)centers.size(); i++)
+    {
+        Vector3 r(radii[i], radii[i], radii[i]);
+        refs[i].index = i;
+        refs[i].box.min = centers[i] - r;
+        refs[i].box.max = centers[i] + r;
+    }
+
+    // A leaf group is tested in one go, so the SAH sees a sphere as a fraction of an intersection
+    BVHBuildSettings leafSettings = settings;
+    leafSettings.intersectionCost /= SPHERE_SET_LANES;
+    leafSettings.maxLeafSize = std::max(settings.maxLeafSize, (u32)SPHERE_SET_LANES);
+    BVHNodeBox* root = BVHNodeBox::NewBVHBoxTree(refs.data(), (u32)refs.size(), leafSettings);
+
+    u32 count = 0;
+    u32 depth = 0;
+    u32 slots = 0;
+    CountSphereNodes(root, 1, &count, &depth, &slots);
+    if(depth > FLAT_BVH_MAX_DEPTH)
+    {
+        std::cerr << "warn: SphereSet cannot flatten a tree with depth " << depth << " (max " << FLAT_BVH_MAX_DEPTH << ")." << std::endl;
+        BVHNodeBox::FreeBVHBoxTree(root);
+        return nullptr;
+    }
+
+    SphereSet* set = new SphereSet();
+    set->type = Geometry::SPHERESET;
+    set->materials = materials;
+    set->sphereCount = (u32)centers.size();
+    set->slotCount = slots;
+    set->nodeCount = count;
+    set->nodes = (FlatBVHNode*)Memory::AlignedAlloc(count * sizeof(FlatBVHNode), 64);
+    set->centerX = (f32*)Memory::AlignedAlloc(slots * sizeof(f32), 64);
+    set->centerY = (f32*)Memory::AlignedAlloc(slots * sizeof(f32), 64);
+    set->centerZ = (f32*)Memory::AlignedAlloc(slots * sizeof(f32), 64);
+    set->radius  = (f32*)Memory::AlignedAlloc(slots * sizeof(f32), 64);
+    set->materialId = new u16[slots];
+
+    const f32 nan = std::numeric_limits<f32>::quiet_NaN();
+    for(u32 s = 0; s < slots; s++)
+    {
+        set->centerX[s] = set->centerY[s] = set->centerZ[s] = set->radius[s] = nan;
+        set->materialId[s] = 0;
+    }
+
+    SphereSetSource src = { &centers, &radii, &materialIds };
+    u32 offset = 0;
+    u32 slot = 0;
+    FlattenSphereNode(set, root, src, &offset, &slot);
+
+    set->box = root->box;
+    BVHNodeBox::FreeBVHBoxTree(root);
+    return set;
+}
+
+SphereSet::~SphereSet()
+{
+    Memory::AlignedFree(nodes);
+    Memory::AlignedFree(centerX);
+    Memory::AlignedFree(centerY);
+    Memory::AlignedFree(centerZ);
+    Memory::AlignedFree(radius);
+    delete[] materialId;
+}
+
+// Tests SPHERE_SET_LANES slots at once. Returns the hit mask and writes the nearest root in [tmin, tmax).
+internal POSSIBLE_INLINE u32 IntersectSpheres(const SphereSet* set, u32 slot, const Ray* r, f32 a, f32 tmin, f32 tmax, f32* t)
+{
+#ifdef LIQUID_SSE
+    const __m128 ox = _mm_set1_ps(r->origin.x);
+    const __m128 oy = _mm_set1_ps(r->origin.y);
+    const __m128 oz = _mm_set1_ps(r->origin.z);
+    const __m128 dx = _mm_set1_ps(r->direction.x);
+    const __m128 dy = _mm_set1_ps(r->direction.y);
+    const __m128 dz = _mm_set1_ps(r->direction.z);
+    const __m128 av = _mm_set1_ps(a);
+    const __m128 tminV = _mm_set1_ps(tmin);
+    const __m128 tmaxV = _mm_set1_ps(tmax);
+
+    __m128 ocx = _mm_sub_ps(ox, _mm_load_ps(set->centerX + slot));
+    __m128 ocy = _mm_sub_ps(oy, _mm_load_ps(set->centerY + slot));
+    __m128 ocz = _mm_sub_ps(oz, _mm_load_ps(set->centerZ + slot));
+    __m128 rad = _mm_load_ps(set->radius + slot);
+
+    __m128 hb = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+    __m128 c  = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_mul_ps(rad, rad));
+    __m128 d  = _mm_sub_ps(_mm_mul_ps(hb, hb), _mm_mul_ps(av, c));
+
+    __m128 sq = _mm_sqrt_ps(_mm_max_ps(d, _mm_setzero_ps()));
+    __m128 root0 = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), hb), sq), av);
+    __m128 root1 = _mm_div_ps(_mm_add_ps(_mm_sub_ps(_mm_setzero_ps(), hb), sq), av);
+
+    // Same as HitSphere: the near root if it is in range, the far one otherwise
+    __m128 in0 = _mm_and_ps(_mm_cmpge_ps(root0, tminV), _mm_cmplt_ps(root0, tmaxV));
+    __m128 in1 = _mm_and_ps(_mm_cmpge_ps(root1, tminV), _mm_cmplt_ps(root1, tmaxV));
+    __m128 dist = _mm_or_ps(_mm_and_ps(in0, root0), _mm_andnot_ps(in0, root1));
+    __m128 ok = _mm_and_ps(_mm_cmpge_ps(d, _mm_setzero_ps()), _mm_or_ps(in0, in1));
+
+    _mm_storeu_ps(t, dist);
+    return (u32)_mm_movemask_ps(ok);
+#else
+    u32 mask = 0;
+    for(u32 l = 0; l < SPHERE_SET_LANES; l++)
+    {
+        f32 ocx = r->origin.x - set->centerX[slot + l];
+        f32 ocy = r->origin.y - set->centerY[slot + l];
+        f32 ocz = r->origin.z - set->centerZ[slot + l];
+        f32 rad = set->radius[slot + l];
+
+        f32 hb = (ocx * r->direction.x + ocy * r->direction.y) + ocz * r->direction.z;
+        f32 c  = ((ocx * ocx + ocy * ocy) + ocz * ocz) - rad * rad;
+        f32 d  = hb * hb - a * c;
+
+        f32 sq = sqrtf(fmaxf(d, 0.0f));
+        f32 root0 = (-hb - sq) / a;
+        f32 root1 = (-hb + sq) / a;
+
+        bool in0 = root0 >= tmin && root0 < tmax;
+        bool in1 = root1 >= tmin && root1 < tmax;
+        t[l] = in0 ? root0 : root1;
+        if(d >= 0.0f && (in0 || in1)) mask |= 1u << l;
+    }
+    return mask;
+#endif
+}
+
+bool SphereSet::traverse(const Ray* r, f32 tmin, f32 tmax, HitRecord* rec) const
+{
+    const f32 a = Vector3::Dot(r->direction, r->direction);
+    return TraverseFlat(nodes, r, tmin, tmax, rec, [&](u32 first, u32 count, f32 t) -> bool {
+        i32 best = -1;
+        for(u32 s = first; s < first + count; s += SPHERE_SET_LANES)
+        {
+            f32 dist[SPHERE_SET_LANES];
+            u32 mask = IntersectSpheres(this, s, r, a, tmin, t, dist);
+            while(mask)
+            {
+                u32 l = LowestSetBit(mask);
+                mask &= mask - 1;
+                if(dist[l] < t)
+                {
+                    t = dist[l];
+                    best = (i32)(s + l);
+                }
+            }
+        }
+        if(best < 0) return false;
+
+        // Attributes of the closest sphere only
+        Vector3 center(centerX[best], centerY[best], centerZ[best]);
+        rec->t = t;
+        rec->p = r->at(t);
+        Vector3 N = (rec->p - center) / radius[best];
+        rec->SetFace(r, N);
+        rec->uv = Vector2(
+            (atan2f(-N.z, N.x) + PI) / (2 * PI),
+            acosf(-N.y) / PI
+        );
+        rec->m = materials[materialId[best]];
+        return true;
+    });
+}
+
+bool SphereSet::occluded(const Ray* r, f32 tmin, f32 tmax) const
+{
+    const f32 a = Vector3::Dot(r->direction, r->direction);
+    return OccludedFlat(nodes, r, tmin, tmax, [&](u32 first, u32 count) -> bool {
+        for(u32 s = first; s < first + count; s += SPHERE_SET_LANES)
+        {
+            f32 dist[SPHERE_SET_LANES];
+            if(IntersectSpheres(this, s, r, a, tmin, tmax, dist)) return true;
+        }
+        return false;
+    });
+}
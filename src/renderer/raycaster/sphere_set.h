@@ -0,0 +1,38 @@
+#pragma once
+
+#include "geometry.h"
+#include <vector>
+
+struct Material;
+struct FlatBVHNode;
+
+#define SPHERE_SET_LANES 4 // Spheres tested at once (SSE), leaves are padded to a multiple of this
+
+// Many world space spheres stored SoA under their own flat BVH, the whole set is one top level object
+struct SphereSet : Geometry
+{
+    // Leaf ordered, padding slots are NaN and never hit
+    f32* centerX = nullptr;
+    f32* centerY = nullptr;
+    f32* centerZ = nullptr;
+    f32* radius = nullptr;
+    u16* materialId = nullptr; // Index into materials
+    u32 slotCount = 0;         // Spheres plus padding
+    u32 sphereCount = 0;
+
+    std::vector<Material*> materials;
+
+    FlatBVHNode* nodes = nullptr; // Leaves index the slots
+    u32 nodeCount = 0;
+    AABB box;
+
+    // Returns nullptr if the arrays don't match or the tree is too deep to traverse
+    static SphereSet* Create(const std::vector<Vector3>& centers, const std::vector<f32>& radii,
+                             const std::vector<u16>& materialIds, const std::vector<Material*>& materials,
+                             const BVHBuildSettings& settings = BVHBuildSettings());
+
+    bool traverse(const Ray* r, f32 tmin, f32 tmax, HitRecord* rec) const;
+    bool occluded(const Ray* r, f32 tmin, f32 tmax) const; // Any sphere in [tmin, tmax)
+
+    ~SphereSet();
+};
@@ -0,0 +1,197 @@
+#include "wavefront.h"
+#include "caster.h"
+#include "material.h"
+#include "../../math/random.h"
+#include "../../thread/threadpool.h"
+
+#include <vector>
+#include <algorithm>
+
+#define WAVEFRONT_MAX_DEPTH 8 // Same bounce limit as the recursive RayCast
+
+struct PathState
+{
+    Ray ray;
+    Vector3 throughput; // Product of the scatter colors so far
+    u32 pixel;          // Index into the chunk's radiance buffer
+    Random::Stream rng;  // The path's own stream, so the sort order never changes what it draws
+};
+
+struct ShadeItem
+{
+    const Material* m;
+    u32 path;
+};
+
+// Spreads the low 9 bits of v so there are two zero bits between each one
+internal POSSIBLE_INLINE u32 ExpandBits9(u32 v)
+{
+    v &= 0x1ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v <<  8)) & 0x0300f00f;
+    v = (v | (v <<  4)) & 0x030c30c3;
+    v = (v | (v <<  2)) & 0x09249249;
+    return v;
+}
+
+// Direction octant on top of the origin's Morton code, so rays leaving nearby points
+// in similar directions get neighbouring keys (and traverse the same nodes back to back)
+internal u32 RaySortKey(const Ray& r, const AABB& bounds, const Vector3& invExtent)
+{
+    u32 octant = ((r.direction.x < 0.0f) << 2) | ((r.direction.y < 0.0f) << 1) | (r.direction.z < 0.0f);
+    u32 q[3];
+    for(i32 a = 0; a < 3; a++)
+    {
+        f32 c = (r.origin.data[a] - bounds.min.data[a]) * invExtent.data[a];
+        q[a] = (u32)(std::min(std::max(c, 0.0f), 1.0f) * 511.0f);
+    }
+    return (octant << 27) | (ExpandBits9(q[0]) << 2) | (ExpandBits9(q[1]) << 1) | ExpandBits9(q[2]);
+}
+
+void calculateChunkWavefront(JobContext* ctx)
+{
+    const u32 pixelCount = (u32)(ctx->ispan * ctx->jspan);
+    std::vector<Vector3> radiance(pixelCount);
+
+    std::vector<PathState> paths;
+    std::vector<PathState> next;
+    std::vector<HitRecord> recs;
+    std::vector<u8> hit;
+    std::vector<u64> order;
+    std::vector<ShadeItem> shade;
+    paths.reserve(pixelCount);
+    next.reserve(pixelCount);
+
+    // An empty scene has no bounds, every path misses anyway
+    AABB bounds;
+    if(ctx->world->flat)     bounds = ctx->world->flat->nodes[0].box;
+    else if(ctx->world->top) bounds = ctx->world->top->box;
+    const Vector3 extent = bounds.max - bounds.min;
+    const Vector3 invExtent(
+        1.0f / std::max(extent.x, 1e-6f),
+        1.0f / std::max(extent.y, 1e-6f),
+        1.0f / std::max(extent.z, 1e-6f)
+    );
+
+    // Converged pixels of an adaptive render get no paths, decided once for the whole chunk
+    std::vector<u8> active(pixelCount);
+    u32 activeCount = 0;
+    for(i32 j = 0; j < ctx->jspan; j++)
+    {
+        for(i32 i = 0; i < ctx->ispan; i++)
+        {
+            active[j * ctx->ispan + i] = PixelActive(ctx, ctx->istart + i, ctx->jstart + j);
+            activeCount += active[j * ctx->ispan + i];
+        }
+    }
+
+    for(i32 s = 0; s < ctx->spp && activeCount > 0; s++)
+    {
+        // Generate - one camera path per active pixel
+        paths.clear();
+        for(i32 j = ctx->jstart; j < ctx->jstart + ctx->jspan; j++)
+        {
+            for(i32 i = ctx->istart; i < ctx->istart + ctx->ispan; i++)
+            {
+                if(!active[(j - ctx->jstart) * ctx->ispan + (i - ctx->istart)])
+                    continue;
+
+                Random::SeedPixel((u64)j * ctx->img->w + i, ctx->sppBefore + s, ctx->frame, ctx->sampler, ctx->sampleCount);
+                f32 u = (f32)(i + Random::RandomF32()) / ctx->img->w;
+                f32 v = (f32)(j + Random::RandomF32()) / ctx->img->h;
+
+                PathState p;
+                p.ray = ctx->cam->shootRay(u, v);
+                p.rng = Random::ThreadStream();
+                p.throughput = Vector3(1, 1, 1);
+                p.pixel = (u32)((j - ctx->jstart) * ctx->ispan + (i - ctx->istart));
+                paths.push_back(p);
+            }
+        }
+
+        for(i32 depth = 0; depth < WAVEFRONT_MAX_DEPTH && !paths.empty(); depth++)
+        {
+            if(ctx->cancel->load(std::memory_order_relaxed))
+                return;
+
+            const u32 n = (u32)paths.size();
+
+            // Extend - closest hits in ray key order
+            order.resize(n);
+            recs.resize(n);
+            hit.resize(n);
+            for(u32 i = 0; i < n; i++)
+            {
+                order[i] = ((u64)RaySortKey(paths[i].ray, bounds, invExtent) << 32) | i;
+            }
+            std::sort(order.begin(), order.end());
+
+            for(u32 k = 0; k < n; k++)
+            {
+                u32 i = (u32)order[k];
+                hit[i] = ClosestIntersect(&paths[i].ray, ctx->world, &recs[i]);
+            }
+
+            // Shade - misses take the sky, hits are grouped by material type then material
+            shade.clear();
+            for(u32 i = 0; i < n; i++)
+            {
+                if(hit[i])
+                {
+                    shade.push_back({ recs[i].m, i });
+                }
+                else
+                {
+                    radiance[paths[i].pixel] = radiance[paths[i].pixel] + paths[i].throughput * ShadeMiss(&paths[i].ray, ctx->world);
+                }
+            }
+            std::sort(shade.begin(), shade.end(), [](const ShadeItem& a, const ShadeItem& b) {
+                if(a.m->scatter != b.m->scatter) return (uintptr_t)a.m->scatter < (uintptr_t)b.m->scatter;
+                if(a.m != b.m) return (uintptr_t)a.m < (uintptr_t)b.m;
+                return a.path < b.path;
+            });
+
+            // Continue - only the paths that scattered go on to the next bounce
+            Random::Stream& rng = Random::ThreadStream();
+            next.clear();
+            for(const ShadeItem& item : shade)
+            {
+                const PathState& p = paths[item.path];
+                HitRecord* rec = &recs[item.path];
+
+                if(item.m->emit)
+                {
+                    radiance[p.pixel] = radiance[p.pixel] + p.throughput * item.m->emit(item.m, 0, 0, Vector3());
+                }
+
+                PathState scattered;
+                Vector3 color;
+                rng = p.rng;
+                if(item.m->scatter(item.m, &p.ray, &scattered.ray, rec, &color))
+                {
+                    scattered.throughput = p.throughput * color;
+                    scattered.pixel = p.pixel;
+                    scattered.rng = rng;
+                    next.push_back(scattered);
+                }
+            }
+            paths.swap(next);
+        }
+
+        ctx->progress->fetch_add(activeCount, std::memory_order_relaxed);
+    }
+
+    std::vector<u8>& tile = *ctx->tileBuffer;
+    tile.resize((size_t)pixelCount * IMAGE_FORMAT_BPP);
+    for(i32 j = 0; j < ctx->jspan; j++)
+    {
+        for(i32 i = 0; i < ctx->ispan; i++)
+        {
+            Vector3 pixel_color = active[j * ctx->ispan + i] ? AccumulatePixel(ctx, ctx->istart + i, ctx->jstart + j, radiance[j * ctx->ispan + i])
+                                                             : ResolvePixel(ctx, ctx->istart + i, ctx->jstart + j);
+            pixel_color = pixel_color.sqrtComponents(); // For a gamma of 2.0
+            Image::EncodePixel(&tile[IMAGE_FORMAT_BPP * ((ctx->jspan - 1 - j) * ctx->ispan + i)], pixel_color);
+        }
+    }
+    PublishChunk(ctx, tile.data());
+}
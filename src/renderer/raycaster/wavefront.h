@@ -0,0 +1,11 @@
+#pragma once
+#include "../../common.h"
+
+#include <mutex>
+
+struct JobContext;
+
+// Breadth-first alternative to calculateChunk. All the paths of one sample over the chunk
+// advance a bounce at a time: generate, extend (rays sorted by origin/direction), shade (hits
+// grouped by material) and continue with the paths that scattered.
+void calculateChunkWavefront(JobContext* ctx);
@@ -8,6 +8,7 @@
 #include "../camera.h"
 #include "../raycaster/caster.h"
 #include "../raycaster/material.h"
+#include "../raycaster/sphere_set.h"
 #include "../../thread/threadpool.h"
 #include "samples.h"
 
@@ -28,6 +29,7 @@ Scene Samples::BasicSphere(std::atomic<i32>* progress)
     Scene world;
     world.name = "SimpleSpaceEarth";
     world.top = tree;
+    world.flat = FlatBVH::FromBVHTree(tree);
     world.objList = { sun, earth };
     world.sky = nullptr; // = Black
     world.renderCamera = new Camera(Vector3(0, 0, 250), Vector3(50, 0, 0), Vector3(0, 1, 0), 15.0f, 16.0f / 9.0f, .01f, 250);
@@ -51,6 +53,7 @@ Scene Samples::SingleSphere(std::atomic<i32>* progress)
     Scene world;
     world.name = "SingleEarth";
     world.top = tree;
+    world.flat = FlatBVH::FromBVHTree(tree);
     world.objList = { earth };
     world.sky = new ColorTexture(Vector3(0.1f, 0.1f, 0.1f));
     world.renderCamera = new Camera(Vector3(15, 15, 15), Vector3(0, 0, 0), Vector3(0, 1, 0), 45.0f, 16.0f / 9.0f, .01f, 250);
@@ -83,6 +86,7 @@ Scene Samples::ColoredSpheres(std::atomic<i32>* progress)
     Scene world;
     world.name = "ColoredSpheres";
     world.top = tree;
+    world.flat = FlatBVH::FromBVHTree(tree);
     world.objList = { s0, s1, s2, ground, light };
     world.sky = nullptr; // Black
     world.renderCamera = new Camera(Vector3(10, 5, 10), Vector3(0, 0, 0), Vector3(0, 1, 0), 45.0f, 16.0f / 9.0f, .01f, sqrtf(22));
@@ -91,3 +95,64 @@ Scene Samples::ColoredSpheres(std::atomic<i32>* progress)
 
     return world;
 }
+
+Scene Samples::ManySpheres(std::atomic<i32>* progress)
+{
+    Geometry::RegisterGeometry("Sphere", new Sphere());
+
+    std::vector<Material*> materials = {
+        Material::RegisterMaterial("Red", new Lambertian(Vector3(1, 0, 0))),
+        Material::RegisterMaterial("Green", new Lambertian(Vector3(0, 1, 0))),
+        Material::RegisterMaterial("Blue", new Lambertian(Vector3(0, 1, 1))),
+        Material::RegisterMaterial("Steel", new Metal(Vector3(0.8f, 0.8f, 0.8f), 0.1f)),
+        Material::RegisterMaterial("ClearGlass", new Glass(Vector3(1, 1, 1), 1.5f))
+    };
+    Material* c = Material::RegisterMaterial("Check", new Lambertian(Vector3(0, 0, 0), Vector3(1, 1, 1)));
+    Material* l = Material::RegisterMaterial("Light", new DiffuseLight(Vector3(1, 1, 1), 2.0f));
+
+    // Small spheres resting on the ground, all in a single SphereSet
+    const u32 count = 250000;
+    std::vector<Vector3> centers(count);
+    std::vector<f32> radii(count);
+    std::vector<u16> materialIds(count);
+    for(u32 i = 0; i < count; i++)
+    {
+        f32 r = Random::RandomF32Range(0.05f, 0.25f);
+        centers[i] = Vector3(Random::RandomF32Range(-100, 100), r - 1, Random::RandomF32Range(-100, 100));
+        radii[i] = r;
+        materialIds[i] = (u16)(i % materials.size());
+    }
+
+    progress->store(25);
+
+    std::vector<Object*> objects;
+    SphereSet* spheres = SphereSet::Create(centers, radii, materialIds, materials);
+    if(spheres != nullptr)
+    {
+        Geometry::RegisterGeometry("ManySpheres", spheres);
+        objects.push_back(Object::CreateSphereSet("ManySpheres"));
+    }
+    else
+    {
+        std::cerr << "warn: ManySpheres could not build its sphere set - rendering without the small spheres." << std::endl;
+    }
+
+    progress->store(75);
+
+    objects.push_back(Object::CreateSphere(Vector3(0, -1001, 0), 1000, c));
+    objects.push_back(Object::CreateSphere(Vector3(-5, 5, -5), 5, l));
+
+    BVHNode* tree = BVHNode::NewBVHTree(objects);
+
+    Scene world;
+    world.name = "ManySpheres";
+    world.top = tree;
+    world.flat = FlatBVH::FromBVHTree(tree);
+    world.objList = objects;
+    world.sky = new ColorTexture(Vector3(0.1f, 0.1f, 0.1f));
+    world.renderCamera = new Camera(Vector3(10, 5, 10), Vector3(0, 0, 0), Vector3(0, 1, 0), 45.0f, 16.0f / 9.0f, .01f, sqrtf(22));
+
+    progress->store(100);
+
+    return world;
+}
@@ -10,4 +10,5 @@ namespace Samples
     Scene BasicSphere(std::atomic<i32>* progress);
     Scene SingleSphere(std::atomic<i32>* progress);
     Scene ColoredSpheres(std::atomic<i32>* progress);
+    Scene ManySpheres(std::atomic<i32>* progress);
 }
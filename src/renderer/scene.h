@@ -2,22 +2,56 @@
 #include "raycaster/geometry.h"
 #include "../math/ray.h"
 #include "raycaster/accelerator/bvh.h"
+#include "raycaster/accelerator/flat_bvh.h"
 #include "raycaster/material.h"
 #include "camera.h"
 
 struct Scene
 {
-    // Contains all of the scene objects
+    // Contains all of the scene objects (nullptr for an empty scene)
     BVHNode* top;
+    FlatBVH* flat = nullptr; // Used for traversal when present
     Texture* sky;
     Camera* renderCamera;
     std::string name = "Unnamed";
     std::vector<Object*> objList;
+
+    // True if anything blocks the ray in [tmin, tmax) - cheaper than a closest hit (shadow/visibility rays)
+    bool occluded(const Ray* r, f32 tmin, f32 tmax) const
+    {
+        if(flat) return flat->occluded(r, tmin, tmax);
+        return top && top->occluded(r, tmin, tmax);
+    }
     
+    // Call after moving objects - refits the trees, rebuilds degraded subtrees and re-flattens only if needed.
+    // Returns true if a subtree had to be rebuilt (the flat tree was then rebuilt as well).
+    static bool UpdateObjects(Scene* s, const std::vector<Object*>& changed)
+    {
+        bool rebuilt = false;
+        s->top = BVHNode::Update(s->top, changed, &rebuilt);
+        if(s->flat == nullptr) return rebuilt;
+
+        if(rebuilt)
+        {
+            FlatBVH::FreeFlatBVH(s->flat);
+            s->flat = FlatBVH::FromBVHTree(s->top);
+        }
+        else
+        {
+            FlatBVH::Refit(s->flat, changed);
+        }
+        return rebuilt;
+    }
+
     static void FreeScene(Scene* s)
     {
         BVHNode::FreeBVHTree(s->top);
+        FlatBVH::FreeFlatBVH(s->flat);
         delete s->sky;
         delete s->renderCamera;
+        s->top = nullptr;
+        s->flat = nullptr;
+        s->sky = nullptr;
+        s->renderCamera = nullptr;
     }
 };
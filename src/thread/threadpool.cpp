@@ -1,144 +1,555 @@
 #include "threadpool.h"
 
-internal const u32 MAX_THREAD_CONCURRENCY = std::thread::hardware_concurrency();
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 
-ThreadPool::ThreadPool(
-    u32 chunkSizeX, u32 chunkSizeY,
-    Scene* world,
-    Image* img,
-    i32 spp,
-    void (*jobFunc)(JobContext* ctx, std::mutex* img_mtx),
-    std::atomic<bool>* finish,
-    f32* gDonePct,
-    std::mutex* gDoneMtx
-)
+// Worker identity of the calling thread, tasks pushed from a worker go to its own deque
+internal thread_local const ThreadPool* CurrentPool = nullptr;
+internal thread_local i32 CurrentWorker = -1;
+
+DirtyTileList::~DirtyTileList()
 {
-    this->chunkSizeX = chunkSizeX;
-    this->chunkSizeY = chunkSizeY;
+    Free(takeAll());
+}
 
-    istep = img->w / chunkSizeX;
-    jstep = img->h / chunkSizeY;
+void DirtyTileList::push(i32 x, i32 y, i32 w, i32 h, const u8* pixels)
+{
+    const size_t size = (size_t)IMAGE_FORMAT_BPP * w * h;
+    DirtyTile* tile = new DirtyTile{ x, y, w, h, new u8[size], head.load(std::memory_order_relaxed) };
+    memcpy(tile->pixels, pixels, size);
+    while(!head.compare_exchange_weak(tile->next, tile, std::memory_order_release, std::memory_order_relaxed));
+}
 
-    numJobs = chunkSizeX * chunkSizeY;
-    this->jobFunc = jobFunc;
+DirtyTile* DirtyTileList::takeAll()
+{
+    return head.exchange(nullptr, std::memory_order_acquire);
+}
 
-    this->threadsDone = new std::atomic<bool>[MAX_THREAD_CONCURRENCY];
-    this->done = finish;
+void DirtyTileList::Free(DirtyTile* list)
+{
+    while(list)
+    {
+        DirtyTile* next = list->next;
+        delete[] list->pixels;
+        delete list;
+        list = next;
+    }
+}
 
-    for(i32 i = 0; i < (i32)chunkSizeX; i++)
+#define ADAPTIVE_MIN_LUMINANCE 0.01f // Darker pixels are judged against this, their relative error would never get small
+
+internal POSSIBLE_INLINE f32 Luminance(const Vector3& c)
+{
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+// Blue for few samples, green halfway, red at the per pixel cap
+internal Vector3 HeatColor(f32 t)
+{
+    t = std::min(std::max(t, 0.0f), 1.0f);
+    return Vector3(t, 1.0f - fabsf(2.0f * t - 1.0f), 1.0f - t);
+}
+
+// Standard error of the pixel's mean luminance (returned in mean), needs two passes over the pixel.
+// The per sample variance comes from the spread of the pass means.
+internal f32 PixelError(const AdaptiveState* a, const Vector3* accum, size_t p, f32* mean)
+{
+    const u32 n = a->samples[p];
+    *mean = Luminance(accum[p]) / n;
+    const f32 variance = std::max(a->lumSq[p] - *mean * *mean * n, 0.0f) / (a->batches[p] - 1);
+    return sqrtf(variance / n);
+}
+
+Vector3 AccumulatePixel(JobContext* ctx, i32 i, i32 j, const Vector3& sum)
+{
+    if(ctx->accum == nullptr)
+        return sum * (1.0f / ctx->spp);
+
+    const size_t p = (size_t)j * ctx->img->w + i;
+    Vector3& total = ctx->accum[p];
+    total = total + sum;
+    if(ctx->adaptive == nullptr)
+        return total * (1.0f / (ctx->sppBefore + ctx->spp));
+
+    AdaptiveState* a = ctx->adaptive;
+    const f32 passMean = Luminance(sum) / ctx->spp;
+    a->samples[p] += ctx->spp;
+    a->batches[p]++;
+    a->lumSq[p] += ctx->spp * passMean * passMean;
+    return ResolvePixel(ctx, i, j);
+}
+
+bool PixelActive(const JobContext* ctx, i32 i, i32 j)
+{
+    const AdaptiveState* a = ctx->adaptive;
+    if(a == nullptr || !a->settings.enabled)
+        return true;
+
+    const size_t p = (size_t)j * ctx->img->w + i;
+    const u32 n = a->samples[p];
+    if(n >= a->maxSamples)
+        return false;
+    if(n < a->settings.minSamples || a->batches[p] < 2)
+        return true;
+
+    f32 mean;
+    const f32 error = PixelError(a, ctx->accum, p, &mean);
+    return error > a->settings.threshold * std::max(mean, ADAPTIVE_MIN_LUMINANCE);
+}
+
+Vector3 ResolvePixel(const JobContext* ctx, i32 i, i32 j)
+{
+    const size_t p = (size_t)j * ctx->img->w + i;
+    const AdaptiveState* a = ctx->adaptive;
+    if(a == nullptr)
+        return ctx->sppBefore > 0 ? ctx->accum[p] * (1.0f / ctx->sppBefore) : Vector3(0, 0, 0);
+
+    if(a->settings.enabled && a->settings.heatmap)
+        return HeatColor((f32)a->samples[p] / a->maxSamples);
+    return a->samples[p] > 0 ? ctx->accum[p] * (1.0f / a->samples[p]) : Vector3(0, 0, 0);
+}
+
+void PublishChunk(JobContext* ctx, const u8* pixels)
+{
+    // Render space rows grow up, the image is stored top down
+    i32 y = (i32)ctx->img->h - (ctx->jstart + ctx->jspan);
+    ctx->img->writeRegion(ctx->istart, y, ctx->ispan, ctx->jspan, pixels);
+    ctx->dirty->push(ctx->istart, y, ctx->ispan, ctx->jspan, pixels);
+}
+
+ThreadPool::ThreadPool(u32 threadCount)
+{
+    start(threadCount, WorkerPlacement::NONE);
+}
+
+ThreadPool::~ThreadPool()
+{
+    stop();
+}
+
+ThreadPool* ThreadPool::Get()
+{
+    static ThreadPool pool;
+    return &pool;
+}
+
+void ThreadPool::start(u32 threadCount, WorkerPlacement placement)
+{
+    if(threadCount == 0) threadCount = std::thread::hardware_concurrency();
+    if(threadCount == 0) threadCount = 1;
+
+    // More workers than processors wrap around the placement order
+    std::vector<const LogicalCPU*> order = CPUTopology::Get().placementOrder(placement);
+    currentPlacement = placement;
+
+    quit = false;
+    workers.clear();
+    for(u32 i = 0; i < threadCount; i++)
     {
-        for(i32 j = 0; j < (i32)chunkSizeY; j++)
-        {
-            JobContext jc;
-            jc.cam = world->renderCamera;
-            jc.img = img;
-            jc.id = chunkSizeY * i + j;
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for(u32 i = 0; i < threadCount; i++)
+    {
+        const LogicalCPU* cpu = order.empty() ? nullptr : order[i % order.size()];
+        threads.emplace_back(&ThreadPool::workerLoop, this, i, cpu);
+    }
+}
 
-            jc.istart = istep * i;
-            jc.jstart = jstep * j;
+void ThreadPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMtx);
+        quit = true;
+    }
+    wake.notify_all();
+
+    for(auto& t : threads)
+    {
+        t.join();
+    }
+    threads.clear();
+}
+
+void ThreadPool::resize(u32 threadCount)
+{
+    resize(threadCount, currentPlacement);
+}
 
-            jc.ispan = istep;
-            jc.jspan = jstep;
-            jc.spp = spp;
+void ThreadPool::resize(u32 threadCount, WorkerPlacement placement)
+{
+    u32 count = threadCount > 0 ? threadCount : std::thread::hardware_concurrency();
+    if(count == size() && placement == currentPlacement)
+        return;
+
+    stop();
+    start(count, placement);
+}
+
+void ThreadPool::push(std::function<void()> task)
+{
+    u32 q = (CurrentPool == this) ? (u32)CurrentWorker : nextQueue.fetch_add(1) % (u32)workers.size();
+    {
+        std::lock_guard<std::mutex> lock(workers[q]->mtx);
+        workers[q]->tasks.push_back(std::move(task));
+    }
+    pending.fetch_add(1);
+
+    // Taking the sleep lock orders this push with a worker that is about to wait
+    {
+        std::lock_guard<std::mutex> lock(sleepMtx);
+    }
+    wake.notify_one();
+}
 
-            jc.numJobs = numJobs;
-            jc.world = world;
+bool ThreadPool::pop(i32 self, std::function<void()>* task)
+{
+    const u32 n = (u32)workers.size();
 
-            jc.globalDonePct = gDonePct;
-            jc.globalDoneMtx = gDoneMtx;
+    // Own deque first, newest task (its data is likely still in cache)
+    if(self >= 0)
+    {
+        Worker* w = workers[self].get();
+        std::lock_guard<std::mutex> lock(w->mtx);
+        if(!w->tasks.empty())
+        {
+            *task = std::move(w->tasks.back());
+            w->tasks.pop_back();
+            pending.fetch_sub(1);
+            return true;
+        }
+    }
 
-            jobs.push_back(jc);
+    // Steal the oldest task from the others (usually the largest remaining piece of work)
+    u32 first = self >= 0 ? (u32)self + 1 : nextQueue.load();
+    for(u32 k = 0; k < n; k++)
+    {
+        Worker* w = workers[(first + k) % n].get();
+        std::lock_guard<std::mutex> lock(w->mtx);
+        if(!w->tasks.empty())
+        {
+            *task = std::move(w->tasks.front());
+            w->tasks.pop_front();
+            pending.fetch_sub(1);
+            return true;
         }
     }
+    return false;
+}
 
-    if(numJobs < MAX_THREAD_CONCURRENCY)
+bool ThreadPool::runPending()
+{
+    std::function<void()> task;
+    if(pop(CurrentPool == this ? CurrentWorker : -1, &task))
     {
-        std::cerr << "warn: ThreadPool detected " << numJobs << " concurrent jobs, but your system has " << MAX_THREAD_CONCURRENCY << " threads.\n";
-        std::cerr << "      There will be " << MAX_THREAD_CONCURRENCY - numJobs << " idle threads.\n";
+        task();
+        return true;
     }
+    return false;
 }
 
-ThreadPool::~ThreadPool()
+void ThreadPool::workerLoop(u32 id, const LogicalCPU* cpu)
 {
-    fence();
-    delete this->threadsDone;
+    CurrentPool = this;
+    CurrentWorker = (i32)id;
+    if(cpu != nullptr)
+    {
+        if(!PinCurrentThread(*cpu))
+            std::cerr << "warn: Could not pin worker " << id << " to processor " << cpu->id << "." << std::endl;
+    }
+
+    std::function<void()> task;
+    while(true)
+    {
+        if(pop((i32)id, &task))
+        {
+            task();
+            task = nullptr;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMtx);
+        wake.wait(lock, [this]() { return quit || pending.load() > 0; });
+        if(quit && pending.load() == 0)
+            break;
+    }
+
+    CurrentPool = nullptr;
+    CurrentWorker = -1;
 }
 
-internal bool AllDone(const std::atomic<bool>* data, const u32 size)
+void ThreadPool::parallelFor(i64 begin, i64 end, i64 grain, const std::function<void(i64, i64)>& body)
 {
-    for(u32 i = 0; i < size; i++)
+    if(end <= begin)
+        return;
+    if(grain < 1) grain = 1;
+
+    const i64 chunks = (end - begin + grain - 1) / grain;
+    if(chunks == 1 || size() <= 1)
+    {
+        body(begin, end);
+        return;
+    }
+
+    // Helpers that only start after every range is claimed find nothing left and never touch body
+    struct Range
+    {
+        std::atomic<i64> next = 0;
+        std::atomic<i64> done = 0;
+    };
+    std::shared_ptr<Range> range = std::make_shared<Range>();
+    const std::function<void(i64, i64)>* bodyPtr = &body;
+    auto work = [range, bodyPtr, begin, end, grain, chunks]() {
+        i64 c;
+        while((c = range->next.fetch_add(1)) < chunks)
+        {
+            i64 b = begin + c * grain;
+            (*bodyPtr)(b, std::min(b + grain, end));
+            range->done.fetch_add(1);
+        }
+    };
+
+    i64 helpers = std::min(chunks - 1, (i64)size());
+    for(i64 h = 0; h < helpers; h++)
+    {
+        push(work);
+    }
+    work();
+
+    while(range->done.load() < chunks)
     {
-        if(!data[i].load())
-            return false;
+        if(!runPending())
+            std::this_thread::yield();
     }
-    return true;
 }
 
-internal void SetAllFalse(std::atomic<bool>* data, const u32 size)
+RenderJob::RenderJob(
+    u32 tileSize,
+    TileOrder order,
+    bool sortByCost,
+    Scene* world,
+    Image* img,
+    i32 spp,
+    i32 passSpp,
+    void (*jobFunc)(JobContext* ctx),
+    std::atomic<bool>* finish,
+    i32 packetSize,
+    AdaptiveSettings adaptive,
+    SamplerType sampler,
+    RenderBudget budget
+) : scheduler(img->w, img->h, tileSize, order)
 {
-    for(u32 i = 0; i < size; i++)
+    this->sortByCost = sortByCost;
+    this->jobFunc = jobFunc;
+    this->done = finish;
+    this->totalSpp = spp;
+    this->passSpp = (passSpp > 0 && passSpp < spp) ? passSpp : spp;
+    this->adaptive.settings = adaptive;
+    this->budget = budget;
+
+    // Adaptive renders need passes to measure the noise, a quarter of the minimum unless progressive already set one.
+    // Budgeted ones need them to stop in time.
+    if(adaptive.enabled && this->passSpp == spp)
+        this->passSpp = (i32)std::max(adaptive.minSamples / 4, 1u);
+    else if((budget.seconds > 0.0 || budget.targetError > 0.0f) && this->passSpp == spp)
+        this->passSpp = std::min(BUDGET_PASS_SAMPLES, spp);
+
+    base.cam = world->renderCamera;
+    base.img = img;
+    base.id = 0;
+    base.numJobs = scheduler.tileCount();
+    base.istart = base.jstart = 0;
+    base.ispan = base.jspan = 0;
+    base.spp = this->passSpp;
+    base.sppBefore = 0;
+    base.frame = 0;
+    base.sampler = Sampler::Get(sampler);
+    base.sampleCount = (u32)spp;
+    base.accum = nullptr;
+    base.adaptive = nullptr;
+    base.packetSize = packetSize;
+    base.world = world;
+    base.tileBuffer = nullptr;
+    base.dirty = &dirty;
+    base.progress = nullptr;
+    base.cancel = &cancelled;
+}
+
+RenderJob::~RenderJob()
+{
+    cancel();
+    fence();
+}
+
+void RenderJob::run(ThreadPool* pool)
+{
+    this->pool = pool;
+    startTime = std::chrono::steady_clock::now(); // The time budget covers the cost pre-pass too
+    finished = std::make_shared<std::promise<void>>();
+    finishedFuture = finished->get_future();
+
+    if(sortByCost)
+    {
+        scheduler.measureCosts(base.world, base.cam, 16, pool);
+    }
+
+    // Start the display from a cleared image, tiles then come in as they finish
+    base.img->setAll(Vector3(0, 0, 0));
+    dirty.push(0, 0, (i32)base.img->w, (i32)base.img->h, base.img->data);
+
+    const size_t pixels = (size_t)base.img->w * base.img->h;
+    const bool budgeted = budget.seconds > 0.0 || budget.targetError > 0.0f;
+    if(passSpp < totalSpp || adaptive.settings.enabled || budgeted)
     {
-        data[i].store(false);
+        accum = std::make_unique<Vector3[]>(pixels);
+        base.accum = accum.get();
     }
+
+    if(adaptive.settings.enabled || budgeted)
+    {
+        adaptiveSamples = std::make_unique<u32[]>(pixels);
+        adaptiveBatches = std::make_unique<u32[]>(pixels);
+        adaptiveLumSq = std::make_unique<f32[]>(pixels);
+        adaptive.samples = adaptiveSamples.get();
+        adaptive.batches = adaptiveBatches.get();
+        adaptive.lumSq = adaptiveLumSq.get();
+        adaptive.maxSamples = adaptive.settings.enabled ? (u32)totalSpp * ADAPTIVE_MAX_SAMPLE_SCALE : (u32)totalSpp;
+        base.adaptive = &adaptive;
+    }
+
+    const u32 workers = pool->size();
+    counters = std::make_unique<ProgressCounter[]>(workers);
+    counterCount = workers;
+    scheduler.setWorkers(workers);
+    startPass();
 }
 
-internal void CheckIfAllDone(std::atomic<bool>* data, const u32 size, std::atomic<bool>* done)
+void RenderJob::startPass()
 {
-    if(AllDone(data, size))
+    const u32 workers = counterCount;
+    passStartTime = std::chrono::steady_clock::now();
+    remaining.store(workers);
+    for(u32 w = 0; w < workers; w++)
     {
-        SetAllFalse(data, size);
-        done->store(false); // NOTE: This is false (rtRender == Means not rendering anymore 'Change misleading name')
+        pool->submit([this, w]() { workerPass(w); });
     }
 }
 
-void ThreadPool::run()
+void RenderJob::workerPass(u32 w)
 {
-    if(numJobs <= MAX_THREAD_CONCURRENCY)
+    std::vector<u8> tileBuffer;
+    JobContext ctx = base;
+    ctx.tileBuffer = &tileBuffer;
+    ctx.progress = &counters[w].value;
+    Tile tile;
+    while(!cancelled.load(std::memory_order_relaxed) && scheduler.next(&tile))
+    {
+        ctx.id = nextId.fetch_add(1);
+        ctx.istart = tile.x;
+        ctx.jstart = tile.y;
+        ctx.ispan = tile.w;
+        ctx.jspan = tile.h;
+        jobFunc(&ctx);
+    }
+    Random::ClearSampler(); // The pool thread may run something else next
+
+    if(remaining.fetch_sub(1) != 1)
+        return;
+
+    // Last one out of the pass, every tile of it is published
+    lastPassSeconds = std::chrono::duration<f64>(std::chrono::steady_clock::now() - passStartTime).count();
+    if(!cancelled.load() && base.adaptive != nullptr)
+        errorEstimate.store(measureError());
+
+    if(!cancelled.load() && adaptive.settings.enabled)
     {
-        for(auto& job : jobs)
-            threads.push_back(new std::thread([&](){ 
-                jobFunc(&job, &image_mtx);
-                threadsDone[job.id].store(true); 
-                CheckIfAllDone(threadsDone, numJobs, done);
-            }));
+        // Go on while some pixel still took samples and the budget is not spent
+        const u64 taken = samplesTaken();
+        const u64 pixels = (u64)base.img->w * base.img->h;
+        completedSpp.store((i32)((taken + pixels / 2) / pixels));
+        if(taken > samplesAtPassStart && taken < pixels * totalSpp && budgetAllowsPass())
+        {
+            samplesAtPassStart = taken;
+            base.sppBefore += base.spp;
+            scheduler.reset();
+            startPass();
+            return;
+        }
     }
-    else
+    else if(!cancelled.load())
     {
-        std::reverse(jobs.begin(), jobs.end());
-        for(i32 i = 0; i < (i32)MAX_THREAD_CONCURRENCY; i++)
+        base.sppBefore += base.spp;
+        completedSpp.store(base.sppBefore);
+        if(base.sppBefore < totalSpp && budgetAllowsPass())
         {
-            auto f = [&](std::vector<JobContext>* jobsptr, 
-                        std::mutex* local_mtx, 
-                        std::atomic<bool>* local_run,
-                        std::mutex* image_local_mtx,
-                        i32 threadID,
-                        void (*local_jobFunc)(JobContext* ctx, std::mutex* img_mtx)) -> void
-            {
-                while(local_run->load())
-                {
-                    std::unique_lock<std::mutex> lock(*local_mtx);
-                    if(jobsptr->size() == 0)
-                        break;
-
-                    JobContext ctx = jobsptr->back();
-                    jobsptr->pop_back();
-                    lock.unlock();
-                    local_jobFunc(&ctx, image_local_mtx);
-                }
-
-                threadsDone[threadID].store(true);
-                CheckIfAllDone(threadsDone, MAX_THREAD_CONCURRENCY, done);
-            };
-            threads.push_back(new std::thread(f, &jobs, &mtx, &running, &image_mtx, i, jobFunc));
+            base.spp = std::min(passSpp, totalSpp - base.sppBefore);
+            scheduler.reset();
+            startPass();
+            return;
         }
     }
+
+    // The job can be deleted as soon as the future is ready, keep the promise alive until set_value returns
+    std::shared_ptr<std::promise<void>> promise = finished;
+    done->store(false); // NOTE: This is false (rtRender == Means not rendering anymore 'Change misleading name')
+    promise->set_value();
+}
+
+u64 RenderJob::samplesTaken() const
+{
+    u64 taken = 0;
+    for(u32 w = 0; w < counterCount; w++)
+    {
+        taken += counters[w].value.load(std::memory_order_relaxed);
+    }
+    return taken;
 }
 
-void ThreadPool::fence() const
+// Summed standard error over summed luminance of the pixels with two passes or more (negative if there are
+// none yet). Weighing by brightness keeps a dark pixel seeing its first light hit from swinging the estimate.
+f32 RenderJob::measureError() const
 {
-    for(auto t : threads)
+    const size_t pixels = (size_t)base.img->w * base.img->h;
+    f64 errorSum = 0.0, meanSum = 0.0;
+    for(size_t p = 0; p < pixels; p++)
     {
-        t->join();
-        delete t;
+        if(adaptive.batches[p] < 2) continue;
+        f32 mean;
+        errorSum += PixelError(&adaptive, accum.get(), p, &mean);
+        meanSum += std::max(mean, ADAPTIVE_MIN_LUMINANCE);
     }
+    return meanSum > 0.0 ? (f32)(errorSum / meanSum) : -1.0f;
+}
+
+bool RenderJob::budgetAllowsPass() const
+{
+    const f32 error = errorEstimate.load();
+    if(budget.targetError > 0.0f && error >= 0.0f && error <= budget.targetError)
+        return false;
+
+    // Passes take about as long as the last one
+    const f64 elapsed = std::chrono::duration<f64>(std::chrono::steady_clock::now() - startTime).count();
+    return budget.seconds <= 0.0 || elapsed + lastPassSeconds <= budget.seconds;
+}
+
+f32 RenderJob::progress() const
+{
+    const f64 total = (f64)base.img->w * base.img->h * totalSpp;
+    f64 done = samplesTaken() / total;
+
+    // Budgeted renders usually stop well before the spp cap: go by the time spent, or by the noise,
+    // which falls with the square root of the samples
+    if(budget.seconds > 0.0 && pool != nullptr)
+        done = std::max(done, std::chrono::duration<f64>(std::chrono::steady_clock::now() - startTime).count() / budget.seconds);
+    const f32 error = errorEstimate.load();
+    if(budget.targetError > 0.0f && error > 0.0f)
+        done = std::max(done, (f64)(budget.targetError / error) * (budget.targetError / error));
+
+    return (f32)std::min(100.0 * done, 100.0); // Adaptive renders overshoot by up to a pass
+}
+
+void RenderJob::fence() const
+{
+    if(finishedFuture.valid())
+        finishedFuture.wait();
 }
@@ -1,12 +1,79 @@
 #pragma once
 #include <thread>
 #include <atomic>
+#include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
 #include <vector>
 #include "../common.h"
 #include "../image/image.h"
 #include "../renderer/camera.h"
 #include "../renderer/scene.h"
+#include "tile_scheduler.h"
+#include "topology.h"
+#include "../math/sampler.h"
+
+// A finished tile, in image rows (top down) like Image::data. It carries its own copy of the encoded
+// pixels: a progressive render writes the same image region again on the next pass, so the display
+// must never read the shared image while a render runs.
+struct DirtyTile
+{
+    i32 x, y;
+    i32 w, h;
+    u8* pixels; // w * h pixels in the image format, top row first
+    DirtyTile* next;
+};
+
+// Tiles published by the workers, taken all at once by the display thread. Lock free: pushes are a CAS
+// on the head and the consumer swaps the whole list out, so there is no ABA to worry about.
+class DirtyTileList
+{
+public:
+    ~DirtyTileList();
+
+    void push(i32 x, i32 y, i32 w, i32 h, const u8* pixels); // Copies the pixels
+    DirtyTile* takeAll(); // Newest first, release it with Free
+    static void Free(DirtyTile* list);
+
+private:
+    std::atomic<DirtyTile*> head = nullptr;
+};
+
+#define ADAPTIVE_MAX_SAMPLE_SCALE 8 // A noisy pixel can take up to this many times the average sample budget
+
+struct AdaptiveSettings
+{
+    bool enabled = false;
+    f32 threshold = 0.02f; // Relative standard error of the mean luminance a pixel stops at
+    u32 minSamples = 16;   // Before any pixel can stop, at least two passes
+    bool heatmap = false;  // Show the samples taken per pixel instead of the image
+};
+
+#define BUDGET_PASS_SAMPLES 4 // Pass size of budgeted renders when none was given, the budget is checked between passes
+
+// Budgeted renders keep adding passes until the time is spent or the estimated noise is low enough,
+// spp is then only a cap. A pass that would overrun the time budget (judging by the last one) is not started.
+struct RenderBudget
+{
+    f64 seconds = 0.0;      // Wall clock time for the whole render, 0 for no limit
+    f32 targetError = 0.0f; // Relative error of the image to stop at (RenderJob::estimatedError), 0 for no target
+};
+
+// Per pixel statistics of an adaptive or budgeted render (render space, j * w + i). The variance comes from the
+// spread of the pass means (batch means), so every integrator only has to hand over its per pass sums.
+// Budgeted renders that are not adaptive (settings.enabled false) keep them only to estimate the noise.
+struct AdaptiveState
+{
+    AdaptiveSettings settings;
+    u32 maxSamples;
+    u32* samples; // Samples taken
+    u32* batches; // Passes that sampled the pixel
+    f32* lumSq;   // Sum over those passes of spp * (pass mean luminance)^2
+};
 
 struct JobContext
 {
@@ -14,40 +81,201 @@ struct JobContext
     u32 numJobs;
     i32 istart, ispan;
     i32 jstart, jspan;
-    i32 spp;
+    i32 spp;         // Samples per pixel of this pass
+    i32 sppBefore;   // Samples the earlier passes already put in accum
+    u32 frame;       // Mixed into the per pixel seeds, the same frame renders the same image on any thread count
+    const Sampler* sampler; // Low discrepancy sequence behind Random::RandomF32, nullptr for plain PCG32
+    u32 sampleCount;        // Samples per pixel of the whole render, the strata are laid out for it
+    Vector3* accum;  // Progressive renders: sample sum per pixel (render space, j * w + i), nullptr otherwise
+    AdaptiveState* adaptive; // Adaptive renders only (they are always progressive)
+    i32 packetSize; // Primary rays traced together (1 traces single rays)
     Camera* cam;
     Image* img;
     Scene* world;
-    f32* globalDonePct;
-    std::mutex* globalDoneMtx;
+    std::vector<u8>* tileBuffer;     // Reused by every chunk of the worker, allocated (first touched) on its thread
+    DirtyTileList* dirty;
+    std::atomic<u64>* progress;      // Pixel samples finished by this worker (its own cache line)
+    const std::atomic<bool>* cancel; // Set when the render is stopped, polled inside the chunk loops
 };
 
+// Average so far of render pixel (i, j) given the sum of this pass' samples, adding them to ctx->accum when present.
+// Every pixel belongs to one chunk per pass, so the accumulation needs no lock.
+Vector3 AccumulatePixel(JobContext* ctx, i32 i, i32 j, const Vector3& sum);
+
+// False once an adaptive render has stopped sampling the pixel (converged or out of samples)
+bool PixelActive(const JobContext* ctx, i32 i, i32 j);
+
+// What an inactive pixel shows: its average, or its sample count in heatmap mode
+Vector3 ResolvePixel(const JobContext* ctx, i32 i, i32 j);
+
+// Copies a finished chunk (ispan x jspan pixels, encoded and top row first) to its own region of ctx->img
+// and queues it for the display. Chunks never overlap so no lock is needed.
+void PublishChunk(JobContext* ctx, const u8* pixels);
+
+// Long lived workers, each one with its own task deque. A worker pops its newest task first
+// and, when it runs dry, steals the oldest task of another worker. Workers can be pinned to
+// cores following the CPU topology, see WorkerPlacement.
 class ThreadPool
 {
 public:
-    ThreadPool(u32 chunkSizeX, u32 chunkSizeY, Scene* world, Image* img, i32 spp, void (*jobFunc)(JobContext* ctx, std::mutex* img_mtx), std::atomic<bool>* finish, f32* gDonePct, std::mutex* gDoneMtx);
+    explicit ThreadPool(u32 threadCount = 0); // 0 uses every hardware thread
     ~ThreadPool();
 
-    void run();
+    // The pool shared by rendering, BVH builds and scene loads
+    static ThreadPool* Get();
+
+    inline u32 size() const
+    {
+        return (u32)threads.size();
+    }
+
+    // Restarts the workers with a new count once the queued tasks are done (don't call it from a task)
+    void resize(u32 threadCount);
+    void resize(u32 threadCount, WorkerPlacement placement);
+
+    inline WorkerPlacement placement() const
+    {
+        return currentPlacement;
+    }
+
+    template<typename F>
+    auto submit(F&& f) -> std::future<decltype(f())>
+    {
+        typedef decltype(f()) R;
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+        std::future<R> result = task->get_future();
+        push([task]() { (*task)(); });
+        return result;
+    }
+
+    // Runs queued tasks on the calling thread until f is ready, so a task waiting on another never starves the pool
+    template<typename T>
+    T wait(std::future<T>& f)
+    {
+        while(f.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+            if(!runPending())
+                f.wait_for(std::chrono::microseconds(50));
+        }
+        return f.get();
+    }
+
+    // Calls body(b, e) over [begin, end) in ranges of grain items, the calling thread takes part too
+    void parallelFor(i64 begin, i64 end, i64 grain, const std::function<void(i64, i64)>& body);
+
+private:
+    struct Worker
+    {
+        std::deque<std::function<void()>> tasks;
+        std::mutex mtx;
+    };
+
+    void start(u32 threadCount, WorkerPlacement placement);
+    void stop();
+    void push(std::function<void()> task);
+    bool pop(i32 self, std::function<void()>* task);
+    bool runPending();
+    void workerLoop(u32 id, const LogicalCPU* cpu);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::mutex sleepMtx;
+    std::condition_variable wake;
+    std::atomic<u32> pending = 0;   // Tasks queued but not started
+    std::atomic<u32> nextQueue = 0; // Round robin target for tasks pushed from outside the pool
+    bool quit = false;
+    WorkerPlacement currentPlacement = WorkerPlacement::NONE;
+};
+
+// One per worker so the progress updates never share a cache line
+struct alignas(64) ProgressCounter
+{
+    std::atomic<u64> value = 0;
+};
+
+// One render: a few tasks on the shared pool pulling tiles from a TileScheduler until it runs dry.
+// A progressive render (passSpp < spp) sweeps the whole image once per pass of passSpp samples, the
+// last task out of a pass starts the next one. The image always holds the average of the passes done.
+// An adaptive render keeps doing passes over the pixels that are still noisy until the spp * pixels
+// budget is spent or every pixel has converged. A budgeted render stops on time or noise, see RenderBudget.
+class RenderJob
+{
+public:
+    RenderJob(u32 tileSize, TileOrder order, bool sortByCost, Scene* world, Image* img, i32 spp, i32 passSpp, void (*jobFunc)(JobContext* ctx), std::atomic<bool>* finish, i32 packetSize = 1, AdaptiveSettings adaptive = {}, SamplerType sampler = SamplerType::UNIFORM, RenderBudget budget = {});
+    ~RenderJob();
+
+    void run(ThreadPool* pool);
     void fence() const;
 
-    inline std::mutex* getImage_mtx()
+    // Workers stop within a pixel, packet sample or bounce and drop their tile, fence() to wait for them
+    inline void cancel()
     {
-        return &image_mtx;
+        cancelled.store(true);
+    }
+
+    inline bool isCancelled() const
+    {
+        return cancelled.load();
+    }
+
+    // Percent of the pixel samples done, lock free (sums the per worker counters)
+    f32 progress() const;
+
+    // Samples per pixel of the passes finished so far (the average for adaptive renders)
+    inline i32 samplesDone() const
+    {
+        return completedSpp.load();
+    }
+
+    // Standard error of the pixel luminances after the last pass, summed and taken relative to their sum. Negative
+    // until two passes are done or when the render keeps no per pixel statistics (only adaptive and budgeted ones do).
+    inline f32 estimatedError() const
+    {
+        return errorEstimate.load();
+    }
+
+    // Pixel samples over all the workers so far, each one a camera path
+    u64 samplesTaken() const;
+
+    // Tiles finished since the last call, newest first. Later passes may publish the same region again,
+    // so apply them oldest first and only ever read their own pixels.
+    inline DirtyTile* takeDirtyTiles()
+    {
+        return dirty.takeAll();
     }
 
 private:
-    u32 chunkSizeX = 1;
-    u32 chunkSizeY = 1;
-    u32 istep;
-    u32 jstep;
-    u32 numJobs;
-    std::vector<JobContext> jobs;
-    std::vector<std::thread*> threads;
-    std::mutex mtx;
-    std::mutex image_mtx;
-    std::atomic<bool> running = true;
+    void startPass();
+    void workerPass(u32 w);
+    f32 measureError() const;
+    bool budgetAllowsPass() const;
+
+    TileScheduler scheduler;
+    bool sortByCost;
+    JobContext base; // Everything but the tile
+    ThreadPool* pool = nullptr;
+    i32 totalSpp;
+    i32 passSpp;
+    std::unique_ptr<Vector3[]> accum;
+    AdaptiveState adaptive;
+    std::unique_ptr<u32[]> adaptiveSamples;
+    std::unique_ptr<u32[]> adaptiveBatches;
+    std::unique_ptr<f32[]> adaptiveLumSq;
+    u64 samplesAtPassStart = 0;
+    RenderBudget budget;
+    std::chrono::steady_clock::time_point startTime;
+    std::chrono::steady_clock::time_point passStartTime;
+    f64 lastPassSeconds = 0.0;
+    std::atomic<f32> errorEstimate = -1.0f;
+    std::atomic<i32> completedSpp = 0;
+    std::shared_ptr<std::promise<void>> finished; // Set by the last task of the last pass
+    std::future<void> finishedFuture;
+    DirtyTileList dirty;
+    std::unique_ptr<ProgressCounter[]> counters;
+    u32 counterCount = 0;
+    std::atomic<bool> cancelled = false;
+    std::atomic<u32> remaining = 0; // Tasks still in the current pass
+    std::atomic<u32> nextId = 0;
     std::atomic<bool>* done;
-    std::atomic<bool>* threadsDone;
-    void (*jobFunc)(JobContext* ctx, std::mutex* img_mtx);
-};
\ No newline at end of file
+    void (*jobFunc)(JobContext* ctx);
+};
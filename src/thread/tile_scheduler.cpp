@@ -0,0 +1,171 @@
+#include "tile_scheduler.h"
+#include "threadpool.h"
+#include "../renderer/raycaster/caster.h"
+#include "../math/random.h"
+
+#include <algorithm>
+#include <chrono>
+
+#define TILE_MIN_SPLIT_SIZE 8 // Tiles are not split below this many pixels per side
+
+// Position of (x, y) along the Hilbert curve filling an n x n grid (n a power of two)
+internal u32 HilbertIndex(u32 n, u32 x, u32 y)
+{
+    u32 d = 0;
+    for(u32 s = n / 2; s > 0; s /= 2)
+    {
+        u32 rx = (x & s) > 0;
+        u32 ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        if(ry == 0)
+        {
+            if(rx == 1)
+            {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+TileScheduler::TileScheduler(u32 imageW, u32 imageH, u32 tileSize, TileOrder order)
+{
+    this->imageW = imageW;
+    this->imageH = imageH;
+    if(tileSize < TILE_MIN_SPLIT_SIZE) tileSize = TILE_MIN_SPLIT_SIZE;
+
+    const u32 tx = (imageW + tileSize - 1) / tileSize;
+    const u32 ty = (imageH + tileSize - 1) / tileSize;
+
+    struct Keyed
+    {
+        f32 key0;
+        f32 key1;
+        Tile tile;
+    };
+    std::vector<Keyed> tiles;
+    tiles.reserve(tx * ty);
+
+    u32 n = 1;
+    while(n < tx || n < ty) n *= 2;
+
+    for(u32 j = 0; j < ty; j++)
+    {
+        for(u32 i = 0; i < tx; i++)
+        {
+            Keyed k;
+            k.tile.x = (i32)(i * tileSize);
+            k.tile.y = (i32)(j * tileSize);
+            k.tile.w = (i32)std::min(tileSize, imageW - i * tileSize);
+            k.tile.h = (i32)std::min(tileSize, imageH - j * tileSize);
+            k.tile.cost = 0.0f;
+
+            switch(order)
+            {
+                case TileOrder::SCANLINE:
+                {
+                    // Top row first (render space rows grow up)
+                    k.key0 = (f32)(ty - 1 - j);
+                    k.key1 = (f32)i;
+                } break;
+                case TileOrder::SPIRAL:
+                {
+                    // Ring around the center first, then the angle inside the ring
+                    f32 dx = (i + 0.5f) - tx * 0.5f;
+                    f32 dy = (j + 0.5f) - ty * 0.5f;
+                    k.key0 = std::max(fabsf(dx), fabsf(dy));
+                    k.key1 = atan2f(dy, dx);
+                } break;
+                case TileOrder::HILBERT:
+                {
+                    k.key0 = (f32)HilbertIndex(n, i, j);
+                    k.key1 = 0.0f;
+                } break;
+            }
+            tiles.push_back(k);
+        }
+    }
+
+    std::stable_sort(tiles.begin(), tiles.end(), [](const Keyed& a, const Keyed& b) {
+        if(a.key0 != b.key0) return a.key0 < b.key0;
+        return a.key1 < b.key1;
+    });
+
+    for(const Keyed& k : tiles)
+    {
+        ordered.push_back(k.tile);
+    }
+    queue.assign(ordered.begin(), ordered.end());
+    initialCount = (u32)ordered.size();
+}
+
+void TileScheduler::measureCosts(Scene* world, Camera* cam, u32 pathsPerTile, ThreadPool* pool)
+{
+    std::vector<Tile> tiles = ordered;
+
+    pool->parallelFor(0, (i64)tiles.size(), 1, [&](i64 begin, i64 end) {
+        for(i64 t = begin; t < end; t++)
+        {
+            Tile& tile = tiles[t];
+            auto start = std::chrono::steady_clock::now();
+            for(u32 k = 0; k < pathsPerTile; k++)
+            {
+                f32 u = (tile.x + Random::RandomF32() * tile.w) / imageW;
+                f32 v = (tile.y + Random::RandomF32() * tile.h) / imageH;
+                Ray r = cam->shootRay(u, v);
+                RayCast(&r, world, 8);
+            }
+            tile.cost = std::chrono::duration<f32, std::micro>(std::chrono::steady_clock::now() - start).count();
+        }
+    });
+
+    std::stable_sort(tiles.begin(), tiles.end(), [](const Tile& a, const Tile& b) {
+        return a.cost > b.cost;
+    });
+
+    std::lock_guard<std::mutex> lock(mtx);
+    ordered = tiles;
+    queue.assign(ordered.begin(), ordered.end());
+}
+
+bool TileScheduler::next(Tile* tile)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    if(queue.empty())
+        return false;
+
+    Tile t = queue.front();
+    queue.pop_front();
+
+    // Not enough work left for everyone, halve the tile along its longer side until there is
+    while(queue.size() + 1 < workers && std::max(t.w, t.h) >= 2 * TILE_MIN_SPLIT_SIZE)
+    {
+        Tile rest = t;
+        if(t.w >= t.h)
+        {
+            t.w /= 2;
+            rest.x += t.w;
+            rest.w -= t.w;
+        }
+        else
+        {
+            t.h /= 2;
+            rest.y += t.h;
+            rest.h -= t.h;
+        }
+        t.cost *= 0.5f;
+        rest.cost = t.cost;
+        queue.push_front(rest);
+    }
+
+    *tile = t;
+    return true;
+}
+
+void TileScheduler::reset()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    queue.assign(ordered.begin(), ordered.end());
+}
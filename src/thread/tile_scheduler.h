@@ -0,0 +1,70 @@
+#pragma once
+#include <mutex>
+#include <deque>
+#include <vector>
+#include "../common.h"
+
+struct Scene;
+struct Camera;
+class ThreadPool;
+
+enum class TileOrder
+{
+    SCANLINE, // Row by row from the top left
+    SPIRAL,   // Rings around the image center, the subject usually sits there
+    HILBERT   // Hilbert curve over the tile grid, consecutive tiles stay neighbours
+};
+
+POSSIBLE_INLINE const char* TileOrderName(TileOrder order)
+{
+    switch(order)
+    {
+        case TileOrder::SCANLINE: return "Scanline";
+        case TileOrder::SPIRAL:   return "Spiral";
+        case TileOrder::HILBERT:  return "Hilbert";
+    }
+    return "Unknown";
+}
+
+struct Tile
+{
+    i32 x, y; // Top left pixel (render space, j grows up like in calculateChunk)
+    i32 w, h;
+    f32 cost; // Measured by the pre-pass, 0 otherwise
+};
+
+// Hands out the tiles of one render. The whole image is covered, edge tiles are just smaller.
+// When fewer tiles than workers are left, the next one is split in two so the tail stays busy.
+class TileScheduler
+{
+public:
+    TileScheduler(u32 imageW, u32 imageH, u32 tileSize, TileOrder order);
+
+    // Traces a few primary paths per tile and sorts the tiles longest first (stable, so ties keep the order)
+    void measureCosts(Scene* world, Camera* cam, u32 pathsPerTile, ThreadPool* pool);
+
+    // Next tile to render, false once the queue is empty. Safe to call from every worker.
+    bool next(Tile* tile);
+
+    // Queues every tile again in the same order, for the next pass of a progressive render
+    void reset();
+
+    inline void setWorkers(u32 count)
+    {
+        workers = count;
+    }
+
+    inline u32 tileCount() const
+    {
+        return initialCount;
+    }
+
+private:
+    std::deque<Tile> queue;
+    std::vector<Tile> ordered; // Unsplit tiles in render order, what reset() starts from
+    std::mutex mtx;
+    u32 imageW;
+    u32 imageH;
+    u32 workers = 1;
+    u32 initialCount = 0;
+};
@@ -0,0 +1,285 @@
+#include "topology.h"
+
+#include <algorithm>
+#include <map>
+#include <thread>
+
+#ifdef _WIN32
+#include <Windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <fstream>
+#include <string>
+#endif
+
+// Turns sparse ids (socket 0 and 2, node 1 and 3...) into 0..n-1 in first seen order
+internal u32 DenseIndex(std::map<u64, u32>* ids, u64 id)
+{
+    auto it = ids->find(id);
+    if(it != ids->end())
+        return it->second;
+    u32 index = (u32)ids->size();
+    ids->emplace(id, index);
+    return index;
+}
+
+// Ranks the siblings of each core by processor number and fills the counts
+internal void FinishTopology(CPUTopology* topo)
+{
+    std::sort(topo->cpus.begin(), topo->cpus.end(), [](const LogicalCPU& a, const LogicalCPU& b) {
+        return a.id < b.id;
+    });
+
+    std::map<u32, u32> siblings;
+    topo->coreCount = topo->packageCount = topo->nodeCount = 0;
+    for(LogicalCPU& cpu : topo->cpus)
+    {
+        cpu.smt = siblings[cpu.core]++;
+        topo->coreCount = std::max(topo->coreCount, cpu.core + 1);
+        topo->packageCount = std::max(topo->packageCount, cpu.package + 1);
+        topo->nodeCount = std::max(topo->nodeCount, cpu.node + 1);
+    }
+}
+
+internal void FlatTopology(CPUTopology* topo)
+{
+    u32 count = std::max(std::thread::hardware_concurrency(), 1u);
+    topo->cpus.clear();
+    for(u32 i = 0; i < count; i++)
+    {
+        topo->cpus.push_back(LogicalCPU{ i, i, 0, 0, 0 });
+    }
+}
+
+#ifdef _WIN32
+internal bool DetectTopology(CPUTopology* topo)
+{
+    DWORD size = 0;
+    GetLogicalProcessorInformationEx(RelationAll, nullptr, &size);
+    if(size == 0)
+        return false;
+
+    std::vector<u8> buffer(size);
+    auto info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)buffer.data();
+    if(!GetLogicalProcessorInformationEx(RelationAll, info, &size))
+        return false;
+
+    // Processor number -> core, package and node. Every relation lists the processors it covers as group masks.
+    std::map<u64, LogicalCPU> found;
+    u32 cores = 0, packages = 0, nodes = 0;
+    for(DWORD offset = 0; offset < size;)
+    {
+        auto rel = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)(buffer.data() + offset);
+        offset += rel->Size;
+
+        const GROUP_AFFINITY* masks = nullptr;
+        WORD maskCount = 0;
+        u32 index = 0;
+        switch(rel->Relationship)
+        {
+            case RelationProcessorCore:
+            {
+                masks = rel->Processor.GroupMask;
+                maskCount = rel->Processor.GroupCount;
+                index = cores++;
+            } break;
+            case RelationProcessorPackage:
+            {
+                masks = rel->Processor.GroupMask;
+                maskCount = rel->Processor.GroupCount;
+                index = packages++;
+            } break;
+            case RelationNumaNode:
+            {
+                masks = &rel->NumaNode.GroupMask;
+                maskCount = 1;
+                index = nodes++;
+            } break;
+            default: continue;
+        }
+
+        for(WORD g = 0; g < maskCount; g++)
+        {
+            for(u32 bit = 0; bit < 64; bit++)
+            {
+                if((masks[g].Mask & ((KAFFINITY)1 << bit)) == 0) continue;
+
+                u64 id = (u64)masks[g].Group * 64 + bit;
+                LogicalCPU& cpu = found.emplace(id, LogicalCPU{ (u32)id, 0, 0, 0, 0 }).first->second;
+                if(rel->Relationship == RelationProcessorCore) cpu.core = index;
+                else if(rel->Relationship == RelationProcessorPackage) cpu.package = index;
+                else cpu.node = index;
+            }
+        }
+    }
+
+    if(cores == 0)
+        return false;
+    for(auto& f : found)
+    {
+        topo->cpus.push_back(f.second);
+    }
+    return true;
+}
+
+bool PinCurrentThread(const LogicalCPU& cpu)
+{
+    GROUP_AFFINITY affinity = {};
+    affinity.Group = (WORD)(cpu.id / 64);
+    affinity.Mask = (KAFFINITY)1 << (cpu.id % 64);
+    return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+}
+#elif defined(__linux__)
+internal bool ReadSysValue(const std::string& path, u64* value)
+{
+    std::ifstream file(path);
+    return (bool)(file >> *value);
+}
+
+// Parses the kernel cpulist format, "0-3,8,10-11"
+internal std::vector<u32> ReadCPUList(const std::string& path)
+{
+    std::vector<u32> list;
+    std::ifstream file(path);
+    std::string text;
+    if(!std::getline(file, text))
+        return list;
+
+    size_t pos = 0;
+    while(pos < text.size())
+    {
+        size_t end = text.find(',', pos);
+        if(end == std::string::npos) end = text.size();
+        std::string range = text.substr(pos, end - pos);
+        pos = end + 1;
+        if(range.empty()) continue;
+
+        size_t dash = range.find('-');
+        u32 first = (u32)std::stoul(range.substr(0, dash));
+        u32 last = dash == std::string::npos ? first : (u32)std::stoul(range.substr(dash + 1));
+        for(u32 c = first; c <= last; c++)
+        {
+            list.push_back(c);
+        }
+    }
+    return list;
+}
+
+internal bool DetectTopology(CPUTopology* topo)
+{
+    const std::string root = "/sys/devices/system/cpu/";
+    std::vector<u32> online = ReadCPUList(root + "online");
+    if(online.empty())
+        return false;
+
+    // Leave out the processors the process is not allowed on (taskset, cgroups)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    // Node of each processor, the node directories are missing on kernels without NUMA
+    std::map<u32, u64> cpuNode;
+    for(u32 n : ReadCPUList("/sys/devices/system/node/online"))
+    {
+        std::vector<u32> cpus = ReadCPUList("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+        for(u32 c : cpus)
+        {
+            cpuNode[c] = n;
+        }
+    }
+
+    std::map<u64, u32> cores, packages, nodes;
+    for(u32 c : online)
+    {
+        if(haveMask && c < CPU_SETSIZE && !CPU_ISSET(c, &allowed)) continue;
+
+        std::string dir = root + "cpu" + std::to_string(c) + "/topology/";
+        u64 core = c, package = 0;
+        ReadSysValue(dir + "physical_package_id", &package);
+        ReadSysValue(dir + "core_id", &core); // Only unique inside its package
+
+        LogicalCPU cpu;
+        cpu.id = c;
+        cpu.package = DenseIndex(&packages, package);
+        cpu.core = DenseIndex(&cores, (package << 32) | core);
+        cpu.node = DenseIndex(&nodes, cpuNode.count(c) ? cpuNode[c] : 0);
+        cpu.smt = 0;
+        topo->cpus.push_back(cpu);
+    }
+    return !topo->cpus.empty();
+}
+
+bool PinCurrentThread(const LogicalCPU& cpu)
+{
+    if(cpu.id >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu.id, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+#else
+internal bool DetectTopology(CPUTopology* topo)
+{
+    return false;
+}
+
+bool PinCurrentThread(const LogicalCPU& cpu)
+{
+    return false;
+}
+#endif
+
+const CPUTopology& CPUTopology::Get()
+{
+    static CPUTopology topo = []() {
+        CPUTopology t;
+        if(!DetectTopology(&t))
+        {
+            std::cerr << "warn: CPU topology not available, every processor is taken as its own core on one node." << std::endl;
+            FlatTopology(&t);
+        }
+        FinishTopology(&t);
+        return t;
+    }();
+    return topo;
+}
+
+std::vector<const LogicalCPU*> CPUTopology::placementOrder(WorkerPlacement placement) const
+{
+    std::vector<const LogicalCPU*> order;
+    if(placement == WorkerPlacement::NONE)
+        return order;
+
+    for(const LogicalCPU& cpu : cpus)
+    {
+        order.push_back(&cpu);
+    }
+
+    // Rank of each core inside its package, so SPREAD can alternate sockets core by core
+    std::vector<u32> coreRank(coreCount, 0);
+    std::vector<u32> perPackage(packageCount, 0);
+    for(const LogicalCPU& cpu : cpus)
+    {
+        if(cpu.smt == 0) coreRank[cpu.core] = perPackage[cpu.package]++;
+    }
+
+    if(placement == WorkerPlacement::SPREAD)
+    {
+        std::stable_sort(order.begin(), order.end(), [&](const LogicalCPU* a, const LogicalCPU* b) {
+            if(a->smt != b->smt) return a->smt < b->smt;
+            if(coreRank[a->core] != coreRank[b->core]) return coreRank[a->core] < coreRank[b->core];
+            return a->package < b->package;
+        });
+    }
+    else
+    {
+        std::stable_sort(order.begin(), order.end(), [&](const LogicalCPU* a, const LogicalCPU* b) {
+            if(a->package != b->package) return a->package < b->package;
+            if(a->smt != b->smt) return a->smt < b->smt;
+            return coreRank[a->core] < coreRank[b->core];
+        });
+    }
+    return order;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <vector>
+#include "../common.h"
+
+// Where the ThreadPool workers are pinned
+enum class WorkerPlacement
+{
+    NONE,    // Threads float, the OS schedules them
+    SPREAD,  // One worker per physical core alternating sockets, SMT siblings only once every core has one
+    COMPACT  // Fill a socket (cores, then their siblings) before moving to the next one
+};
+
+POSSIBLE_INLINE const char* WorkerPlacementName(WorkerPlacement placement)
+{
+    switch(placement)
+    {
+        case WorkerPlacement::NONE:    return "None";
+        case WorkerPlacement::SPREAD:  return "Spread";
+        case WorkerPlacement::COMPACT: return "Compact";
+    }
+    return "Unknown";
+}
+
+struct LogicalCPU
+{
+    u32 id;      // OS processor number (group * 64 + index on Windows)
+    u32 core;    // Dense physical core index, shared by SMT siblings
+    u32 package; // Dense socket index
+    u32 node;    // Dense NUMA node index
+    u32 smt;     // Rank among the siblings of its core (0 for the first hardware thread)
+};
+
+// Processors this process may run on. Detected once from /sys on Linux and
+// GetLogicalProcessorInformationEx on Windows, anything else is seen as one socket of single thread cores.
+struct CPUTopology
+{
+    std::vector<LogicalCPU> cpus;
+    u32 coreCount = 0;
+    u32 packageCount = 0;
+    u32 nodeCount = 0;
+
+    static const CPUTopology& Get();
+
+    // Logical CPUs in the order workers take them for the given placement (empty for NONE)
+    std::vector<const LogicalCPU*> placementOrder(WorkerPlacement placement) const;
+};
+
+// Pins the calling thread to one logical CPU, false if the OS refused (the thread keeps floating)
+bool PinCurrentThread(const LogicalCPU& cpu);
@@ -0,0 +1,89 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+
+MappedFile* MappedFile::Open(const std::string& filename)
+{
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file == INVALID_HANDLE_VALUE) return nullptr;
+
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return nullptr;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if(mapping == nullptr)
+    {
+        CloseHandle(file);
+        return nullptr;
+    }
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if(data == nullptr)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return nullptr;
+    }
+
+    MappedFile* m = new MappedFile();
+    m->data = (const u8*)data;
+    m->size = (u64)size.QuadPart;
+    m->file = file;
+    m->mapping = mapping;
+    return m;
+}
+
+void MappedFile::Close(MappedFile* file)
+{
+    if(file == nullptr) return;
+    UnmapViewOfFile(file->data);
+    CloseHandle((HANDLE)file->mapping);
+    CloseHandle((HANDLE)file->file);
+    delete file;
+}
+
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+MappedFile* MappedFile::Open(const std::string& filename)
+{
+    i32 fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) return nullptr;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    MappedFile* m = new MappedFile();
+    m->data = (const u8*)data;
+    m->size = (u64)st.st_size;
+    m->fd = fd;
+    return m;
+}
+
+void MappedFile::Close(MappedFile* file)
+{
+    if(file == nullptr) return;
+    munmap((void*)file->data, (size_t)file->size);
+    close(file->fd);
+    delete file;
+}
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+#include "../common.h"
+#include <string>
+
+// Read only memory mapping of a whole file
+struct MappedFile
+{
+    const u8* data = nullptr;
+    u64 size = 0;
+
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#else
+    i32 fd = -1;
+#endif
+
+    // Returns nullptr if the file can't be opened or is empty
+    static MappedFile* Open(const std::string& filename);
+    static void Close(MappedFile* file);
+};
@@ -0,0 +1,30 @@
+#pragma once
+#include "../common.h"
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace Memory
+{
+    // Size should be a multiple of alignment (required by aligned_alloc)
+    POSSIBLE_INLINE void* AlignedAlloc(size_t size, size_t alignment)
+    {
+        size = (size + alignment - 1) / alignment * alignment;
+#ifdef _WIN32
+        return _aligned_malloc(size, alignment);
+#else
+        return aligned_alloc(alignment, size);
+#endif
+    }
+
+    POSSIBLE_INLINE void AlignedFree(void* ptr)
+    {
+#ifdef _WIN32
+        _aligned_free(ptr);
+#else
+        free(ptr);
+#endif
+    }
+}